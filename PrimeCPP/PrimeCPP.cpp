@@ -10,125 +10,103 @@
 #include <cstring>
 #include <cmath>
 #include <vector>
+#include <memory>
+
+#include "../PrimeCPP_Common/buffer_arena.h"
+#include "../PrimeCPP_Common/fixed_sieve.h"
+#include "../PrimeCPP_Common/odd_bits.h"
+#include "../PrimeCPP_Common/popcount.h"
+#include "../PrimeCPP_Common/presieve.h"
+#include "PrimeCPP.h"
 
 using namespace std;
 using namespace std::chrono;
+using namespace primecpp;
 
-class prime_sieve
-{
-  private:
-
-      long sieveSize = 0;
-      vector<bool> Bits;
-      const std::map<const long long, const int> resultsDictionary = 
-      {
-            {          10LL, 4         },               // Historical data for validating our results - the number of primes
-            {         100LL, 25        },               // to be found under some limit, such as 168 primes under 1000
-            {        1000LL, 168       },
-            {       10000LL, 1229      },
-            {      100000LL, 9592      },
-            {     1000000LL, 78498     },
-            {    10000000LL, 664579    },
-            {   100000000LL, 5761455   },
-            {  1000000000LL, 50847534  },
-            { 10000000000LL, 455052511 },
-
-      };
-
-      bool validateResults()
-      {
-          auto result = resultsDictionary.find(sieveSize);
-          if (resultsDictionary.end() == result)
-              return false;
-          return result->second == countPrimes();
-      }
-
-   public:
-
-      prime_sieve(long n) 
-        : Bits(n, true), sieveSize(n)
-      {
-      }
-
-      ~prime_sieve()
-      {
-      }
-
-      void runSieve()
-      {
-          int factor = 3;
-          int q = (int) sqrt(sieveSize);
+// runEngine
+//
+// Runs one engine for five seconds and prints its results line, so engines can be compared run against run.  With
+// reuse, every pass sieves in the buffer the pass before it gave back instead of allocating a new one.
 
-          while (factor <= q)
-          {
-              for (int num = factor; num < sieveSize; num += 2)
-              {
-                  if (Bits[num])
-                  {
-                      factor = num;
-                      break;
-                  }
-              }
-              for (int num = factor * factor; num < sieveSize; num += factor * 2)
-                  Bits[num] = false;
-
-              factor += 2;
-          }
-      }
-
-      void printResults(bool showResults, double duration, int passes)
-      {
-          if (showResults)
-              printf("2, ");
-
-          int count = (sieveSize >= 2);                             // Starting count (2 is prime)
-          for (int num = 3; num <= sieveSize; num+=2)
-          {
-              if (Bits[num])
-              {
-                  if (showResults)
-                      printf("%d, ", num);
-                  count++;
-              }
-          }
-
-          if (showResults)
-              printf("\n");
+void runEngine(bool segmented, bool reuse)
+{
+    auto passes = 0;
+    auto tStart = steady_clock::now();
 
-          printf("Passes: %d, Time: %lf, Avg: %lf, Limit: %ld, Count1: %d, Count2: %d, Valid: %d\n", 
-                 passes,
-                 duration,
-                 duration / passes,
-                 sieveSize,
-                 count,
-                 countPrimes(),
-                 validateResults());
-      }
+    while (true)
+    {
+        prime_sieve sieve(1000000L, reuse ? &buffer_arena<uint64_t>::local() : nullptr);
+        if (segmented)
+            sieve.runSieveSegmented();
+        else
+            sieve.runSieve();
+        passes++;
+        if (duration_cast<seconds>(steady_clock::now() - tStart).count() >= 5)
+        {
+            sieve.printResults(false, duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000, passes,
+                               segmented ? "segmented" : "basic");
+            break;
+        }
+    } 
+}
 
-      int countPrimes()
-      {
-          int count =  (sieveSize >= 2);;
-          for (int i = 3; i < sieveSize; i+=2)
-              if (Bits[i])
-                  count++;
-          return count;
-      }
-};
+// runFixedEngine
+//
+// The same five second run with a fixed_sieve, compiled for exactly the 1000000 limit used above
 
-int main()
+void runFixedEngine()
 {
+    typedef fixed_sieve<1000000> sieve;
     auto passes = 0;
     auto tStart = steady_clock::now();
 
     while (true)
     {
-        prime_sieve sieve(1000000L);
-        sieve.runSieve();
+        std::unique_ptr<sieve> fixed(new sieve);
+        fixed->runSieve();
         passes++;
         if (duration_cast<seconds>(steady_clock::now() - tStart).count() >= 5)
         {
-            sieve.printResults(false, duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000, passes);
+            auto duration = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000;
+            printf("Passes: %d, Time: %lf, Avg: %lf, Limit: %ld, Count1: %d, Count2: %d, Valid: %d, Engine: %s, Buffers: %s\n", 
+                   passes,
+                   (double) duration,
+                   (double) duration / passes,
+                   1000000L,
+                   (int) fixed->countPrimes(),
+                   (int) fixed->countPrimes(),
+                   fixed->validateResults(),
+                   "fixed",
+                   "fixed");
             break;
         }
-    } 
+    }
+}
+
+int main(int argc, char **argv)
+{
+    // Optional engine name: basic (the default), segmented, fixed, or all to run each in turn; then optionally fresh
+    // (the default) or reuse, for where each pass gets its buffer
+
+    string engine = (argc > 1) ? argv[1] : "basic";
+    string buffers = (argc > 2) ? argv[2] : "fresh";
+
+    if (engine != "basic" && engine != "segmented" && engine != "fixed" && engine != "all")
+    {
+        fprintf(stderr, "Unknown engine: %s (expected basic, segmented, fixed or all)\n", engine.c_str());
+        return 1;
+    }
+
+    if (buffers != "fresh" && buffers != "reuse")
+    {
+        fprintf(stderr, "Unknown buffers: %s (expected fresh or reuse)\n", buffers.c_str());
+        return 1;
+    }
+
+    if (engine == "basic" || engine == "all")
+        runEngine(false, buffers == "reuse");
+    if (engine == "segmented" || engine == "all")
+        runEngine(true, buffers == "reuse");
+    if (engine == "fixed" || engine == "all")
+        runFixedEngine();
 }
@@ -0,0 +1,168 @@
+// ---------------------------------------------------------------------------
+// PrimeCPP.h : The original prime_sieve, shared by PrimeCPP and the benchmark harness
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+#include "../PrimeCPP_Common/buffer_arena.h"
+#include "../PrimeCPP_Common/cancel_token.h"
+#include "../PrimeCPP_Common/index_width.h"
+#include "../PrimeCPP_Common/odd_bits.h"
+#include "../PrimeCPP_Common/presieve.h"
+#include "../PrimeCPP_Common/prime_counts.h"
+#include "../PrimeCPP_Common/prime_writer.h"
+#include "../PrimeCPP_Common/segmented_sieve.h"
+
+// primecpp
+//
+// Dave's original sieve, in a namespace of its own so the benchmark harness can build it next to the others.
+
+namespace primecpp
+{
+
+using namespace std;
+
+const long SEGMENT_SIZE = 32 * 1024 * 16;                         // Numbers per block in the segmented sieve (32K of odd bits, one L1)
+
+class prime_sieve
+{
+  private:
+
+      uint64_t sieveSize = 0;                           // 64 bits everywhere; long is only 32 on Windows
+      odd_bits Bits;                                    // One bit per odd number, where 1==prime, 0==not
+      int64_t primeCount = -1;                          // Primes found, once countPrimes has counted them
+
+      bool validateResults()
+      {
+          uint64_t expected = 0;                        // Historical data, from prime_counts.h
+          return knownPrimeCount(sieveSize, expected) && expected == countPrimes();
+      }
+
+   public:
+
+      prime_sieve(uint64_t n, buffer_arena<uint64_t> *arena = nullptr) 
+        : sieveSize(n), Bits(n, oddPattern(), arena)           // Multiples of 3 to 13 are crossed off already
+      {
+          if (Bits.size())
+              Bits.clear(0);                            // One is not prime
+      }
+
+      ~prime_sieve()
+      {
+      }
+
+      // runSieve
+      //
+      // Given a token, polls it before each factor and stops once it's cancelled; returns the share of the pass done
+
+      double runSieve(const cancel_token *token = nullptr)
+      {
+          primeCount = -1;
+          uint64_t factor = oddPattern().nextPrime();
+          uint64_t q = isqrt(sieveSize);
+          double done = 0;                                      // factorWork of the factors crossed off, given a token
+
+          while (factor <= q)
+          {
+              factor = 2 * Bits.next(factor >> 1) + 1;          // The next number still standing, a word at a time
+              if (factor > q)
+                  break;
+              if (token)
+              {
+                  if (token->cancelled())
+                      return factorPassFraction(sieveSize, oddPattern().nextPrime(), done);
+                  done += factorWork(sieveSize, factor);
+              }
+              crossOff(Bits.data(), (factor * factor) >> 1, factor, Bits.size());   // Bit i is 2i+1, so odd
+                                                                                     // multiples are factor bits apart
+
+              factor += 2;
+          }
+          return 1.0;
+      }
+
+      // runSieveSegmented
+      //
+      // Produces the same array as runSieve, but crosses off one cache-sized block at a time instead of walking
+      // the whole array once per factor.  The factors themselves (up to sqrt(n)) are found first, and for each one
+      // we remember the next multiple to cross off so the following block can pick up where the last one stopped.
+      // Given a token, it is polled before each block; a pass it stops is credited with the multiples struck so far.
+
+      double runSieveSegmented(const cancel_token *token = nullptr)
+      {
+          primeCount = -1;
+          uint64_t q = isqrt(sieveSize);
+          vector<uint64_t> factors;
+          vector<uint64_t> multiples;
+
+          for (uint64_t factor = 2 * Bits.next(oddPattern().nextPrime() >> 1) + 1; factor <= q;
+               factor = 2 * Bits.next((factor >> 1) + 1) + 1)                 // Each number still standing, in turn
+          {
+              uint64_t num = factor * factor;
+              for (; num <= q; num += factor * 2)
+                  Bits.clear(num >> 1);
+
+              factors.push_back(factor);
+              multiples.push_back(num);
+          }
+
+          for (uint64_t low = q + 1; low < sieveSize; low += SEGMENT_SIZE)
+          {
+              if (isCancelled(token))
+              {
+                  double done = 0;
+                  for (size_t i = 0; i < factors.size(); i++)
+                      done += (double) (multiples[i] - factors[i] * factors[i]) / (2 * factors[i]);
+                  return factorPassFraction(sieveSize, oddPattern().nextPrime(), done);
+              }
+              uint64_t high = min(low + SEGMENT_SIZE, sieveSize);
+              for (size_t i = 0; i < factors.size(); i++)   // Bit j is 2j+1, so numbers below high are bits below high/2
+                  multiples[i] = 2 * crossOff(Bits.data(), multiples[i] >> 1, factors[i], high >> 1) + 1;
+          }
+          return 1.0;
+      }
+
+      void printResults(bool showResults, double duration, int passes, const char *engine = "basic")
+      {
+          uint64_t count = (sieveSize >= 2);                        // Starting count (2 is prime)
+          if (showResults)
+          {
+              prime_writer out(stdout);
+              out.write(2);
+              forEachSetBit(Bits.data(), 1, Bits.size(), [&](uint64_t i)
+              {
+                  out.write(2 * i + 1);
+                  count++;
+                  return true;
+              });
+          }
+          else
+          {
+              count = countPrimes();                                // Nothing to list, so no second scan to check it by
+          }
+
+          printf("Passes: %d, Time: %lf, Avg: %lf, Limit: %llu, Count1: %llu, Count2: %llu, Valid: %d, Engine: %s, Buffers: %s\n", 
+                 passes,
+                 duration,
+                 duration / passes,
+                 (unsigned long long) sieveSize,
+                 (unsigned long long) count,
+                 (unsigned long long) countPrimes(),
+                 validateResults(),
+                 engine,
+                 Bits.reused() ? "reused" : "fresh");
+      }
+
+      uint64_t countPrimes()
+      {
+          if (primeCount < 0)
+              primeCount = (sieveSize >= 2) + (int64_t) Bits.count();   // One is never set, so popcount the lot
+          return (uint64_t) primeCount;
+      }
+};
+
+} // namespace primecpp
@@ -0,0 +1,72 @@
+// ---------------------------------------------------------------------------
+// bit_scan.h : Finding the set bits of packed words a word at a time
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstdint>
+
+#include "popcount.h"
+
+// trailingZeros64
+//
+// The index of the lowest set bit of a nonzero word.  GCC and Clang turn the builtin into a single TZCNT (or BSF);
+// elsewhere the bits below the lowest set one are counted with popcount64.  (std::countr_zero is C++20, and the
+// builds here are C++17.)
+
+inline unsigned trailingZeros64(uint64_t w)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned) __builtin_ctzll(w);
+#else
+    return (unsigned) popcount64((w & (0 - w)) - 1);
+#endif
+}
+
+// nextSetBit
+//
+// The index of the first set bit at or past first and below last, bit i being bit i % 64 of word i / 64, or last
+// if there is none.  Words with nothing set are passed over one compare each, so a run of composites costs a word
+// per 128 numbers instead of a test per odd one.
+
+inline uint64_t nextSetBit(const uint64_t *words, uint64_t first, uint64_t last)
+{
+    if (first >= last)
+        return last;
+    uint64_t w = first / 64;
+    const uint64_t lastWord = (last - 1) / 64;
+    uint64_t word = words[w] & (~0ULL << (first % 64));
+    while (!word)
+    {
+        if (++w > lastWord)
+            return last;
+        word = words[w];
+    }
+    const uint64_t i = w * 64 + trailingZeros64(word);
+    return i < last ? i : last;
+}
+
+// forEachSetBit
+//
+// Calls fn(i) for each set bit i in [first, last), in order, until it returns false; returns false if it was
+// stopped.  Each word is read once, and each set bit in it found with trailingZeros64 and then dropped.
+
+template <typename Fn>
+inline bool forEachSetBit(const uint64_t *words, uint64_t first, uint64_t last, Fn &&fn)
+{
+    if (first >= last)
+        return true;
+    const uint64_t firstWord = first / 64, lastWord = (last - 1) / 64;
+    for (uint64_t w = firstWord; w <= lastWord; w++)
+    {
+        uint64_t word = words[w];
+        if (w == firstWord)
+            word &= ~0ULL << (first % 64);
+        if (w == lastWord)
+            word &= ~0ULL >> (63 - (last - 1) % 64);
+        for (; word; word &= word - 1)                          // Drop the lowest set bit each time round
+            if (!fn(w * 64 + trailingZeros64(word)))
+                return false;
+    }
+    return true;
+}
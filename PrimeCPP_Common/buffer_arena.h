@@ -0,0 +1,74 @@
+// ---------------------------------------------------------------------------
+// buffer_arena.h : Per-thread cache of sieve buffers reused from pass to pass
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "sieve_buffer.h"
+
+// buffer_arena
+//
+// Keeps the storage of sieves that have been torn down so the next sieve of the same size can take it over instead
+// of allocating again.  A freshly allocated 10^9-bit buffer costs a page fault for every 4K page on first touch, as
+// well as its zero-fill; a reused one is already mapped and resident, so resetting it is a plain fill at memory
+// bandwidth.  Each thread has its own arena (local()), so no locking is needed and a buffer stays with the thread,
+// and the memory, that first touched it.
+
+template <typename T>
+class buffer_arena
+{
+  private:
+
+      std::vector<sieve_buffer<T>> Free;                         // Buffers given back, ready to hand out again
+
+  public:
+
+      static const size_t MAX_BUFFERS = 4;                      // Beyond this, released buffers are just freed
+
+      // acquire
+      //
+      // A buffer of exactly count elements: a released one if there is one, a new one otherwise.  The contents of a
+      // reused buffer are whatever the last user left, and a new one's are uninitialized; callers fill it themselves.
+
+      sieve_buffer<T> acquire(size_t count)
+      {
+          for (size_t i = 0; i < Free.size(); i++)
+          {
+              if (Free[i].size() == count)
+              {
+                  sieve_buffer<T> buffer = std::move(Free[i]);
+                  Free.erase(Free.begin() + i);
+                  return buffer;
+              }
+          }
+          return sieve_buffer<T>(count);
+      }
+
+      void release(sieve_buffer<T> &&buffer)
+      {
+          if (buffer.empty())
+              return;
+          if (Free.size() >= MAX_BUFFERS)
+              Free.erase(Free.begin());
+          Free.push_back(std::move(buffer));
+      }
+
+      // clear
+      //
+      // Frees every buffer held, so the next acquire allocates afresh (with whatever pages are asked for by then)
+
+      void clear()
+      {
+          Free.clear();
+      }
+
+      static buffer_arena &local()
+      {
+          thread_local buffer_arena arena;
+          return arena;
+      }
+};
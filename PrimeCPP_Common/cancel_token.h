@@ -0,0 +1,148 @@
+// ---------------------------------------------------------------------------
+// cancel_token.h : Stopping a pass part way, at a deadline or on request, and crediting the part that was done
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// cancel_token
+//
+// A flag the owner raises with cancel(), or that raises itself once a deadline passes, for engines to poll where they
+// can stop cleanly: between segments for those that go a segment at a time, and between factors for those that go a
+// factor at a time.  A cancelled engine returns straight away, its array unfinished, with the share of the pass it
+// did, so a timed run can stop on its deadline and still count the last pass for what it was worth.
+//
+// Polling is a relaxed load and, while there is a deadline and it hasn't passed, a read of the clock; the first
+// poll past the deadline raises the flag, so the others skip the clock.  One token can be shared by every thread.
+
+class cancel_token
+{
+  private:
+
+      typedef std::chrono::steady_clock clock;
+
+      mutable std::atomic<bool> Cancelled;
+      std::atomic<clock::rep> Deadline;                         // Ticks since the clock's epoch; max for none
+
+  public:
+
+      cancel_token()
+        : Cancelled(false), Deadline(clock::duration::max().count())
+      {
+      }
+
+      explicit cancel_token(clock::time_point deadline)
+        : Cancelled(false), Deadline(deadline.time_since_epoch().count())
+      {
+      }
+
+      cancel_token(const cancel_token &) = delete;
+      cancel_token &operator=(const cancel_token &) = delete;
+
+      void cancel()
+      {
+          Cancelled.store(true, std::memory_order_relaxed);
+      }
+
+      void setDeadline(clock::time_point deadline)
+      {
+          Deadline.store(deadline.time_since_epoch().count(), std::memory_order_relaxed);
+      }
+
+      clock::time_point deadline() const
+      {
+          return clock::time_point(clock::duration(Deadline.load(std::memory_order_relaxed)));
+      }
+
+      bool cancelled() const
+      {
+          if (Cancelled.load(std::memory_order_relaxed))
+              return true;
+          const clock::rep deadline = Deadline.load(std::memory_order_relaxed);
+          if (deadline == clock::duration::max().count() || clock::now().time_since_epoch().count() < deadline)
+              return false;
+          Cancelled.store(true, std::memory_order_relaxed);
+          return true;
+      }
+};
+
+// isCancelled
+//
+// For engines that take an optional token: false without one
+
+inline bool isCancelled(const cancel_token *token)
+{
+    return token && token->cancelled();
+}
+
+// factorWork
+//
+// The share of a pass up to limit that crossing off factor p is: its odd multiples from p*p on, (limit - p*p) / 2p of
+// them.  A wheel only strikes the multiples coprime to its modulus, the same fraction of them for every p, so this
+// weighs factors against one another for every engine that goes a factor at a time.  The work of the whole pass,
+// every base prime's, is factorPassWork in segmented_sieve.h.
+
+inline double factorWork(uint64_t limit, uint64_t p)
+{
+    return p * p < limit ? (double) (limit - p * p) / (2.0 * (double) p) : 0.0;
+}
+
+// pass_tally
+//
+// The passes of a timed run, whole and stopped.  A whole pass counts one.  A pass the deadline stopped counts for its
+// share, and that share is taken by time, against the mean time of the whole passes: an engine takes much the same
+// time every pass, so that is exact.  Before any pass has finished the share the engine reports is all there is to
+// go on; it is close for the engines that go a block at a time, but for those that go a factor at a time it can be
+// out by half, as a multiple costs several times more once the strides outgrow the cache.
+
+class pass_tally
+{
+  private:
+
+      double Whole = 0;                                         // Passes that finished
+      double WholeSeconds = 0;                                  // ... and the time they took
+      double StoppedShare = 0;                                  // Shares of the passes that were stopped
+      double StoppedSeconds = 0;
+
+  public:
+
+      // Adds one pass, that got through share of its work in the given time
+
+      void add(double share, double seconds)
+      {
+          if (share >= 1.0)
+          {
+              Whole++;
+              WholeSeconds += seconds;
+          }
+          else
+          {
+              StoppedShare += share;
+              StoppedSeconds += seconds;
+          }
+      }
+
+      pass_tally &operator+=(const pass_tally &other)
+      {
+          Whole += other.Whole;
+          WholeSeconds += other.WholeSeconds;
+          StoppedShare += other.StoppedShare;
+          StoppedSeconds += other.StoppedSeconds;
+          return *this;
+      }
+
+      double whole() const
+      {
+          return Whole;
+      }
+
+      double passes() const
+      {
+          if (Whole && WholeSeconds > 0)
+              return Whole + StoppedSeconds * Whole / WholeSeconds;
+          return Whole + StoppedShare;
+      }
+};
@@ -0,0 +1,174 @@
+// ---------------------------------------------------------------------------
+// cross_off.h : Crossing off a factor's multiples from packed bit words
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// stride_masks
+//
+// For every odd step below 64, the bits t with t % step == 0 over one period of step words (64 * step bits), plus
+// the first word again so a mask can be read across the wrap.  A stride that starts anywhere hits the same bits,
+// shifted: the mask of each word of a run is two of these words and a funnel shift, worked out once per call.
+// The rows take 16K, built once on first use; a sieve only ever reads the rows of its own small primes.
+
+class stride_masks
+{
+  public:
+
+      static const uint64_t MAX_STEP = 63;
+
+  private:
+
+      uint64_t Words[(MAX_STEP + 1) / 2][MAX_STEP + 1];         // Row step/2 is the period of step
+
+      stride_masks()
+      {
+          for (uint64_t step = 1; step <= MAX_STEP; step += 2)
+          {
+              uint64_t *row = Words[step / 2];
+              for (uint64_t w = 0; w <= step; w++)
+                  row[w] = 0;
+              for (uint64_t t = 0; t < 64 * step; t += step)
+                  row[t / 64] |= 1ULL << (t % 64);
+              row[step] = row[0];
+          }
+      }
+
+  public:
+
+      static const stride_masks &get()
+      {
+          static const stride_masks masks;
+          return masks;
+      }
+
+      // phase
+      //
+      // The step masks of the words from word first / 64 on, for a stride through bit first: out[k] holds the bits of
+      // word first / 64 + k (for k up to step, then they repeat) that are first plus a multiple of step.  Bits below
+      // first in the first word come out set too, for the caller to mask off.
+
+      void phase(uint64_t first, uint64_t step, uint64_t *out) const
+      {
+          const uint64_t *row = Words[step / 2];
+          const uint64_t period = 64 * step;
+          const uint64_t at = (period - first % 64) % period;   // Word k is bits at + 64k of the row, cyclically, as
+          const uint64_t word = at / 64, shift = at % 64;       // the period is a multiple of both 64 and step
+          for (uint64_t k = 0; k < step; k++)
+          {
+              const uint64_t w = (word + k) % step;
+              out[k] = shift ? (row[w] >> shift) | (row[w + 1] << (64 - shift)) : row[w];
+          }
+      }
+};
+
+// crossOffMasked
+//
+// Clears bits first, first+step, ... below end with whole-word masks, through clearWord(word, mask), and returns the
+// first index at or past end.  For an odd step below 64 every word of the run has at least one hit, and the masks
+// repeat every step words, so this is one AND per word and no per-bit work at all.
+
+template <typename ClearWord>
+inline uint64_t crossOffMasked(uint64_t first, uint64_t step, uint64_t end, ClearWord clearWord)
+{
+    if (first >= end)
+        return first;
+    uint64_t masks[stride_masks::MAX_STEP];
+    stride_masks::get().phase(first, step, masks);
+
+    const uint64_t firstWord = first / 64, lastWord = (end - 1) / 64;
+    const uint64_t head = ~0ULL << (first % 64);
+    const uint64_t tail = ~0ULL >> (63 - (end - 1) % 64);
+    if (firstWord == lastWord)
+        clearWord(firstWord, masks[0] & head & tail);
+    else
+    {
+        clearWord(firstWord, masks[0] & head);
+        uint64_t k = 1 % step;
+        for (uint64_t w = firstWord + 1; w < lastWord; w++)
+        {
+            clearWord(w, masks[k]);
+            if (++k == step)
+                k = 0;
+        }
+        clearWord(lastWord, masks[k] & tail);
+    }
+    return first + (end - first + step - 1) / step * step;
+}
+
+// crossOffUnrolled
+//
+// Clears the same bits one at a time, eight strides to an iteration: eight independent read-modify-writes, whose
+// addresses don't depend on each other, for one loop test and one add.
+
+inline uint64_t crossOffUnrolled(uint64_t *words, uint64_t first, uint64_t step, uint64_t end)
+{
+    uint64_t i = first;
+    if (end > 7 * step)
+        for (const uint64_t stop = end - 7 * step; i < stop; i += 8 * step)
+        {
+            words[(i           ) / 64] &= ~(1ULL << ((i           ) % 64));
+            words[(i +     step) / 64] &= ~(1ULL << ((i +     step) % 64));
+            words[(i + 2 * step) / 64] &= ~(1ULL << ((i + 2 * step) % 64));
+            words[(i + 3 * step) / 64] &= ~(1ULL << ((i + 3 * step) % 64));
+            words[(i + 4 * step) / 64] &= ~(1ULL << ((i + 4 * step) % 64));
+            words[(i + 5 * step) / 64] &= ~(1ULL << ((i + 5 * step) % 64));
+            words[(i + 6 * step) / 64] &= ~(1ULL << ((i + 6 * step) % 64));
+            words[(i + 7 * step) / 64] &= ~(1ULL << ((i + 7 * step) % 64));
+        }
+    for (; i < end; i += step)
+        words[i / 64] &= ~(1ULL << (i % 64));
+    return i;
+}
+
+// usesMasks
+//
+// Whether crossOff takes the masked kernel for a step over a run of the given bits: the step has to be odd and below
+// 64, and the run long enough (four periods) that working out the masks costs less than the strikes it saves
+
+inline bool usesMasks(uint64_t step, uint64_t bits)
+{
+    return (step & 1) && step <= stride_masks::MAX_STEP && bits >= 4 * 64 * step;
+}
+
+// crossOff
+//
+// Clears bits first, first+step, ... below end of packed words (bit i is bit i % 64 of word i / 64), and returns the
+// first index at or past end, so a segmented sieve can carry it to the next block.  The kernel is picked per call:
+// word masks for small steps, the unrolled loop for the rest.
+
+inline uint64_t crossOff(uint64_t *words, uint64_t first, uint64_t step, uint64_t end)
+{
+    if (first < end && usesMasks(step, end - first))
+        return crossOffMasked(first, step, end, [words](uint64_t w, uint64_t mask) { words[w] &= ~mask; });
+    return crossOffUnrolled(words, first, step, end);
+}
+
+// crossOffBytes
+//
+// As crossOffUnrolled, for an array of one byte per candidate, in the caller's index type (see index_width.h).  The
+// unrolled loop only runs while all eight strikes fall below end, so the index never passes end by more than a step.
+
+template <typename Index, typename Byte>
+inline Index crossOffBytes(Byte *bytes, Index first, Index step, Index end)
+{
+    Index i = first;
+    if (end > 7 * step)
+        for (const Index stop = end - 7 * step; i < stop; i += 8 * step)
+        {
+            bytes[i           ] = 0;
+            bytes[i +     step] = 0;
+            bytes[i + 2 * step] = 0;
+            bytes[i + 3 * step] = 0;
+            bytes[i + 4 * step] = 0;
+            bytes[i + 5 * step] = 0;
+            bytes[i + 6 * step] = 0;
+            bytes[i + 7 * step] = 0;
+        }
+    for (; i < end; i += step)
+        bytes[i] = 0;
+    return i;
+}
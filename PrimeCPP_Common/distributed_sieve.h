@@ -0,0 +1,616 @@
+// ---------------------------------------------------------------------------
+// distributed_sieve.h : Sharding a range across worker processes over TCP and merging what they find
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "prime_counts.h"
+#include "range_sieve.h"
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// tcp_socket
+//
+// Just enough of a socket for the shard protocol: connect, listen, accept, and sending or receiving a whole buffer,
+// on POSIX sockets or Winsock.  Move-only, and closed when destroyed.
+
+class tcp_socket
+{
+  private:
+
+#if defined(_WIN32)
+      typedef SOCKET handle;
+      static handle none()              { return INVALID_SOCKET; }
+      static void closeHandle(handle h) { closesocket(h); }
+#else
+      typedef int handle;
+      static handle none()              { return -1; }
+      static void closeHandle(handle h) { ::close(h); }
+#endif
+
+      handle Handle = none();
+
+      explicit tcp_socket(handle h) : Handle(h) {}
+
+      static bool startup()
+      {
+#if defined(_WIN32)
+          static const bool started = []
+          {
+              WSADATA data;
+              return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+          }();
+          return started;
+#else
+          return true;
+#endif
+      }
+
+      static int sendFlags()
+      {
+#if defined(MSG_NOSIGNAL)
+          return MSG_NOSIGNAL;                                  // A worker that went away is an error, not a SIGPIPE
+#else
+          return 0;
+#endif
+      }
+
+      void setOptions()
+      {
+          int on = 1;
+          setsockopt(Handle, IPPROTO_TCP, TCP_NODELAY, (const char *) &on, sizeof(on));
+          setsockopt(Handle, SOL_SOCKET, SO_KEEPALIVE, (const char *) &on, sizeof(on));
+#if defined(SO_NOSIGPIPE)
+          setsockopt(Handle, SOL_SOCKET, SO_NOSIGPIPE, (const char *) &on, sizeof(on));
+#endif
+      }
+
+  public:
+
+      tcp_socket() = default;
+
+      ~tcp_socket()
+      {
+          close();
+      }
+
+      tcp_socket(tcp_socket &&other) : Handle(other.Handle)
+      {
+          other.Handle = none();
+      }
+
+      tcp_socket &operator=(tcp_socket &&other)
+      {
+          if (this != &other)
+          {
+              close();
+              Handle = other.Handle;
+              other.Handle = none();
+          }
+          return *this;
+      }
+
+      tcp_socket(const tcp_socket &) = delete;
+      tcp_socket &operator=(const tcp_socket &) = delete;
+
+      bool isOpen() const               { return Handle != none(); }
+
+      void close()
+      {
+          if (isOpen())
+              closeHandle(Handle);
+          Handle = none();
+      }
+
+      // connectTo
+      //
+      // Tries each address host resolves to in turn; the socket isn't open if none of them answered
+
+      static tcp_socket connectTo(const std::string &host, const std::string &port)
+      {
+          tcp_socket socket;
+          addrinfo hints = {}, *found = nullptr;
+          hints.ai_family = AF_UNSPEC;
+          hints.ai_socktype = SOCK_STREAM;
+          if (!startup() || getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0)
+              return socket;
+          for (addrinfo *a = found; a && !socket.isOpen(); a = a->ai_next)
+          {
+              socket.Handle = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+              if (socket.isOpen() && ::connect(socket.Handle, a->ai_addr, (int) a->ai_addrlen) != 0)
+                  socket.close();
+          }
+          freeaddrinfo(found);
+          if (socket.isOpen())
+              socket.setOptions();
+          return socket;
+      }
+
+      // listenOn
+      //
+      // A socket accepting connections on port, on every IPv4 interface
+
+      static tcp_socket listenOn(uint16_t port)
+      {
+          tcp_socket socket;
+          if (!startup())
+              return socket;
+          socket.Handle = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+          if (!socket.isOpen())
+              return socket;
+          int on = 1;
+          setsockopt(socket.Handle, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on));
+          sockaddr_in address = {};
+          address.sin_family = AF_INET;
+          address.sin_addr.s_addr = htonl(INADDR_ANY);
+          address.sin_port = htons(port);
+          if (::bind(socket.Handle, (const sockaddr *) &address, sizeof(address)) != 0 || ::listen(socket.Handle, 16) != 0)
+              socket.close();
+          return socket;
+      }
+
+      tcp_socket accept() const
+      {
+          tcp_socket socket(::accept(Handle, nullptr, nullptr));
+          if (socket.isOpen())
+              socket.setOptions();
+          return socket;
+      }
+
+      bool sendAll(const void *data, size_t bytes)
+      {
+          const char *p = (const char *) data;
+          while (bytes)
+          {
+              const auto sent = ::send(Handle, p, (int) std::min<size_t>(bytes, 1 << 30), sendFlags());
+              if (sent <= 0)
+                  return false;
+              p += sent;
+              bytes -= (size_t) sent;
+          }
+          return true;
+      }
+
+      bool receiveAll(void *data, size_t bytes)
+      {
+          char *p = (char *) data;
+          while (bytes)
+          {
+              const auto received = ::recv(Handle, p, (int) std::min<size_t>(bytes, 1 << 30), 0);
+              if (received <= 0)
+                  return false;
+              p += received;
+              bytes -= (size_t) received;
+          }
+          return true;
+      }
+};
+
+// The shard protocol
+//
+// The coordinator sends a request, the worker sieves it and sends back a reply, and so on over one connection for as
+// many shards as the coordinator has for it.  Every field is a little-endian integer at a fixed offset:
+//
+//   request   magic "PRIMESHD", version u32, flags u32 (zero), lo u64, hi u64, stride u64                  40 bytes
+//   reply     magic "PRIMESHD", version u32, status u32, lo u64, hi u64, count u64, checkpoints u64        48 bytes
+//             then checkpoints u64 counts
+//
+// A shard is the numbers [lo, hi) and count the primes among them.  With a stride, the reply also splits count into
+// the primes of each stride of numbers from lo in turn (the last one perhaps short), so the coordinator can merge
+// them into pi(x) at every multiple of the stride, not only at the ends of shards.  status is SHARD_OK, or
+// SHARD_REFUSED for a request the worker won't sieve, after which it closes the connection.
+
+const char     SHARD_MAGIC[8]          = { 'P', 'R', 'I', 'M', 'E', 'S', 'H', 'D' };
+const uint32_t SHARD_PROTOCOL_VERSION  = 1;
+const size_t   SHARD_REQUEST_BYTES     = 40;
+const size_t   SHARD_REPLY_BYTES       = 48;
+const uint32_t SHARD_OK                = 0;
+const uint32_t SHARD_REFUSED           = 1;
+const uint64_t SHARD_MAX_CHECKPOINTS   = 1 << 24;               // 128MB of reply, a bound against a bad request
+const uint64_t SHARD_WINDOW            = 1ULL << 27;            // Numbers a worker sieves at once, 8MB of bits
+
+struct shard_request
+{
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t stride;                                            // Zero for just the count
+};
+
+struct shard_result
+{
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+    uint64_t count = 0;
+    std::vector<uint64_t> checkpoints;                          // Primes in each stride of [lo, hi), with a stride
+};
+
+inline void putLittle(unsigned char *out, uint64_t value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++)
+        out[i] = (unsigned char) (value >> (8 * i));
+}
+
+inline uint64_t getLittle(const unsigned char *in, size_t bytes)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++)
+        value |= (uint64_t) in[i] << (8 * i);
+    return value;
+}
+
+// The number of strides a shard's checkpoints split it into
+
+inline uint64_t shardCheckpoints(const shard_request &request)
+{
+    if (!request.stride || request.hi <= request.lo)
+        return 0;
+    return (request.hi - request.lo - 1) / request.stride + 1;
+}
+
+// sieveShard
+//
+// Sieves one shard through sieve, a window of at most SHARD_WINDOW numbers at a time, so a worker's memory doesn't
+// grow with the shard and its base primes carry over from one shard to the next
+
+inline shard_result sieveShard(range_sieve &sieve, const shard_request &request)
+{
+    shard_result result;
+    result.lo = request.lo;
+    result.hi = std::max(request.lo, request.hi);
+    const uint64_t stride = request.stride ? request.stride : std::max<uint64_t>(result.hi - result.lo, 1);
+    sieve.reserve(result.hi);
+
+    for (uint64_t block = result.lo; block < result.hi; )
+    {
+        const uint64_t blockHi = block + std::min(stride, result.hi - block);
+        uint64_t primes = 0;
+        for (uint64_t lo = block; lo < blockHi; )
+        {
+            const uint64_t hi = lo + std::min(SHARD_WINDOW, blockHi - lo);
+            sieve.sieve(lo, hi);
+            primes += sieve.count();
+            lo = hi;
+        }
+        result.count += primes;
+        if (request.stride)
+            result.checkpoints.push_back(primes);
+        block = blockHi;
+    }
+    return result;
+}
+
+// shard_worker
+//
+// The worker side: listens on a port and serves each connection on a thread of its own, with a range_sieve of its
+// own, so one worker process can run as many shards at once as coordinators (or connections from one coordinator)
+// ask of it.  serve() doesn't return.
+
+class shard_worker
+{
+  private:
+
+      tcp_socket Listener;
+      const char *Error = "not listening";
+
+      static void serveConnection(tcp_socket socket)
+      {
+          range_sieve sieve;
+          unsigned char header[SHARD_REQUEST_BYTES];
+          while (socket.receiveAll(header, sizeof(header)))
+          {
+              shard_request request;
+              request.lo     = getLittle(header + 16, 8);
+              request.hi     = getLittle(header + 24, 8);
+              request.stride = getLittle(header + 32, 8);
+              const bool valid = memcmp(header, SHARD_MAGIC, sizeof(SHARD_MAGIC)) == 0 &&
+                                 getLittle(header + 8, 4) == SHARD_PROTOCOL_VERSION &&
+                                 request.lo <= request.hi &&
+                                 shardCheckpoints(request) <= SHARD_MAX_CHECKPOINTS;
+
+              shard_result result;
+              if (valid)
+                  result = sieveShard(sieve, request);
+
+              std::vector<unsigned char> reply(SHARD_REPLY_BYTES + result.checkpoints.size() * sizeof(uint64_t));
+              memcpy(reply.data(), SHARD_MAGIC, sizeof(SHARD_MAGIC));
+              putLittle(reply.data() + 8, SHARD_PROTOCOL_VERSION, 4);
+              putLittle(reply.data() + 12, valid ? SHARD_OK : SHARD_REFUSED, 4);
+              putLittle(reply.data() + 16, request.lo, 8);
+              putLittle(reply.data() + 24, request.hi, 8);
+              putLittle(reply.data() + 32, result.count, 8);
+              putLittle(reply.data() + 40, result.checkpoints.size(), 8);
+              for (size_t i = 0; i < result.checkpoints.size(); i++)
+                  putLittle(reply.data() + SHARD_REPLY_BYTES + i * sizeof(uint64_t), result.checkpoints[i], 8);
+              if (!socket.sendAll(reply.data(), reply.size()) || !valid)
+                  return;
+          }
+      }
+
+  public:
+
+      bool listen(uint16_t port)
+      {
+          Listener = tcp_socket::listenOn(port);
+          Error = Listener.isOpen() ? nullptr : "cannot listen on port";
+          return Listener.isOpen();
+      }
+
+      const char *error() const         { return Error ? Error : "none"; }
+
+      void serve()
+      {
+          while (Listener.isOpen())
+          {
+              tcp_socket socket = Listener.accept();
+              if (socket.isOpen())
+                  std::thread(serveConnection, std::move(socket)).detach();
+          }
+      }
+};
+
+// shard_coordinator
+//
+// The coordinator side: splits [lo, hi) into shards and hands them out to workers ("host:port", or "local" for a
+// thread of this process) as each finishes its last, one connection per address, so faster nodes take more shards.
+// List an address more than once to keep several of that worker's cores busy.  A worker whose connection fails is
+// dropped and its shard given to another; run() fails only if every worker has gone and shards are left.
+//
+// The shards come back in any order and are merged in order of lo: count() is the primes in [lo, hi) and
+// checkpoints() pi(x) - pi(lo) at every shard boundary, and with a stride at every multiple of it from lo, for as
+// fine an index of the range as the nightly check wants.  validate() compares those with PRIME_COUNTS wherever the
+// table has the x, which for a range from zero by shards of a power of ten is every power of ten up to hi.
+
+class shard_coordinator
+{
+  public:
+
+      struct worker_stats
+      {
+          std::string address;
+          uint64_t shards = 0;
+          double busy = 0;                                      // Seconds from sending each request to its reply
+          bool failed = false;
+      };
+
+  private:
+
+      std::vector<worker_stats> Workers;
+      std::vector<shard_result> Results;
+      uint64_t Lo = 0;
+      uint64_t Hi = 0;
+      uint64_t Stride = 0;
+      const char *Error = "not run";
+
+      // Sends a request down socket and waits for its reply, which must answer that request and no other
+
+      static bool requestShard(tcp_socket &socket, const shard_request &request, shard_result &result)
+      {
+          unsigned char header[SHARD_REPLY_BYTES];
+          memcpy(header, SHARD_MAGIC, sizeof(SHARD_MAGIC));
+          putLittle(header + 8, SHARD_PROTOCOL_VERSION, 4);
+          putLittle(header + 12, 0, 4);
+          putLittle(header + 16, request.lo, 8);
+          putLittle(header + 24, request.hi, 8);
+          putLittle(header + 32, request.stride, 8);
+          if (!socket.sendAll(header, SHARD_REQUEST_BYTES) || !socket.receiveAll(header, SHARD_REPLY_BYTES))
+              return false;
+
+          const uint64_t checkpoints = getLittle(header + 40, 8);
+          if (memcmp(header, SHARD_MAGIC, sizeof(SHARD_MAGIC)) != 0 ||
+              getLittle(header + 8, 4) != SHARD_PROTOCOL_VERSION || getLittle(header + 12, 4) != SHARD_OK ||
+              getLittle(header + 16, 8) != request.lo || getLittle(header + 24, 8) != request.hi ||
+              checkpoints != shardCheckpoints(request))
+              return false;
+
+          result.lo = request.lo;
+          result.hi = request.hi;
+          result.count = getLittle(header + 32, 8);
+          std::vector<unsigned char> counts((size_t) checkpoints * sizeof(uint64_t));
+          if (!socket.receiveAll(counts.data(), counts.size()))
+              return false;
+          result.checkpoints.resize((size_t) checkpoints);
+          uint64_t total = 0;
+          for (size_t i = 0; i < result.checkpoints.size(); i++)
+              total += result.checkpoints[i] = getLittle(counts.data() + i * sizeof(uint64_t), 8);
+          return !request.stride || total == result.count;
+      }
+
+  public:
+
+      explicit shard_coordinator(const std::vector<std::string> &workers)
+      {
+          for (const auto &address : workers)
+          {
+              worker_stats stats;
+              stats.address = address;
+              Workers.push_back(stats);
+          }
+      }
+
+      // run
+      //
+      // Sieves [lo, hi) in shards of shardNumbers (rounded up to a whole number of strides), and waits for them all
+
+      bool run(uint64_t lo, uint64_t hi, uint64_t shardNumbers, uint64_t stride = 0)
+      {
+          Lo = lo;
+          Hi = std::max(lo, hi);
+          Stride = stride;
+          Results.clear();
+          if (Workers.empty())
+          {
+              Error = "no workers";
+              return false;
+          }
+          shardNumbers = std::max<uint64_t>(shardNumbers, 1);
+          if (stride)
+              shardNumbers = (shardNumbers + stride - 1) / stride * stride;
+          for (uint64_t start = Lo; start < Hi; start += std::min(shardNumbers, Hi - start))
+              Results.push_back({ start, start + std::min(shardNumbers, Hi - start), 0, {} });
+
+          std::mutex lock;
+          std::condition_variable changed;
+          std::deque<size_t> pending;
+          size_t inFlight = 0;
+          for (size_t i = 0; i < Results.size(); i++)
+              pending.push_back(i);
+
+          auto work = [&](size_t w)
+          {
+              worker_stats &stats = Workers[w];
+              const bool isLocal = stats.address == "local";
+              range_sieve sieve;
+              tcp_socket socket;
+              if (!isLocal)
+              {
+                  const auto colon = stats.address.rfind(':');
+                  if (colon != std::string::npos)
+                      socket = tcp_socket::connectTo(stats.address.substr(0, colon), stats.address.substr(colon + 1));
+                  if (!socket.isOpen())
+                  {
+                      std::lock_guard<std::mutex> guard(lock);
+                      stats.failed = true;
+                      return;
+                  }
+              }
+
+              for (;;)
+              {
+                  size_t shard;
+                  {
+                      std::unique_lock<std::mutex> guard(lock);
+                      changed.wait(guard, [&] { return !pending.empty() || inFlight == 0; });
+                      if (pending.empty())
+                          return;
+                      shard = pending.front();
+                      pending.pop_front();
+                      inFlight++;
+                  }
+
+                  const shard_request request = { Results[shard].lo, Results[shard].hi, Stride };
+                  shard_result result;
+                  const auto tStart = std::chrono::steady_clock::now();
+                  bool ok = true;
+                  if (isLocal)
+                      result = sieveShard(sieve, request);
+                  else
+                      ok = requestShard(socket, request, result);
+                  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+
+                  std::lock_guard<std::mutex> guard(lock);
+                  inFlight--;
+                  if (ok)
+                  {
+                      Results[shard] = std::move(result);
+                      stats.shards++;
+                      stats.busy += seconds;
+                  }
+                  else
+                  {
+                      pending.push_front(shard);                // For someone else, and this worker is done
+                      stats.failed = true;
+                  }
+                  changed.notify_all();
+                  if (!ok)
+                      return;
+              }
+          };
+
+          std::vector<std::thread> threads;
+          for (size_t w = 0; w < Workers.size(); w++)
+              threads.emplace_back(work, w);
+          for (auto &t : threads)
+              t.join();
+
+          Error = pending.empty() ? nullptr : "every worker failed";
+          return Error == nullptr;
+      }
+
+      const char *error() const                         { return Error ? Error : "none"; }
+      const std::vector<worker_stats> &workers() const  { return Workers; }
+      const std::vector<shard_result> &shards() const   { return Results; }
+
+      uint64_t count() const
+      {
+          uint64_t total = 0;
+          for (const auto &r : Results)
+              total += r.count;
+          return total;
+      }
+
+      // checkpoints
+      //
+      // The merged index: for each x at the end of a shard or stride, in order, the primes in [lo, x)
+
+      std::vector<prime_count> checkpoints() const
+      {
+          std::vector<prime_count> merged;
+          uint64_t total = 0;
+          for (const auto &r : Results)
+          {
+              if (r.checkpoints.empty())
+              {
+                  total += r.count;
+                  merged.push_back({ r.hi, total });
+                  continue;
+              }
+              for (size_t i = 0; i < r.checkpoints.size(); i++)
+              {
+                  total += r.checkpoints[i];
+                  merged.push_back({ std::min(r.lo + (i + 1) * Stride, r.hi), total });
+              }
+          }
+          return merged;
+      }
+
+      // validate
+      //
+      // False if a checkpoint PRIME_COUNTS knows the count for has a different one; checked says how many it knew.
+      // Only a range starting at zero (or one or two) counts the same primes the table does, so others check nothing.
+
+      bool validate(size_t &checked) const
+      {
+          checked = 0;
+          if (Error || Lo > 2)
+              return !Error;
+          for (const auto &point : checkpoints())
+          {
+              uint64_t expected = 0;
+              if (knownPrimeCount(point.limit, expected))
+              {
+                  if (expected != point.count)
+                      return false;
+                  checked++;
+              }
+          }
+          return true;
+      }
+};
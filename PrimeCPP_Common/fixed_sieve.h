@@ -0,0 +1,513 @@
+// ---------------------------------------------------------------------------
+// fixed_sieve.h : Sieves specialized at compile time on limit, storage and wheel
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "bit_scan.h"
+#include "cancel_token.h"
+#include "perf_counters.h"
+#include "popcount.h"
+#include "presieve.h"
+#include "prime_counts.h"
+#include "prime_writer.h"
+#include "segmented_sieve.h"
+#include "sieve_buffer.h"
+#include "wheel_sieve.h"
+
+// wheel2
+//
+// The odd-only layout, seen as the smallest wheel: one residue (1) out of every 2 numbers, so bit b is 2*b+1 just
+// like odd_bits.  The wheel30 and wheel210 traits come from wheel_sieve.h.
+
+struct wheel2
+{
+    static constexpr uint64_t MODULUS = 2;
+    static constexpr const char *NAME = "odd";
+};
+
+// floorSqrt
+//
+// The largest r with r*r <= n, worked out exactly (no floating point) so it can be a compile-time constant
+
+constexpr uint64_t floorSqrt(uint64_t n)
+{
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+    while (bit > n)
+        bit >>= 2;
+    while (bit)
+    {
+        if (n >= root + bit)
+        {
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+            root >>= 1;
+        bit >>= 2;
+    }
+    return root;
+}
+
+// wheelSpokes, wheelResidues, wheelIndexOf, wheelGaps, wheelTargets, wheelCarries
+//
+// The same tables wheel_tables builds at run time (see wheel_sieve.h for what they mean), built by the compiler
+// instead, so their sizes are constants and the crossing-off loop can be unrolled over a whole turn of the wheel.
+
+constexpr bool wheelCoprime(uint64_t r, uint64_t m)
+{
+    while (m)
+    {
+        const uint64_t t = r % m;
+        r = m;
+        m = t;
+    }
+    return r == 1;
+}
+
+template <uint64_t M>
+constexpr size_t wheelSpokes()
+{
+    size_t k = 0;
+    for (uint64_t r = 1; r < M; r++)
+        k += wheelCoprime(r, M);
+    return k;
+}
+
+template <uint64_t M>
+constexpr std::array<uint64_t, wheelSpokes<M>()> wheelResidues()
+{
+    std::array<uint64_t, wheelSpokes<M>()> residues {};
+    size_t k = 0;
+    for (uint64_t r = 1; r < M; r++)
+        if (wheelCoprime(r, M))
+            residues[k++] = r;
+    return residues;
+}
+
+template <uint64_t M>
+constexpr std::array<int, M> wheelIndexOf()
+{
+    std::array<int, M> index {};
+    int k = 0;
+    for (uint64_t r = 0; r < M; r++)
+        index[r] = wheelCoprime(r, M) ? k++ : -1;
+    return index;
+}
+
+template <uint64_t M>
+constexpr std::array<uint64_t, wheelSpokes<M>()> wheelGaps()
+{
+    constexpr size_t K = wheelSpokes<M>();
+    constexpr auto R = wheelResidues<M>();
+    std::array<uint64_t, K> gap {};
+    for (size_t m = 0; m < K; m++)
+        gap[m] = (m + 1 < K ? R[m + 1] : R[0] + M) - R[m];
+    return gap;
+}
+
+template <uint64_t M>
+constexpr std::array<uint32_t, wheelSpokes<M>() * wheelSpokes<M>()> wheelTargets()
+{
+    constexpr size_t K = wheelSpokes<M>();
+    constexpr auto R = wheelResidues<M>();
+    constexpr auto index = wheelIndexOf<M>();
+    std::array<uint32_t, K * K> target {};
+    for (size_t j = 0; j < K; j++)
+        for (size_t m = 0; m < K; m++)
+            target[j * K + m] = (uint32_t) index[(R[j] * R[m]) % M];
+    return target;
+}
+
+template <uint64_t M>
+constexpr std::array<uint32_t, wheelSpokes<M>() * wheelSpokes<M>()> wheelCarries()
+{
+    constexpr size_t K = wheelSpokes<M>();
+    constexpr auto R = wheelResidues<M>();
+    constexpr auto gap = wheelGaps<M>();
+    std::array<uint32_t, K * K> carry {};
+    for (size_t j = 0; j < K; j++)
+        for (size_t m = 0; m < K; m++)
+            carry[j * K + m] = (uint32_t) (((R[j] * R[m]) % M + R[j] * gap[m]) / M);
+    return carry;
+}
+
+// wheelPrimesBelow
+//
+// How many of the primes dividing M (the ones the wheel never stores) are below limit
+
+template <uint64_t M>
+constexpr uint64_t wheelPrimesBelow(uint64_t limit)
+{
+    uint64_t count = 0;
+    for (uint64_t p = 2; p <= M; p++)
+    {
+        bool prime = (M % p == 0);
+        for (uint64_t d = 2; prime && d * d <= p; d++)
+            prime = (p % d != 0);
+        count += prime && p < limit;
+    }
+    return count;
+}
+
+// presievePatternFor
+//
+// The presieve pattern laid out for a wheel's bits
+
+inline const presieve_pattern &presievePatternFor(wheel2)
+{
+    return oddPattern();
+}
+
+template <typename Wheel>
+const presieve_pattern &presievePatternFor(Wheel)
+{
+    return wheel_tables<Wheel>::get().Pattern;
+}
+
+// keepStores
+//
+// Tells the compiler that everything written through p may still be read.  A fixed_sieve has no pointers hiding
+// its array, so when one is built, run and destroyed in a benchmark loop without its results ever being looked at,
+// the compiler can prove all of the crossing off is dead and drop it; this keeps the work in.
+
+inline void keepStores(const void *p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r"(p) : "memory");
+#else
+    static const void *volatile sink;
+    sink = p;
+#endif
+}
+
+// packed_bits, byte_flags
+//
+// Storage for a fixed number of candidates: one bit each, packed 64 to a word, or one byte each.  Both are plain
+// std::arrays, so the compiler knows every size and bound; and neither is initialized when built, since fill()
+// writes all of it straight away.
+
+struct packed_bits
+{
+    static constexpr const char *SUFFIX = "";
+
+    template <uint64_t N>
+    class array
+    {
+      private:
+
+          std::array<uint64_t, (N + 63) / 64> Words;
+
+      public:
+
+          bool test(uint64_t i) const    { return (Words[i / 64] >> (i % 64)) & 1; }
+          void clear(uint64_t i)         { Words[i / 64] &= ~(1ULL << (i % 64)); }
+          uint64_t count() const         { return popcountWords(Words.data(), Words.size()); }
+
+          void fill(const presieve_pattern &pattern)
+          {
+              pattern.fill(Words.data(), 0, Words.size());
+              if (N % 64)
+                  Words.back() &= (1ULL << (N % 64)) - 1;
+          }
+
+          // Calls fn(i) for each set i, in order, a word at a time
+
+          template <typename Fn>
+          void forEachSet(Fn &&fn) const
+          {
+              forEachSetBit(Words.data(), 0, N, [&](uint64_t i) { fn(i); return true; });
+          }
+    };
+};
+
+struct byte_flags
+{
+    static constexpr const char *SUFFIX = "-bytes";
+
+    template <uint64_t N>
+    class array
+    {
+      private:
+
+          std::array<uint8_t, N> Bytes;
+
+      public:
+
+          bool test(uint64_t i) const    { return Bytes[i] != 0; }
+          void clear(uint64_t i)         { Bytes[i] = 0; }
+          uint64_t count() const         { return popcountBytes((const char *) Bytes.data(), N); }
+
+          void fill(const presieve_pattern &pattern)
+          {
+              uint64_t chunk[64];                               // The pattern is made a chunk of words at a time
+              for (uint64_t i = 0; i < N; i += 64 * 64)
+              {
+                  pattern.fill(chunk, i / 64, 64);
+                  for (uint64_t b = i; b < N && b < i + 64 * 64; b++)
+                      Bytes[b] = (chunk[(b - i) / 64] >> (b % 64)) & 1;
+              }
+          }
+
+          template <typename Fn>
+          void forEachSet(Fn &&fn) const
+          {
+              for (uint64_t i = 0; i < N; i++)
+                  if (Bytes[i])
+                      fn(i);
+          }
+    };
+};
+
+// fixed_sieve
+//
+// A sieve whose limit, storage and wheel are all template arguments.  The array is a std::array of exactly the
+// right size, sqrt(Limit) and the expected count are constants, and crossing off walks the wheel a whole turn (K
+// multiples, whose offsets from one another are the same every turn) per iteration, unrolled at compile time.  The
+// public interface matches prime_sieve, so it can be benchmarked next to it.
+//
+// Being large, a fixed_sieve belongs on the heap (huge pages, if asked for); withFixedLimit() picks the
+// instantiation for a run-time limit.
+
+template <uint64_t Limit, typename Storage = packed_bits, typename Wheel = wheel2>
+class fixed_sieve
+{
+  private:
+
+      static constexpr uint64_t M = Wheel::MODULUS;
+      static constexpr size_t K = wheelSpokes<M>();
+      static constexpr uint64_t BLOCKS = (Limit + M - 1) / M;   // Blocks of M numbers, rounded up
+      static constexpr uint64_t BITS = BLOCKS * K;
+      static constexpr uint64_t ROOT = floorSqrt(Limit - 1);    // Factors p need p*p < Limit
+      static constexpr uint64_t EXPECTED = expectedPrimeCount(Limit);
+
+      static constexpr std::array<uint64_t, K> RESIDUES = wheelResidues<M>();
+      static constexpr std::array<int, M> INDEX_OF = wheelIndexOf<M>();
+      static constexpr std::array<uint64_t, K> GAPS = wheelGaps<M>();
+      static constexpr std::array<uint32_t, K * K> TARGETS = wheelTargets<M>();
+      static constexpr std::array<uint32_t, K * K> CARRIES = wheelCarries<M>();
+
+      static_assert(EXPECTED != 0, "fixed_sieve needs a limit with a known prime count");
+
+      typename Storage::template array<BITS> Bits;
+      mutable uint64_t Count = 0;                               // Primes found, once countPrimes has counted them
+      mutable bool Counted = false;
+
+      static uint64_t numberOf(uint64_t bit)                    { return M * (bit / K) + RESIDUES[bit % K]; }
+
+      template <size_t... S>
+      void clearTurn(uint64_t base, const uint64_t *offsets, std::index_sequence<S...>)
+      {
+          (Bits.clear(base + offsets[S]), ...);
+      }
+
+      // crossOff
+      //
+      // Clears every multiple p*q with q >= p and q coprime to M, where p = M*i + R[j].  One turn of the wheel moves
+      // every multiple on by exactly p blocks, so the K offsets within a turn are worked out once and reused.
+
+      void crossOff(uint64_t i, size_t j)
+      {
+          const uint64_t p = M * i + RESIDUES[j];
+
+          uint64_t offsets[K];
+          uint64_t delta = 0;
+          for (size_t s = 0, m = j; s < K; s++, m = (m + 1 == K) ? 0 : m + 1)
+          {
+              offsets[s] = delta * K + TARGETS[j * K + m];
+              delta += i * GAPS[m] + CARRIES[j * K + m];
+          }
+
+          uint64_t base = (p * p) / M * K;
+          for (; base + offsets[K - 1] < BITS; base += p * K)
+              clearTurn(base, offsets, std::make_index_sequence<K>());
+          for (size_t s = 0; s < K && base + offsets[s] < BITS; s++)
+              Bits.clear(base + offsets[s]);
+      }
+
+  public:
+
+      // Sieves are new'd one at a time, and a big one is placed on whatever pages sieve_pages was asked for.  All of
+      // them, big or small, come from and go back to sieve_pages, which owns the fallback to the heap.
+
+      static void *operator new(size_t bytes)
+      {
+          return sieve_pages::get().allocate(bytes);
+      }
+
+      static void operator delete(void *p, size_t)
+      {
+          sieve_pages::get().release(p);
+      }
+
+      fixed_sieve()
+      {
+          Bits.fill(presievePatternFor(Wheel()));               // Candidates, less the presieved small primes
+          for (size_t k = 0; BLOCKS && k < K; k++)
+              if ((BLOCKS - 1) * M + RESIDUES[k] >= Limit)
+                  Bits.clear((BLOCKS - 1) * K + k);             // Past the limit within the last block
+          if (BITS)
+              Bits.clear(0);                                    // One is not prime
+      }
+
+      // runSieve
+      //
+      // Walk the stored candidates past the presieved ones up to sqrt(Limit); each one still set is prime, so cross
+      // off its multiples.  Given a token, it is polled before each factor; returns the share of the pass done, one
+      // unless the token was cancelled first.
+
+      double runSieve(const cancel_token *token = nullptr)
+      {
+          Counted = false;
+          const uint64_t first = presievePatternFor(Wheel()).nextPrime();
+          double done = 0;                                      // factorWork of the factors crossed off, given a token
+          for (uint64_t bit = (first / M) * K; bit < BITS; bit++)
+          {
+              const uint64_t p = numberOf(bit);
+              if (p > ROOT)
+                  break;
+              if (p >= first && Bits.test(bit))
+              {
+                  if (token)
+                  {
+                      if (token->cancelled())
+                      {
+                          keepStores(&Bits);
+                          return factorPassFraction(Limit, first, done);
+                      }
+                      done += factorWork(Limit, p);
+                  }
+                  crossOff(bit / K, bit % K);
+              }
+          }
+          keepStores(&Bits);
+          return 1.0;
+      }
+
+      // countPrimes
+      //
+      // Can be called after runSieve to determine how many primes were found in total; counted once, then kept
+
+      size_t countPrimes() const
+      {
+          if (!Counted)
+          {
+              Count = wheelPrimesBelow<M>(Limit) + Bits.count();
+              Counted = true;
+          }
+          return Count;
+      }
+
+      // isPrime
+      //
+      // Can be called after runSieve to determine whether a given number (below the limit) is prime.
+
+      bool isPrime(uint64_t n) const
+      {
+          if (INDEX_OF[n % M] < 0)
+              return n <= M && wheelPrimesBelow<M>(n + 1) != wheelPrimesBelow<M>(n);
+          return Bits.test((n / M) * K + INDEX_OF[n % M]);
+      }
+
+      // validateResults
+      //
+      // Checks the count against the one looked up when the sieve was compiled
+
+      bool validateResults() const
+      {
+          return countPrimes() == EXPECTED;
+      }
+
+      // printResults
+      //
+      // Displays stats about what was found as well as (optionally) the primes themselves, and the hardware counters
+      // of each thread over the timed passes when there are some
+
+      void printResults(bool showResults, double duration, double passes, size_t threads,
+                        const std::vector<perf_sample> *counters = nullptr) const
+      {
+          size_t count = 0;                                     // Primes listed, when they are, to check the count by
+          if (showResults)
+          {
+              prime_writer out(stdout);
+              for (uint64_t n = 2; n <= M && n < Limit; n++)
+              {
+                  if (INDEX_OF[n % M] < 0 && isPrime(n))
+                  {
+                      out.write(n);
+                      count++;
+                  }
+              }
+              Bits.forEachSet([&](uint64_t bit)
+              {
+                  out.write(numberOf(bit));
+                  count++;
+              });
+          }
+          else
+          {
+              count = countPrimes();
+          }
+
+          std::cout << "Passes: "  << passes << ", "
+                    << "Threads: " << threads << ", "
+                    << "Time: "    << duration << ", "
+                    << "Average: " << duration/passes << ", "
+                    << "Limit: "   << Limit << ", "
+                    << "Counts: "  << count << "/" << countPrimes() << ", "
+                    << "Valid : "  << (validateResults() ? "Pass" : "FAIL!") << ", "
+                    << "Engine: "  << "fixed-" << Wheel::NAME << Storage::SUFFIX << ", "
+                    << "Buffers: " << "fixed"
+                    << "\n";
+
+          if (counters)
+              printCounters(*counters, passes);
+      }
+};
+
+// FIXED_LIMIT_MAX
+//
+// The highest limit a fixed engine is compiled for.  PRIME_COUNTS goes on far past what one in-memory sieve holds,
+// for validating range and sharded runs, and a fixed_sieve is an array sized by its limit: at 10^10 the byte layout
+// is already 5GB.  Where size_t is 32 bits even that can't be declared, so there it stops at 10^9.
+
+constexpr uint64_t FIXED_LIMIT_MAX = SIZE_MAX > UINT32_MAX ? 10'000'000'000ULL : 1'000'000'000ULL;
+
+// fixedLimitCount
+//
+// The number of leading PRIME_COUNTS entries (the table ascends) a fixed engine is compiled for
+
+constexpr size_t fixedLimitCount()
+{
+    size_t n = 0;
+    while (n < sizeof(PRIME_COUNTS) / sizeof(PRIME_COUNTS[0]) && PRIME_COUNTS[n].limit <= FIXED_LIMIT_MAX)
+        n++;
+    return n;
+}
+
+// withFixedLimit
+//
+// Calls fn(std::integral_constant<uint64_t, L>()) for the one L in PRIME_COUNTS equal to limit, up to
+// FIXED_LIMIT_MAX, so a run-time limit can pick its compile-time instantiation.  Returns false, without calling fn,
+// for any other limit.
+
+template <typename Fn, size_t... I>
+bool withFixedLimit(uint64_t limit, Fn &&fn, std::index_sequence<I...>)
+{
+    return ((limit == PRIME_COUNTS[I].limit ? (fn(std::integral_constant<uint64_t, PRIME_COUNTS[I].limit>()), true) : false) || ...);
+}
+
+template <typename Fn>
+bool withFixedLimit(uint64_t limit, Fn &&fn)
+{
+    return withFixedLimit(limit, fn, std::make_index_sequence<fixedLimitCount()>());
+}
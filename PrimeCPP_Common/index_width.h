@@ -0,0 +1,54 @@
+// ---------------------------------------------------------------------------
+// index_width.h : Choosing 32-bit or 64-bit index arithmetic for the crossing-off loops by limit
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+// isqrt
+//
+// The largest q with q * q <= n, exactly; a plain (int) sqrt(n) is off by one near some squares and overflows an
+// int past 2^62
+
+inline uint64_t isqrt(uint64_t n)
+{
+    uint64_t q = (uint64_t) std::sqrt((double) n);
+    while (q > 0 && (q > UINT32_MAX || q * q > n))              // Floating point sqrt can be off by one either way
+        q--;
+    while (q < UINT32_MAX && (q + 1) * (q + 1) <= n)
+        q++;
+    return q;
+}
+
+// INDEX32_LIMIT
+//
+// The highest limit sieved with 32-bit numbers and indices, on a 32-bit target; zero (never) on a 64-bit one.  A
+// crossing-off loop steps past its end before it stops, by at most twice sqrt(limit) when it walks numbers, so the
+// limit leaves room below 2^32 for a step of 2^17.  Products like factor * factor stay below the limit, so they fit.
+//
+// On x86-64 a 32-bit index measured no faster anywhere, and in PrimeCPP_Threaded's segmented loop 40% slower at
+// 10^7 under -O3: an unsigned 32-bit counter may wrap, so the compiler can't turn it into a pointer and widens it
+// again on every step.  A 32-bit build (the Win32 configurations) does each 64-bit add and compare in two halves,
+// and that is where the narrow loops pay.
+
+const uint64_t INDEX32_LIMIT = sizeof(void *) < sizeof(uint64_t) ? (1ULL << 32) - (1ULL << 17) : 0;
+
+// withIndexWidth
+//
+// Calls fn with a zero of the index type for limit: uint32_t up to INDEX32_LIMIT and uint64_t above it.  A loop
+// templated on the type is compiled both ways, so a 32-bit build keeps its common limits like 10^7 in single
+// registers and is still exact at 10^10 or more:
+//
+//     withIndexWidth(limit, [&](auto zero) { runSieve<decltype(zero)>(); });
+//
+// The loops over odd_bits don't bother: its words are addressed through a 64-bit index whatever the counter is.
+
+template <typename Fn>
+auto withIndexWidth(uint64_t limit, Fn &&fn) -> decltype(fn(uint64_t()))
+{
+    if (limit <= INDEX32_LIMIT && INDEX32_LIMIT)
+        return fn(uint32_t());
+    return fn(uint64_t());
+}
@@ -0,0 +1,220 @@
+// ---------------------------------------------------------------------------
+// numa.h : CPU and NUMA node topology, and pinning pool workers to cores
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.h"
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+// numa_topology
+//
+// The CPUs this process may run on, and the node each belongs to.  On Linux the nodes come from sysfs
+// (/sys/devices/system/node/nodeN/cpulist) and the CPUs from the process's affinity mask, so a container or a
+// taskset limits what we use; on Windows from the NUMA API.  Anywhere else, or if none of that can be read, it is
+// one node holding hardware_concurrency() CPUs.  No libnuma is needed: placing memory relies on first touch, the
+// default policy, which puts each page on the node of the thread that first writes it.
+
+class numa_topology
+{
+  private:
+
+      std::vector<int> Cpus;                                    // Usable CPUs, grouped node by node
+      std::vector<int> NodeOf;                                  // Indexed by CPU number
+      int Nodes = 1;
+
+      void add(int cpu, int node)
+      {
+          if (cpu < 0 || node < 0)
+              return;
+          if ((size_t) cpu >= NodeOf.size())
+              NodeOf.resize(cpu + 1, -1);
+          if (NodeOf[cpu] >= 0)
+              return;
+          NodeOf[cpu] = node;
+          Cpus.push_back(cpu);
+          Nodes = std::max(Nodes, node + 1);
+      }
+
+#if defined(__linux__)
+      // A sysfs CPU list, such as "0-3,8-11"
+      static std::vector<int> parseCpuList(const std::string &list)
+      {
+          std::vector<int> cpus;
+          size_t i = 0;
+          while (i < list.size())
+          {
+              size_t end = list.find(',', i);
+              if (end == std::string::npos)
+                  end = list.size();
+              const std::string item = list.substr(i, end - i);
+              const size_t dash = item.find('-');
+              const int first = atoi(item.c_str());
+              const int last = dash == std::string::npos ? first : atoi(item.c_str() + dash + 1);
+              for (int c = first; c <= last && !item.empty(); c++)
+                  cpus.push_back(c);
+              i = end + 1;
+          }
+          return cpus;
+      }
+#endif
+
+      numa_topology()
+      {
+#if defined(__linux__)
+          cpu_set_t allowed;
+          CPU_ZERO(&allowed);
+          const bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+          std::vector<int> nodes;
+          if (DIR *dir = opendir("/sys/devices/system/node"))
+          {
+              while (dirent *entry = readdir(dir))
+              {
+                  const std::string name = entry->d_name;
+                  if (name.compare(0, 4, "node") == 0 && name.size() > 4 && isdigit((unsigned char) name[4]))
+                      nodes.push_back(atoi(name.c_str() + 4));
+              }
+              closedir(dir);
+          }
+          std::sort(nodes.begin(), nodes.end());
+
+          for (int node : nodes)
+          {
+              std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+              std::string list;
+              std::getline(in, list);
+              for (int cpu : parseCpuList(list))
+                  if (!masked || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+                      add(cpu, node);
+          }
+
+          if (Cpus.empty() && masked)                         // No sysfs nodes: one node of the allowed CPUs
+              for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                  if (CPU_ISSET(cpu, &allowed))
+                      add(cpu, 0);
+#elif defined(_WIN32)
+          ULONG highest = 0;
+          if (GetNumaHighestNodeNumber(&highest))
+          {
+              for (ULONG node = 0; node <= highest; node++)
+              {
+                  ULONGLONG mask = 0;
+                  if (GetNumaNodeProcessorMask((UCHAR) node, &mask))
+                      for (int cpu = 0; cpu < 64; cpu++)
+                          if (mask & (1ULL << cpu))
+                              add(cpu, (int) node);
+              }
+          }
+#endif
+          if (Cpus.empty())
+              for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++)
+                  add((int) cpu, 0);
+      }
+
+  public:
+
+      static const numa_topology &get()
+      {
+          static const numa_topology topology;
+          return topology;
+      }
+
+      int nodes() const                 { return Nodes; }
+      size_t cpus() const               { return Cpus.size(); }
+      int nodeOf(int cpu) const         { return cpu >= 0 && (size_t) cpu < NodeOf.size() ? NodeOf[cpu] : 0; }
+
+      // cpuForWorker
+      //
+      // Workers fill one node's CPUs before moving to the next, so neighbouring workers (which the parallel engine
+      // gives neighbouring runs of the array) share a node.  More workers than CPUs wrap around.
+
+      int cpuForWorker(unsigned worker) const
+      {
+          return Cpus[worker % Cpus.size()];
+      }
+};
+
+// pinThisThread
+//
+// Binds the calling thread to one CPU.  Returns false, and leaves the thread as it was, where that isn't possible.
+
+inline bool pinThisThread(int cpu)
+{
+#if defined(__linux__)
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    return cpu >= 0 && cpu < 64 && SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << cpu) != 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
+
+// pinPool
+//
+// Binds worker w of the pool to topology.cpuForWorker(w), from inside the worker itself.  Returns the node each
+// worker ended up on (0 for any that couldn't be pinned), for reporting per-node throughput.
+
+inline std::vector<int> pinPool(thread_pool &pool, const numa_topology &topology)
+{
+    std::vector<int> nodes(pool.size(), 0);
+    pool.run([&](unsigned w)
+    {
+        const int cpu = topology.cpuForWorker(w);
+        if (pinThisThread(cpu))
+            nodes[w] = topology.nodeOf(cpu);
+    });
+    return nodes;
+}
+
+// printNodeThroughput
+//
+// One line per node: how many of the timed passes its workers did, and at what rate.  share is the part of a pass
+// one job is, 1 when each worker runs sieves of its own and 1/threads when they all share one.
+
+inline void printNodeThroughput(const std::vector<thread_pool::worker_stats> &stats, const std::vector<int> &workerNodes,
+                                int nodes, double share, double duration)
+{
+    for (int node = 0; node < nodes; node++)
+    {
+        unsigned threads = 0;
+        double passes = 0, busy = 0;
+        for (size_t w = 0; w < stats.size() && w < workerNodes.size(); w++)
+        {
+            if (workerNodes[w] != node)
+                continue;
+            threads++;
+            passes += stats[w].jobs * share;
+            busy += stats[w].busy;
+        }
+        if (threads)
+            printf("Node %d: Threads: %u, Passes: %.1f, Passes/sec: %.2f, Busy: %.6f\n",
+                node, threads, passes, duration > 0 ? passes / duration : 0.0, busy);
+    }
+}
@@ -0,0 +1,323 @@
+// ---------------------------------------------------------------------------
+// odd_bits.h : Odd-only packed bit storage shared by the C++ prime sieves
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "bit_scan.h"
+#include "buffer_arena.h"
+#include "cross_off.h"
+#include "popcount.h"
+#include "presieve.h"
+#include "sieve_buffer.h"
+
+// odd_bits
+//
+// One bit for every odd number below a limit, packed 64 to a 64-bit word.  Bit i stands for the number 2*i+1, so
+// a sieve that used to index by number shifts right by one first.  Even numbers are never stored, which halves the
+// memory of a vector<bool> over every integer, and the raw words are available so callers can set, clear or test
+// 64 candidates at a time instead of going through a proxy reference per bit.
+//
+// Bits past the end of the last word are always kept clear, so whole-word operations never see stray candidates.
+//
+// Built from a presieve_pattern instead of a fill value, the bits start out with the pattern's small primes already
+// crossed off.
+//
+// Given an arena, the words are taken from it and handed back when the bits are destroyed, so a sieve built over
+// and over at the same limit reuses one buffer instead of allocating (and page faulting) a new one each time.
+
+struct unfilled_words {};                                        // Tag: construct without filling, see below
+
+class odd_bits
+{
+  private:
+
+      sieve_buffer<uint64_t> Words;                             // Packed bits, bit i of word w is number 2*(64w+i)+1
+      uint64_t Limit;                                           // Numbers below this are covered
+      uint64_t Count;                                           // Number of bits, one for each odd number below Limit
+      buffer_arena<uint64_t> *Arena;                            // Where Words came from and goes back to, if anywhere
+
+      void trim()
+      {
+          if (Count % WORD_BITS)
+              Words.back() &= (1ULL << (Count % WORD_BITS)) - 1;
+      }
+
+  public:
+
+      static const uint64_t WORD_BITS = 64;
+
+      explicit odd_bits(uint64_t limit, bool value = true, buffer_arena<uint64_t> *arena = nullptr)
+        : Words(arena ? arena->acquire((limit / 2 + WORD_BITS - 1) / WORD_BITS)
+                      : sieve_buffer<uint64_t>((limit / 2 + WORD_BITS - 1) / WORD_BITS, value ? ~0ULL : 0ULL)),
+          Limit(limit), Count(limit / 2), Arena(arena)
+      {
+          if (Arena)
+              fill(value);
+          else
+              trim();
+      }
+
+      odd_bits(uint64_t limit, const presieve_pattern &pattern, buffer_arena<uint64_t> *arena = nullptr)
+        : Words(arena ? arena->acquire((limit / 2 + WORD_BITS - 1) / WORD_BITS)
+                      : sieve_buffer<uint64_t>((limit / 2 + WORD_BITS - 1) / WORD_BITS)),
+          Limit(limit), Count(limit / 2), Arena(arena)
+      {
+          fill(pattern);
+      }
+
+      // An odd_bits whose words are left as they are, for a caller that fills them itself with fill(pattern, first,
+      // count), a range at a time, on the thread that is going to sieve that range
+
+      odd_bits(uint64_t limit, unfilled_words, buffer_arena<uint64_t> *arena = nullptr)
+        : Words(arena ? arena->acquire((limit / 2 + WORD_BITS - 1) / WORD_BITS)
+                      : sieve_buffer<uint64_t>((limit / 2 + WORD_BITS - 1) / WORD_BITS)),
+          Limit(limit), Count(limit / 2), Arena(arena)
+      {
+      }
+
+      ~odd_bits()
+      {
+          if (Arena)
+              Arena->release(std::move(Words));
+      }
+
+      odd_bits(odd_bits &&) = default;                          // A moved-from Words is empty, and release ignores it
+      odd_bits &operator=(odd_bits &&) = default;
+
+      bool reused() const        { return Arena != nullptr; }
+
+      uint64_t limit() const     { return Limit; }
+      uint64_t size() const      { return Count; }
+      size_t wordCount() const   { return Words.size(); }
+
+      uint64_t *data()             { return Words.data(); }
+      const uint64_t *data() const { return Words.data(); }
+
+      // Single bits, by bit index (the number n lives at bit n >> 1)
+
+      bool test(uint64_t i) const  { return (Words[i / WORD_BITS] >> (i % WORD_BITS)) & 1; }
+      void set(uint64_t i)         { Words[i / WORD_BITS] |= 1ULL << (i % WORD_BITS); }
+      void clear(uint64_t i)       { Words[i / WORD_BITS] &= ~(1ULL << (i % WORD_BITS)); }
+
+      // The first set bit at or past i, or size() if there is none, found a word at a time (see bit_scan.h)
+
+      uint64_t next(uint64_t i) const  { return nextSetBit(Words.data(), i, Count); }
+
+      // Whole words: read one, or set, clear or test every bit of a mask within it
+
+      uint64_t word(size_t w) const                 { return Words[w]; }
+      bool testWord(size_t w, uint64_t mask) const  { return (Words[w] & mask) != 0; }
+      void setWord(size_t w, uint64_t mask)         { Words[w] |= mask; if (w + 1 == Words.size()) trim(); }
+      void clearWord(size_t w, uint64_t mask)       { Words[w] &= ~mask; }
+
+      // count
+      //
+      // The number of set bits, a word (or a vector of words) at a time
+
+      uint64_t count() const
+      {
+          return popcountWords(Words.data(), Words.size());
+      }
+
+      // fill
+      //
+      // Resets every bit to the same value or to a presieve pattern, or just words [first, first + count) to the
+      // pattern
+
+      void fill(bool value)
+      {
+          for (auto &w : Words)
+              w = value ? ~0ULL : 0ULL;
+          trim();
+      }
+
+      void fill(const presieve_pattern &pattern)
+      {
+          pattern.fill(Words.data(), 0, Words.size());
+          trim();
+      }
+
+      void fill(const presieve_pattern &pattern, size_t first, size_t count)
+      {
+          pattern.fill(Words.data() + first, first, count);
+          if (count && first + count == Words.size())
+              trim();
+      }
+
+      // grow
+      //
+      // Raises the limit, keeping the bits there are and filling the new ones (from the old size up) from the pattern.
+      // The words may move; their vector grows geometrically, so raising the limit a step at a time copies the bits
+      // a bounded number of times over.
+
+      void grow(uint64_t limit, const presieve_pattern &pattern)
+      {
+          if (limit <= Limit)
+              return;
+          const uint64_t first = Count;
+          const size_t words = Words.size();
+          Words.resize((size_t) ((limit / 2 + WORD_BITS - 1) / WORD_BITS));
+          Limit = limit;
+          Count = limit / 2;
+          if (first % WORD_BITS)
+          {
+              uint64_t last;                                    // The pattern for the old last word, of which only
+              pattern.fill(&last, words - 1, 1);                // the bits past the old end are new
+              Words[words - 1] |= last & (~0ULL << (first % WORD_BITS));
+          }
+          pattern.fill(Words.data() + words, words, Words.size() - words);
+          trim();
+      }
+};
+
+// atomic_odd_bits
+//
+// The same layout as odd_bits, but every word is a std::atomic<uint64_t> so several threads can cross off into one
+// sieve at once.  Clearing is a relaxed fetch_and, which can never undo another thread's clear of a neighbouring bit
+// in the same word, and that is all a sieve needs: bits only ever go from 1 to 0, so no ordering between threads
+// matters, and joining the threads makes every clear visible to whoever reads the results afterwards.
+
+class atomic_odd_bits
+{
+  private:
+
+      sieve_buffer<std::atomic<uint64_t>> Words;
+      uint64_t Limit;
+      uint64_t Count;
+      buffer_arena<std::atomic<uint64_t>> *Arena;
+
+  public:
+
+      static const uint64_t WORD_BITS = odd_bits::WORD_BITS;
+
+      explicit atomic_odd_bits(uint64_t limit, bool value = true, buffer_arena<std::atomic<uint64_t>> *arena = nullptr)
+        : Words(arena ? arena->acquire((limit / 2 + WORD_BITS - 1) / WORD_BITS)
+                      : sieve_buffer<std::atomic<uint64_t>>((limit / 2 + WORD_BITS - 1) / WORD_BITS)),
+          Limit(limit), Count(limit / 2), Arena(arena)
+      {
+          fill(value);
+      }
+
+      atomic_odd_bits(uint64_t limit, const presieve_pattern &pattern, buffer_arena<std::atomic<uint64_t>> *arena = nullptr)
+        : Words(arena ? arena->acquire((limit / 2 + WORD_BITS - 1) / WORD_BITS)
+                      : sieve_buffer<std::atomic<uint64_t>>((limit / 2 + WORD_BITS - 1) / WORD_BITS)),
+          Limit(limit), Count(limit / 2), Arena(arena)
+      {
+          fill(pattern);
+      }
+
+      ~atomic_odd_bits()
+      {
+          if (Arena)
+              Arena->release(std::move(Words));
+      }
+
+      atomic_odd_bits(atomic_odd_bits &&) = default;
+      atomic_odd_bits &operator=(atomic_odd_bits &&) = default;
+
+      uint64_t limit() const     { return Limit; }
+      uint64_t size() const      { return Count; }
+      size_t wordCount() const   { return Words.size(); }
+
+      bool test(uint64_t i) const
+      {
+          return (Words[i / WORD_BITS].load(std::memory_order_relaxed) >> (i % WORD_BITS)) & 1;
+      }
+
+      // clear
+      //
+      // Looks before it writes: a bit already seen clear stays clear, and skipping the locked operation for it
+      // saves most of the cost on multiples that an earlier factor already crossed off.
+
+      void clear(uint64_t i)
+      {
+          auto &w = Words[i / WORD_BITS];
+          const uint64_t bit = 1ULL << (i % WORD_BITS);
+          if (w.load(std::memory_order_relaxed) & bit)
+              w.fetch_and(~bit, std::memory_order_relaxed);
+      }
+
+      uint64_t word(size_t w) const                 { return Words[w].load(std::memory_order_relaxed); }
+      bool testWord(size_t w, uint64_t mask) const  { return (word(w) & mask) != 0; }
+      void clearWord(size_t w, uint64_t mask)       { Words[w].fetch_and(~mask, std::memory_order_relaxed); }
+
+      uint64_t count() const
+      {
+          uint64_t total = 0;
+          for (size_t w = 0; w < Words.size(); w++)
+              total += popcount64(word(w));
+          return total;
+      }
+
+      // clearStride
+      //
+      // Clears bits first, first+step, ... below end, and returns the first index at or past end.  Hits that share a
+      // word are gathered into one mask, so a small step costs one locked operation per word rather than per bit;
+      // for a step below 64 the masks come from stride_masks (see cross_off.h) instead of being built bit by bit.
+
+      uint64_t clearStride(uint64_t first, uint64_t step, uint64_t end)
+      {
+          if (first < end && usesMasks(step, end - first))
+              return crossOffMasked(first, step, end, [this](uint64_t w, uint64_t mask)
+              {
+                  if (word(w) & mask)
+                      clearWord(w, mask);
+              });
+          uint64_t i = first;
+          while (i < end)
+          {
+              const size_t w = i / WORD_BITS;
+              uint64_t mask = 0;
+              do
+              {
+                  mask |= 1ULL << (i % WORD_BITS);
+                  i += step;
+              }
+              while (i < end && i / WORD_BITS == w);
+
+              if (word(w) & mask)
+                  clearWord(w, mask);
+          }
+          return i;
+      }
+
+      // fill
+      //
+      // Resets every bit to the same value, or to a presieve pattern; not safe while other threads are crossing off
+
+      void fill(bool value)
+      {
+          for (auto &w : Words)
+              w.store(value ? ~0ULL : 0ULL, std::memory_order_relaxed);
+          trim();
+      }
+
+      void fill(const presieve_pattern &pattern)
+      {
+          uint64_t chunk[256];                                  // The pattern is written a chunk at a time, then stored
+          for (size_t w = 0; w < Words.size(); w += 256)
+          {
+              const size_t count = std::min<size_t>(256, Words.size() - w);
+              pattern.fill(chunk, w, count);
+              for (size_t i = 0; i < count; i++)
+                  Words[w + i].store(chunk[i], std::memory_order_relaxed);
+          }
+          trim();
+      }
+
+  private:
+
+      void trim()
+      {
+          if (Count % WORD_BITS)
+              Words.back().store(word(Words.size() - 1) & ((1ULL << (Count % WORD_BITS)) - 1), std::memory_order_relaxed);
+      }
+};
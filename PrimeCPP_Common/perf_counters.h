@@ -0,0 +1,180 @@
+// ---------------------------------------------------------------------------
+// perf_counters.h : Hardware performance counters around sieve passes
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// perf_sample
+//
+// Counts for one stretch of work on one thread.  present has a bit set for each counter that could be opened; a
+// VM or an older CPU often lacks some of the cache events while still having cycles and instructions.
+
+struct perf_sample
+{
+    enum
+    {
+        CYCLES, INSTRUCTIONS, L1_MISSES, LLC_MISSES, BRANCH_MISSES, COUNT
+    };
+
+    uint64_t values[COUNT] = {};
+    unsigned present = 0;
+
+    perf_sample &operator+=(const perf_sample &other)
+    {
+        for (int i = 0; i < COUNT; i++)
+            values[i] += other.values[i];
+        present |= other.present;
+        return *this;
+    }
+};
+
+// perf_counters
+//
+// The counters of the calling thread, in user space only.  On Linux these are perf_event_open() events (cycles,
+// instructions, L1 data read misses, last-level cache misses and branch misses), each scaled for the time it was
+// actually scheduled on the PMU, since five events can be more than the hardware counts at once.  Elsewhere, or if
+// the kernel won't open them (perf_event_paranoid, containers), nothing is opened and every sample is empty.
+//
+// A thread's counters only count that thread, so each thread has its own (local()), opened on first use.
+
+class perf_counters
+{
+  private:
+
+#if defined(__linux__)
+      int Fds[perf_sample::COUNT];
+
+      static int open(uint32_t type, uint64_t config)
+      {
+          perf_event_attr attr;
+          memset(&attr, 0, sizeof(attr));
+          attr.size = sizeof(attr);
+          attr.type = type;
+          attr.config = config;
+          attr.exclude_kernel = 1;
+          attr.exclude_hv = 1;
+          attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+          return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      }
+#endif
+
+  public:
+
+      perf_counters()
+      {
+#if defined(__linux__)
+          const uint64_t l1ReadMiss = PERF_COUNT_HW_CACHE_L1D
+                                    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                                    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+          Fds[perf_sample::CYCLES]        = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+          Fds[perf_sample::INSTRUCTIONS]  = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+          Fds[perf_sample::L1_MISSES]     = open(PERF_TYPE_HW_CACHE, l1ReadMiss);
+          Fds[perf_sample::LLC_MISSES]    = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+          Fds[perf_sample::BRANCH_MISSES] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+      }
+
+      ~perf_counters()
+      {
+#if defined(__linux__)
+          for (int fd : Fds)
+              if (fd >= 0)
+                  close(fd);
+#endif
+      }
+
+      perf_counters(const perf_counters &) = delete;
+      perf_counters &operator=(const perf_counters &) = delete;
+
+      // read
+      //
+      // The running totals since the counters were opened; the work in between two reads is the difference
+
+      perf_sample read() const
+      {
+          perf_sample sample;
+#if defined(__linux__)
+          for (int i = 0; i < perf_sample::COUNT; i++)
+          {
+              uint64_t raw[3];                                  // Value, time enabled, time running
+              if (Fds[i] < 0 || ::read(Fds[i], raw, sizeof(raw)) != (ssize_t) sizeof(raw))
+                  continue;
+              sample.values[i] = raw[2] ? (uint64_t) ((double) raw[0] * raw[1] / raw[2]) : raw[0];
+              sample.present |= 1u << i;
+          }
+#endif
+          return sample;
+      }
+
+      static perf_counters &local()
+      {
+          thread_local perf_counters counters;
+          return counters;
+      }
+};
+
+// perfDelta
+//
+// What was counted between two reads of the same counters
+
+inline perf_sample perfDelta(const perf_sample &before, const perf_sample &after)
+{
+    perf_sample delta;
+    for (int i = 0; i < perf_sample::COUNT; i++)
+        delta.values[i] = after.values[i] - before.values[i];
+    delta.present = before.present & after.present;
+    return delta;
+}
+
+// printCounters
+//
+// One line per thread, and one for all of them.  Each gives that thread's counts over the whole run divided by the
+// passes of the run, so the thread lines add up to the last one.  Threads that never ran a job (or platforms without
+// counters) have nothing present, and say so.
+
+inline void printCounters(const std::vector<perf_sample> &threads, double passes)
+{
+    static const char *NAMES[perf_sample::COUNT] = { "Cycles", "Instructions", "L1 misses", "LLC misses", "Branch misses" };
+
+    auto print = [passes](const std::string &label, const perf_sample &s)
+    {
+        printf("%s counters per pass: ", label.c_str());
+        if (!s.present)
+        {
+            printf("unavailable\n");
+            return;
+        }
+        for (int i = 0; i < perf_sample::COUNT; i++)
+        {
+            if (s.present & (1u << i))
+                printf("%s: %.0f, ", NAMES[i], (double) s.values[i] / (passes > 0 ? passes : 1));
+            else
+                printf("%s: n/a, ", NAMES[i]);
+        }
+        const unsigned ipc = (1u << perf_sample::CYCLES) | (1u << perf_sample::INSTRUCTIONS);
+        if ((s.present & ipc) == ipc && s.values[perf_sample::CYCLES])
+            printf("IPC: %.2f\n", (double) s.values[perf_sample::INSTRUCTIONS] / s.values[perf_sample::CYCLES]);
+        else
+            printf("IPC: n/a\n");
+    };
+
+    perf_sample total;
+    for (size_t w = 0; w < threads.size(); w++)
+    {
+        print("Thread " + std::to_string(w), threads[w]);
+        total += threads[w];
+    }
+    print("All threads", total);
+}
@@ -0,0 +1,99 @@
+// ---------------------------------------------------------------------------
+// popcount.h : Counting set bits a word (or a vector of words) at a time
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+#include <immintrin.h>
+#endif
+
+// popcount64
+//
+// The number of set bits in one word.  GCC and Clang turn the builtin into a single POPCNT when the target has it;
+// std::bitset does the same on MSVC, and is correct everywhere else.
+
+inline uint64_t popcount64(uint64_t w)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (uint64_t) __builtin_popcountll(w);
+#else
+    return std::bitset<64>(w).count();
+#endif
+}
+
+// popcountWords
+//
+// The number of set bits in count words.  With AVX-512 VPOPCNTQ that is eight words per instruction, summed in a
+// vector and reduced once at the end; otherwise four independent running sums, so the POPCNTs (latency 3, one per
+// cycle) can overlap instead of waiting on each other.
+
+inline uint64_t popcountWords(const uint64_t *words, size_t count)
+{
+    size_t w = 0;
+    uint64_t total = 0;
+
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+    __m512i sum = _mm512_setzero_si512();
+    for (; w + 8 <= count; w += 8)
+        sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(_mm512_loadu_si512((const void *) (words + w))));
+    total += (uint64_t) _mm512_reduce_add_epi64(sum);
+#endif
+
+    uint64_t a = 0, b = 0, c = 0, d = 0;
+    for (; w + 4 <= count; w += 4)
+    {
+        a += popcount64(words[w]);
+        b += popcount64(words[w + 1]);
+        c += popcount64(words[w + 2]);
+        d += popcount64(words[w + 3]);
+    }
+    for (; w < count; w++)
+        a += popcount64(words[w]);
+    return total + a + b + c + d;
+}
+
+// popcountBitRange
+//
+// The number of set bits among bit indices [first, last) of words, bit i being bit i % 64 of word i / 64
+
+inline uint64_t popcountBitRange(const uint64_t *words, uint64_t first, uint64_t last)
+{
+    if (first >= last)
+        return 0;
+    const uint64_t wFirst = first / 64, wLast = last / 64;
+    const uint64_t head = ~0ULL << (first % 64);
+    const uint64_t tail = (1ULL << (last % 64)) - 1;
+    if (wFirst == wLast)
+        return popcount64(words[wFirst] & head & tail);
+    uint64_t count = popcount64(words[wFirst] & head);
+    count += popcountWords(words + wFirst + 1, (size_t) (wLast - wFirst - 1));
+    if (last % 64)
+        count += popcount64(words[wLast] & tail);
+    return count;
+}
+
+// popcountBytes
+//
+// The number of nonzero bytes in an array where every byte is 0 or 1, which is the popcount of its words
+
+inline uint64_t popcountBytes(const char *bytes, size_t count)
+{
+    uint64_t a = 0, b = 0;
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        uint64_t w[2];
+        memcpy(w, bytes + i, sizeof(w));
+        a += popcount64(w[0]);
+        b += popcount64(w[1]);
+    }
+    for (; i < count; i++)
+        a += (bytes[i] != 0);
+    return a + b;
+}
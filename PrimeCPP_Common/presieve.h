@@ -0,0 +1,225 @@
+// ---------------------------------------------------------------------------
+// presieve.h : Starting a sieve from a tiled small-prime pattern
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// presieve_lanes
+//
+// The widest vector the compiler was told it may use, as a number of 64-bit words and unaligned load, AND and
+// store.  Which one is picked is decided by the build's target flags (-mavx2, -mavx512f, or any AArch64 target);
+// without them it is one plain word at a time, which is still a single pass over the array.
+
+#if defined(__AVX512F__)
+struct presieve_lanes
+{
+    static const size_t COUNT = 8;
+    static constexpr const char *NAME = "avx512";
+    typedef __m512i type;
+    static type load(const uint64_t *p)          { return _mm512_loadu_si512((const void *) p); }
+    static type both(type a, type b)             { return _mm512_and_si512(a, b); }
+    static void store(uint64_t *p, type v)       { _mm512_storeu_si512((void *) p, v); }
+};
+#elif defined(__AVX2__)
+struct presieve_lanes
+{
+    static const size_t COUNT = 4;
+    static constexpr const char *NAME = "avx2";
+    typedef __m256i type;
+    static type load(const uint64_t *p)          { return _mm256_loadu_si256((const __m256i *) p); }
+    static type both(type a, type b)             { return _mm256_and_si256(a, b); }
+    static void store(uint64_t *p, type v)       { _mm256_storeu_si256((__m256i *) p, v); }
+};
+#elif defined(__ARM_NEON)
+struct presieve_lanes
+{
+    static const size_t COUNT = 2;
+    static constexpr const char *NAME = "neon";
+    typedef uint64x2_t type;
+    static type load(const uint64_t *p)          { return vld1q_u64(p); }
+    static type both(type a, type b)             { return vandq_u64(a, b); }
+    static void store(uint64_t *p, type v)       { vst1q_u64(p, v); }
+};
+#else
+struct presieve_lanes
+{
+    static const size_t COUNT = 1;
+    static constexpr const char *NAME = "scalar";
+    typedef uint64_t type;
+    static type load(const uint64_t *p)          { return *p; }
+    static type both(type a, type b)             { return a & b; }
+    static void store(uint64_t *p, type v)       { *p = v; }
+};
+#endif
+
+// presieve_pattern
+//
+// The bits a sieve has left after crossing off a handful of small primes repeat exactly, so rather than cross them
+// off (3 alone is a third of all the writes an odd-only sieve makes), a sieve can start from a copy of the repeat.
+// The pattern is kept as one short stream of words per group of primes, each stream one period long (the period in
+// bits rounded up to whole words), and filling is a single pass of loads and ANDs, one vector of words at a time.
+// A few bits, the small primes' own, belong to every fill and are put back afterwards.
+//
+// Keeping separate short streams rather than one long period (15015 words for 3 to 13) keeps the tables in L1.
+
+class presieve_pattern
+{
+  private:
+
+      static const size_t MAX_LANES = 8;                        // Each stream is padded so a full vector never wraps
+      static const size_t MAX_STREAMS = 4;
+
+      struct stream
+      {
+          uint64_t Period;                                      // Words before the stream repeats, at least MAX_LANES
+          std::vector<uint64_t> Words;                          // One period, then its first MAX_LANES words again
+      };
+
+      std::vector<stream> Streams;
+      std::vector<uint64_t> Keep;                               // Bit indices set in every fill, whatever the streams say
+      uint64_t NextPrime = 3;                                   // Smallest prime the pattern leaves to the sieve
+
+  public:
+
+      // add
+      //
+      // A stream that clears every bit i for which isMultiple(i), where isMultiple repeats every periodBits bits
+
+      template <typename IsMultiple>
+      void add(uint64_t periodBits, IsMultiple isMultiple)
+      {
+          uint64_t a = periodBits, b = 64;                      // One period is lcm(periodBits, 64) bits
+          while (b)
+          {
+              const uint64_t t = a % b;
+              a = b;
+              b = t;
+          }
+          uint64_t period = periodBits / a;
+
+          std::vector<uint64_t> words(period, ~0ULL);
+          for (uint64_t i = 0; i < period * 64; i++)
+              if (isMultiple(i))
+                  words[i / 64] &= ~(1ULL << (i % 64));
+
+          const uint64_t once = period;
+          while (period < MAX_LANES)
+              period += once;
+          stream s;
+          s.Period = period;
+          for (uint64_t w = 0; w < period + MAX_LANES; w++)
+              s.Words.push_back(words[w % once]);
+          Streams.push_back(s);
+      }
+
+      void keep(uint64_t bit)                     { Keep.push_back(bit); }
+      void setNextPrime(uint64_t p)               { NextPrime = p; }
+      uint64_t nextPrime() const                  { return NextPrime; }
+
+      // fill
+      //
+      // Writes words [first, first + count) of the pattern into out
+
+      void fill(uint64_t *out, uint64_t first, size_t count) const
+      {
+          typedef presieve_lanes lanes;
+
+          const uint64_t *base[MAX_STREAMS];
+          uint64_t period[MAX_STREAMS];
+          uint64_t offset[MAX_STREAMS];
+          const size_t streams = std::min(Streams.size(), MAX_STREAMS);
+          for (size_t s = 0; s < streams; s++)
+          {
+              base[s] = Streams[s].Words.data();
+              period[s] = Streams[s].Period;
+              offset[s] = first % period[s];
+          }
+
+          size_t w = 0;
+          for (; streams && w + lanes::COUNT <= count; w += lanes::COUNT)
+          {
+              typename lanes::type v = lanes::load(base[0] + offset[0]);
+              for (size_t s = 1; s < streams; s++)
+                  v = lanes::both(v, lanes::load(base[s] + offset[s]));
+              lanes::store(out + w, v);
+
+              for (size_t s = 0; s < streams; s++)
+              {
+                  offset[s] += lanes::COUNT;
+                  if (offset[s] >= period[s])
+                      offset[s] -= period[s];
+              }
+          }
+          for (; w < count; w++)
+          {
+              uint64_t v = ~0ULL;
+              for (size_t s = 0; s < streams; s++)
+              {
+                  v &= base[s][offset[s]];
+                  if (++offset[s] == period[s])
+                      offset[s] = 0;
+              }
+              out[w] = v;
+          }
+
+          for (auto bit : Keep)
+              if (bit / 64 >= first && bit / 64 < first + count)
+                  out[bit / 64 - first] |= 1ULL << (bit % 64);
+      }
+};
+
+// oddPattern
+//
+// The pattern for the odd-only layout, where bit i is the number 2*i+1: 3, 5 and 7 in one stream of 105 words,
+// 11 and 13 in another of 143, and the sieve itself starts at 17.
+
+inline const presieve_pattern &oddPattern()
+{
+    static const presieve_pattern pattern = []
+    {
+        presieve_pattern p;
+        p.add(3 * 5 * 7, [](uint64_t i) { const uint64_t n = 2 * i + 1; return n % 3 == 0 || n % 5 == 0 || n % 7 == 0; });
+        p.add(11 * 13,   [](uint64_t i) { const uint64_t n = 2 * i + 1; return n % 11 == 0 || n % 13 == 0; });
+        for (uint64_t n : { 3, 5, 7, 11, 13 })
+            p.keep(n >> 1);
+        p.setNextPrime(17);
+        return p;
+    }();
+    return pattern;
+}
+
+// presieveBytes
+//
+// The same odd-only pattern, one byte (0 or 1) per number rather than one bit, for sieves that store bytes.  Here
+// a single period of 15015 bytes is small enough to keep, and tiling it is a run of plain copies.
+
+inline void presieveBytes(char *out, uint64_t count)
+{
+    static const std::vector<char> pattern = []
+    {
+        std::vector<char> bytes(3 * 5 * 7 * 11 * 13);
+        for (uint64_t i = 0; i < bytes.size(); i++)
+        {
+            const uint64_t n = 2 * i + 1;
+            bytes[i] = !(n % 3 == 0 || n % 5 == 0 || n % 7 == 0 || n % 11 == 0 || n % 13 == 0);
+        }
+        return bytes;
+    }();
+
+    for (uint64_t i = 0; i < count; i += pattern.size())
+        std::copy(pattern.begin(), pattern.begin() + (size_t) std::min<uint64_t>(pattern.size(), count - i), out + i);
+    for (uint64_t n : { 3, 5, 7, 11, 13 })
+        if ((n >> 1) < count)
+            out[n >> 1] = 1;
+}
@@ -0,0 +1,63 @@
+// ---------------------------------------------------------------------------
+// prime_counts.h : Known prime counts for validating the C++ sieves
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// PRIME_COUNTS
+//
+// Historical data for validating our results - the number of primes to be found under some limit, such as 168
+// primes under 1000.  It goes on to 10^16, well past anything one sieve holds, for the range and sharded runs; the
+// fixed engines only take the entries up to FIXED_LIMIT_MAX (see fixed_sieve.h).  A plain constexpr table, so a sieve
+// whose limit is known at compile time can look its count up at compile time too.
+
+struct prime_count
+{
+    uint64_t limit;
+    uint64_t count;
+};
+
+constexpr prime_count PRIME_COUNTS[] =
+{
+      {                     10LLU, 4               },
+      {                    100LLU, 25              },
+      {                  1'000LLU, 168             },
+      {                 10'000LLU, 1229            },
+      {                100'000LLU, 9592            },
+      {              1'000'000LLU, 78498           },
+      {             10'000'000LLU, 664579          },
+      {            100'000'000LLU, 5761455         },
+      {          1'000'000'000LLU, 50847534        },
+      {         10'000'000'000LLU, 455052511       },
+      {        100'000'000'000LLU, 4118054813      },
+      {      1'000'000'000'000LLU, 37607912018     },
+      {     10'000'000'000'000LLU, 346065536839    },
+      {    100'000'000'000'000LLU, 3204941750802   },
+      {  1'000'000'000'000'000LLU, 29844570422669  },
+      { 10'000'000'000'000'000LLU, 279238341033925 },
+};
+
+// expectedPrimeCount
+//
+// The number of primes below limit, or 0 when the limit isn't one we have data for
+
+constexpr uint64_t expectedPrimeCount(uint64_t limit)
+{
+    for (const auto &known : PRIME_COUNTS)
+        if (known.limit == limit)
+            return known.count;
+    return 0;
+}
+
+// knownPrimeCount
+//
+// The same lookup for callers that want to know whether the limit was found.  Returns false when it isn't.
+
+inline bool knownPrimeCount(uint64_t limit, uint64_t &count)
+{
+    count = expectedPrimeCount(limit);
+    return count != 0;
+}
@@ -0,0 +1,188 @@
+// ---------------------------------------------------------------------------
+// prime_index.h : Counting the primes below any x, or in any range, from a finished sieve
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "popcount.h"
+
+// prime_count_index
+//
+// Running counts of the set bits of an odd-only sieve (bit i is the number 2*i+1, one clear), so that pi(x) is two
+// table reads and a popcount of at most a block instead of a scan of the whole array.  Two levels:
+//
+//   Supers[s]   bits set before superblock s, where a superblock is SUPER_BITS (64K) bits, as a uint64_t
+//   Blocks[b]   bits set before block b, counted from the start of its superblock, where a block is BLOCK_BITS
+//               (1024) bits, two cache lines; at most 63 * 1024 so it fits a uint16_t
+//
+// That is 2 bytes per 128 bytes of sieve and 8 per 8K, about 1.7% on top of the bits.  Each table has one entry past
+// the last whole block (or superblock), so a count to the very end of the bits needs no special case.
+//
+// The index can own its tables (built from the words) or point at tables somewhere else, such as in a mapped sieve
+// file; either way it reads the words it was built over, which must outlive it.
+
+class prime_count_index
+{
+  public:
+
+      static const uint64_t BLOCK_BITS = 1024;
+      static const uint64_t SUPER_BITS = 65536;
+      static const uint64_t BLOCK_WORDS = BLOCK_BITS / 64;
+      static const uint64_t BLOCKS_PER_SUPER = SUPER_BITS / BLOCK_BITS;
+
+  private:
+
+      std::vector<uint64_t> OwnedSupers;
+      std::vector<uint16_t> OwnedBlocks;
+      const uint64_t *Supers = nullptr;
+      const uint16_t *Blocks = nullptr;
+      const uint64_t *Words = nullptr;
+      size_t WordCount = 0;
+      uint64_t Limit = 0;
+
+      // Set bits among bit indices [0, k), for k up to the number of bits
+
+      uint64_t rank(uint64_t k) const
+      {
+          if (!Words || k == 0)
+              return 0;
+          const uint64_t block = k / BLOCK_BITS;
+          const uint64_t word = k / 64;
+          uint64_t count = Supers[k / SUPER_BITS] + Blocks[block];
+          count += popcountWords(Words + block * BLOCK_WORDS, (size_t) (word - block * BLOCK_WORDS));
+          if (k % 64)
+              count += popcount64(Words[word] & ((1ULL << (k % 64)) - 1));
+          return count;
+      }
+
+      // Fills in the table entries from block first on, those before it being right already
+
+      void countFrom(size_t first)
+      {
+          uint64_t inSuper = OwnedBlocks[first];
+          uint64_t total = OwnedSupers[first / BLOCKS_PER_SUPER] + inSuper;
+          for (size_t b = first; b < OwnedBlocks.size(); b++)
+          {
+              if (b % BLOCKS_PER_SUPER == 0)
+              {
+                  OwnedSupers[b / BLOCKS_PER_SUPER] = total;
+                  inSuper = 0;
+              }
+              OwnedBlocks[b] = (uint16_t) inSuper;
+              const size_t word = std::min<size_t>(b * BLOCK_WORDS, WordCount);
+              const uint64_t count = popcountWords(Words + word, std::min<size_t>(BLOCK_WORDS, WordCount - word));
+              total += count;
+              inSuper += count;
+          }
+          Supers = OwnedSupers.data();
+          Blocks = OwnedBlocks.data();
+      }
+
+  public:
+
+      prime_count_index() = default;
+
+      prime_count_index(const uint64_t *words, uint64_t limit)
+      {
+          build(words, limit);
+      }
+
+      prime_count_index(prime_count_index &&) = default;        // Moving the vectors keeps their buffers, and so the pointers
+      prime_count_index &operator=(prime_count_index &&) = default;
+      prime_count_index(const prime_count_index &) = delete;
+      prime_count_index &operator=(const prime_count_index &) = delete;
+
+      static size_t wordsFor(uint64_t limit)    { return (size_t) ((limit / 2 + 63) / 64); }
+      static size_t superCount(size_t words)    { return (size_t) (words * 64 / SUPER_BITS + 1); }
+      static size_t blockCount(size_t words)    { return (size_t) (words / BLOCK_WORDS + 1); }
+
+      // build
+      //
+      // One pass over the words of a finished sieve with the given limit
+
+      void build(const uint64_t *words, uint64_t limit)
+      {
+          Words = words;
+          Limit = limit;
+          WordCount = wordsFor(limit);
+          OwnedSupers.assign(superCount(WordCount), 0);
+          OwnedBlocks.assign(blockCount(WordCount), 0);
+          countFrom(0);
+      }
+
+      // extend
+      //
+      // Brings the tables up to date after the sieve they were built over grew to a higher limit (its words perhaps
+      // moved, but those below the old limit unchanged): only the blocks from the old last word on are counted.
+      // Tables that were attached rather than built are built afresh instead.
+
+      void extend(const uint64_t *words, uint64_t limit)
+      {
+          if (!built() || OwnedBlocks.empty() || limit < Limit)
+              return build(words, limit);
+          const size_t oldWords = WordCount;
+          Words = words;
+          Limit = limit;
+          WordCount = wordsFor(limit);
+          OwnedSupers.resize(superCount(WordCount), 0);
+          OwnedBlocks.resize(blockCount(WordCount), 0);
+          countFrom(oldWords ? (oldWords - 1) / BLOCK_WORDS : 0);   // The old last word may have gained bits
+      }
+
+      // attach
+      //
+      // Uses tables built earlier (by build, and saved) for the same words, without copying them
+
+      void attach(const uint64_t *words, uint64_t limit, const uint64_t *supers, const uint16_t *blocks)
+      {
+          OwnedSupers.clear();
+          OwnedBlocks.clear();
+          Words = words;
+          Limit = limit;
+          WordCount = wordsFor(limit);
+          Supers = supers;
+          Blocks = blocks;
+      }
+
+      bool built() const                        { return Words != nullptr; }
+      uint64_t limit() const                    { return Limit; }
+      const uint64_t *supers() const            { return Supers; }
+      const uint16_t *blocks() const            { return Blocks; }
+      size_t superCount() const                 { return superCount(WordCount); }
+      size_t blockCount() const                 { return blockCount(WordCount); }
+      size_t bytes() const                      { return superCount() * sizeof(uint64_t) + blockCount() * sizeof(uint16_t); }
+
+      // primesBelow
+      //
+      // The number of primes p < x, for any x (those past the limit count as the limit).  The odd numbers below x
+      // are bits [0, x/2), and then there is 2.
+
+      uint64_t primesBelow(uint64_t x) const
+      {
+          x = std::min(x, Limit);
+          return x > 2 ? 1 + rank(x / 2) : 0;
+      }
+
+      // pi
+      //
+      // The number of primes p <= x
+
+      uint64_t pi(uint64_t x) const
+      {
+          return primesBelow(x == UINT64_MAX ? x : x + 1);
+      }
+
+      // countRange
+      //
+      // The number of primes in [lo, hi)
+
+      uint64_t countRange(uint64_t lo, uint64_t hi) const
+      {
+          return hi > lo ? primesBelow(hi) - primesBelow(lo) : 0;
+      }
+};
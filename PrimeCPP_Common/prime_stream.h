@@ -0,0 +1,89 @@
+// ---------------------------------------------------------------------------
+// prime_stream.h : Enumerating the primes in a range, one segment at a time
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include "bit_scan.h"
+#include "presieve.h"
+#include "segmented_sieve.h"
+
+// forEachPrime
+//
+// Calls fn(p) for every prime lo <= p < hi, in order, and returns how many there were.  The range is sieved a
+// segment at a time, exactly as the segmented engine does it (presieve pattern, then the small base primes crossed
+// off with their next multiple carried from segment to segment, and the large ones from prime_buckets), and each
+// segment's primes are handed to fn as soon as it is done.  Memory is one segment plus the base primes below sqrt(hi), whatever the size of the range, so
+// hi can be far beyond any array we could hold.
+//
+// If fn returns bool, returning false stops the enumeration there.
+
+template <typename Fn>
+uint64_t forEachPrime(uint64_t lo, uint64_t hi, Fn &&fn, uint64_t segmentBytes = 32 * 1024)
+{
+    uint64_t found = 0;
+    auto yield = [&](uint64_t p) -> bool
+    {
+        found++;
+        if constexpr (std::is_same<decltype(fn(p)), bool>::value)
+            return fn(p);
+        else
+        {
+            fn(p);
+            return true;
+        }
+    };
+
+    if (hi <= lo)
+        return 0;
+    if (lo <= 2 && 2 < hi && !yield(2))
+        return found;
+
+    // Bit i is the odd number 2i+1, as in odd_bits, so [firstBit, lastBit) are the odd numbers in [lo, hi).
+    // Segments start on whole words, so the presieve pattern can be laid straight down over each one.
+
+    const presieve_pattern &pattern = oddPattern();
+    const std::vector<uint64_t> primes = basePrimes(hi, pattern.nextPrime());
+    const uint64_t firstBit = lo / 2;
+    const uint64_t lastBit = hi / 2;
+    const uint64_t segmentWords = std::max<uint64_t>(segmentBytes / sizeof(uint64_t), 1);
+    const uint64_t segmentBits = segmentWords * 64;
+
+    const uint64_t start = firstBit / 64 * 64;
+    const size_t small = largePrimes(primes, segmentBits);
+
+    std::vector<uint64_t> segment(segmentWords);
+    std::vector<uint64_t> next(small);
+    for (size_t i = 0; i < small; i++)
+        next[i] = firstMultiple(primes[i], start);
+    prime_buckets large(primes.data() + small, primes.size() - small, start, lastBit, segmentBits);
+
+    uint64_t s = 0;
+    for (uint64_t low = start; low < lastBit; low += segmentBits, s++)
+    {
+        const uint64_t high = std::min(low + segmentBits, lastBit);
+        const size_t words = (size_t) ((high - low + 63) / 64);
+        pattern.fill(segment.data(), low / 64, words);
+
+        auto clear = [&segment, low](uint64_t j) { segment[(j - low) / 64] &= ~(1ULL << ((j - low) % 64)); };
+        for (size_t i = 0; i < small; i++)
+            next[i] = low + crossOff(segment.data(), next[i] - low, primes[i], high - low);
+        large.sieveSegment(s, clear);
+
+        if (low == 0)
+            segment[0] &= ~1ULL;                                // One is not prime
+        if (low < firstBit)
+            segment[0] &= ~0ULL << (firstBit - low);            // Below lo, in the first word only
+        if ((high - low) % 64)
+            segment[words - 1] &= (1ULL << ((high - low) % 64)) - 1;
+
+        if (!forEachSetBit(segment.data(), 0, high - low, [&](uint64_t i) { return yield(2 * (low + i) + 1); }))
+            return found;
+    }
+    return found;
+}
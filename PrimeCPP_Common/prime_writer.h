@@ -0,0 +1,247 @@
+// ---------------------------------------------------------------------------
+// prime_writer.h : Writing lists of primes out quickly, as text or binary
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// prime_format
+//
+// How a list of primes is written.  text is the "2, 3, 5, " listing the sieves have always printed.  u32 and u64
+// are each prime as a raw little-endian integer of that width, for other programs to read straight back.  delta is
+// each prime less the one before it (the first less zero) as an LEB128 varint: 7 bits a byte, low bits first, the top
+// bit set on every byte but the last.  Gaps between primes are small, so up to 10^11 nearly all take one byte and
+// none more than two, against eight for u64.
+
+enum class prime_format
+{
+    text,
+    u32,
+    u64,
+    delta
+};
+
+inline const char *primeFormatName(prime_format format)
+{
+    switch (format)
+    {
+        case prime_format::u32:   return "u32";
+        case prime_format::u64:   return "u64";
+        case prime_format::delta: return "delta";
+        default:                  return "text";
+    }
+}
+
+inline bool parsePrimeFormat(const std::string &name, prime_format &format)
+{
+    for (prime_format f : { prime_format::text, prime_format::u32, prime_format::u64, prime_format::delta })
+    {
+        if (name == primeFormatName(f))
+        {
+            format = f;
+            return true;
+        }
+    }
+    return false;
+}
+
+// prime_writer
+//
+// Collects primes into large buffers and writes each full one from a thread of its own, so the sieve producing the
+// primes only ever formats into memory and never waits on the file unless it gets a whole FILL_BUFFERS of buffers
+// ahead.  Decimal conversion is two digits at a time from a table, rather than through iostreams or printf.
+//
+// finish() (or the destructor) writes what is left and stops the thread; ok() says whether everything was written,
+// which it wasn't if the file failed or a prime was too big for u32.
+
+class prime_writer
+{
+  private:
+
+      FILE *Out;
+      prime_format Format;
+      size_t BufferBytes;
+      uint64_t Previous = 0;
+      bool Failed = false;
+
+      std::vector<char> Current;
+      size_t Used = 0;
+
+      std::mutex Lock;
+      std::condition_variable Changed;
+      std::deque<std::vector<char>> Full;                       // Filled buffers waiting for the thread
+      std::vector<std::vector<char>> Spare;                     // Written buffers ready to be filled again
+      std::deque<size_t> FullBytes;                             // How much of each is filled
+      bool Done = false;
+      bool WriteFailed = false;
+      std::thread Thread;
+
+      static const size_t FILL_BUFFERS = 4;
+      static const size_t MAX_ENCODED = 24;                     // Longest any one prime can be, in any format
+
+      void writer()
+      {
+          std::unique_lock<std::mutex> lock(Lock);
+          for (;;)
+          {
+              Changed.wait(lock, [this] { return Done || !Full.empty(); });
+              if (Full.empty())
+                  return;
+              std::vector<char> buffer = std::move(Full.front());
+              const size_t bytes = FullBytes.front();
+              Full.pop_front();
+              FullBytes.pop_front();
+
+              lock.unlock();
+              const bool written = fwrite(buffer.data(), 1, bytes, Out) == bytes;
+              lock.lock();
+
+              WriteFailed |= !written;
+              Spare.push_back(std::move(buffer));
+              Changed.notify_all();
+          }
+      }
+
+      // Hands the current buffer to the thread and takes an empty one, waiting if the thread is too far behind
+      void flush()
+      {
+          if (!Used)
+              return;
+          std::unique_lock<std::mutex> lock(Lock);
+          Changed.wait(lock, [this] { return Full.size() < FILL_BUFFERS; });
+          Full.push_back(std::move(Current));
+          FullBytes.push_back(Used);
+          if (Spare.empty())
+              Current.assign(BufferBytes, 0);
+          else
+          {
+              Current = std::move(Spare.back());
+              Spare.pop_back();
+          }
+          Used = 0;
+          Changed.notify_all();
+      }
+
+      static char *decimal(uint64_t value, char *out)
+      {
+          static const char DIGITS[] =
+              "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+              "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+              "8081828384858687888990919293949596979899";
+
+          char digits[20];
+          char *end = digits + sizeof(digits);
+          char *p = end;
+          while (value >= 100)
+          {
+              p -= 2;
+              memcpy(p, DIGITS + 2 * (value % 100), 2);
+              value /= 100;
+          }
+          if (value >= 10)
+          {
+              p -= 2;
+              memcpy(p, DIGITS + 2 * value, 2);
+          }
+          else
+              *--p = (char) ('0' + value);
+          memcpy(out, p, end - p);
+          return out + (end - p);
+      }
+
+      static char *littleEndian(uint64_t value, size_t bytes, char *out)
+      {
+          for (size_t i = 0; i < bytes; i++)
+              out[i] = (char) (value >> (8 * i));
+          return out + bytes;
+      }
+
+      static char *varint(uint64_t value, char *out)
+      {
+          while (value >= 0x80)
+          {
+              *out++ = (char) (value | 0x80);
+              value >>= 7;
+          }
+          *out++ = (char) value;
+          return out;
+      }
+
+  public:
+
+      prime_writer(FILE *out, prime_format format = prime_format::text, size_t bufferBytes = 1 << 20)
+        : Out(out),
+          Format(format),
+          BufferBytes(bufferBytes < MAX_ENCODED ? MAX_ENCODED : bufferBytes),
+          Current(BufferBytes)
+      {
+          Thread = std::thread([this] { writer(); });
+      }
+
+      ~prime_writer()
+      {
+          finish();
+      }
+
+      prime_writer(const prime_writer &) = delete;
+      prime_writer &operator=(const prime_writer &) = delete;
+
+      void write(uint64_t prime)
+      {
+          if (Used + MAX_ENCODED > BufferBytes)
+              flush();
+
+          char *out = Current.data() + Used;
+          switch (Format)
+          {
+              case prime_format::text:
+                  out = decimal(prime, out);
+                  *out++ = ',';
+                  *out++ = ' ';
+                  break;
+              case prime_format::u32:
+                  Failed |= prime > UINT32_MAX;
+                  out = littleEndian(prime, 4, out);
+                  break;
+              case prime_format::u64:
+                  out = littleEndian(prime, 8, out);
+                  break;
+              case prime_format::delta:
+                  out = varint(prime - Previous, out);
+                  Previous = prime;
+                  break;
+          }
+          Used = out - Current.data();
+      }
+
+      // finish
+      //
+      // Ends a text listing with its newline, writes everything still buffered and waits for it to reach the file
+
+      void finish()
+      {
+          if (!Thread.joinable())
+              return;
+          if (Format == prime_format::text)
+              Current[Used++] = '\n';
+          flush();
+          {
+              std::lock_guard<std::mutex> lock(Lock);
+              Done = true;
+              Changed.notify_all();
+          }
+          Thread.join();
+          fflush(Out);
+      }
+
+      bool ok() const                   { return !Failed && !WriteFailed; }   // Once finished
+};
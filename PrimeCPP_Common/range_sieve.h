@@ -0,0 +1,158 @@
+// ---------------------------------------------------------------------------
+// range_sieve.h : Sieving a window [lo, hi) far from zero, without sieving what is below it
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "bit_scan.h"
+#include "popcount.h"
+#include "presieve.h"
+#include "segmented_sieve.h"
+#include "sieve_buffer.h"
+
+// range_sieve
+//
+// The primes of one window [lo, hi) at a time, in one bit per odd number of the window, so a window near 10^15 costs
+// memory for its own width and nothing for the 10^15 below it.  The window is presieved and then crossed off a segment
+// at a time by the segmented engine's two stages, small primes carried from segment to segment and large primes from
+// prime_buckets.
+//
+// The base primes (up to sqrt(hi)) are worked out once and kept: sieving the next window, or any window whose hi is
+// no higher, starts crossing off straight away, and one that goes higher only extends them.  A run of consecutive
+// windows, or shards of one range handed out in turn, pays for the base primes once.
+//
+// Bit i of the words is the odd number 2 * (Start + i) + 1, where Start is the window's first odd number's bit index
+// rounded down to a whole word, so the presieve pattern lines up; bits outside [lo, hi) are kept clear.
+
+class range_sieve
+{
+  private:
+
+      std::vector<uint64_t> Primes;                             // Base primes from 17, enough for hi up to PrimesLimit
+      uint64_t PrimesLimit = 0;
+      sieve_buffer<uint64_t> Words;
+      uint64_t Lo = 0;
+      uint64_t Hi = 0;
+      uint64_t Start = 0;                                       // Bit index (number / 2) of bit 0 of Words
+      uint64_t SegmentBits;
+
+      bool test(uint64_t bit) const     { return (Words[(bit - Start) / 64] >> ((bit - Start) % 64)) & 1; }
+
+  public:
+
+      explicit range_sieve(uint64_t maxHi = 0, uint64_t segmentBytes = 32 * 1024)
+        : SegmentBits(std::max<uint64_t>(segmentBytes / sizeof(uint64_t), 1) * 64)
+      {
+          reserve(maxHi);
+      }
+
+      // reserve
+      //
+      // Makes sure the base primes cover windows up to hi
+
+      void reserve(uint64_t hi)
+      {
+          if (hi <= PrimesLimit)
+              return;
+          Primes = ::basePrimes(hi, oddPattern().nextPrime());
+          PrimesLimit = hi;
+      }
+
+      // sieve
+      //
+      // Replaces the window with [lo, hi), reusing the words (and base primes) of the last one where they suffice
+
+      void sieve(uint64_t lo, uint64_t hi)
+      {
+          hi = std::max(lo, hi);
+          reserve(hi);
+          Lo = lo;
+          Hi = hi;
+
+          const uint64_t firstBit = lo / 2;                     // As in forEachPrime, [firstBit, lastBit) are the odd
+          const uint64_t lastBit = hi / 2;                      // numbers of [lo, hi)
+          Start = firstBit / 64 * 64;
+          const size_t words = (size_t) ((std::max(lastBit, Start) - Start + 63) / 64);
+          Words.resize(words);
+          if (!words)
+              return;
+
+          const presieve_pattern &pattern = oddPattern();
+          pattern.fill(Words.data(), Start / 64, words);
+
+          const size_t small = largePrimes(Primes, SegmentBits);
+          const size_t count = (size_t) (std::partition_point(Primes.begin(), Primes.end(),   // Those this hi needs
+                                                              [hi](uint64_t p) { return p * p < hi; }) - Primes.begin());
+          std::vector<uint64_t> next(std::min(small, count));
+          for (size_t i = 0; i < next.size(); i++)
+              next[i] = firstMultiple(Primes[i], Start);
+          prime_buckets large(Primes.data() + next.size(), count - next.size(), Start, lastBit, SegmentBits);
+
+          auto clear = [this](uint64_t j) { Words[(j - Start) / 64] &= ~(1ULL << ((j - Start) % 64)); };
+          uint64_t segment = 0;
+          for (uint64_t low = Start; low < lastBit; low += SegmentBits, segment++)
+          {
+              const uint64_t high = std::min(low + SegmentBits, lastBit);
+              for (size_t i = 0; i < next.size(); i++)
+                  next[i] = Start + crossOff(Words.data(), next[i] - Start, Primes[i], high - Start);
+              large.sieveSegment(segment, clear);
+          }
+
+          if (Start == 0)
+              Words[0] &= ~1ULL;                                // One is not prime
+          if (firstBit > Start)
+              Words[0] &= ~0ULL << (firstBit - Start);          // Below lo, in the first word only
+          if ((lastBit - Start) % 64)
+              Words[words - 1] &= (1ULL << ((lastBit - Start) % 64)) - 1;
+      }
+
+      uint64_t lo() const                               { return Lo; }
+      uint64_t hi() const                               { return Hi; }
+      const std::vector<uint64_t> &basePrimes() const   { return Primes; }
+
+      // The words themselves: bit i of data() is the odd number 2 * (start() + i) + 1
+
+      const uint64_t *data() const                      { return Words.data(); }
+      size_t wordCount() const                          { return Words.size(); }
+      uint64_t start() const                            { return Start; }
+
+      // isPrime
+      //
+      // Whether n is prime, for any n in [lo, hi)
+
+      bool isPrime(uint64_t n) const
+      {
+          if (!(n & 1))
+              return n == 2;
+          return test(n / 2);
+      }
+
+      // count
+      //
+      // The number of primes in the window
+
+      uint64_t count() const
+      {
+          return (Lo <= 2 && 2 < Hi) + popcountWords(Words.data(), Words.size());
+      }
+
+      // forEachPrime
+      //
+      // Calls fn(p) for each prime of the window, in order
+
+      template <typename Fn>
+      void forEachPrime(Fn &&fn) const
+      {
+          if (Lo <= 2 && 2 < Hi)
+              fn((uint64_t) 2);
+          forEachSetBit(Words.data(), 0, Words.size() * 64, [&](uint64_t i)
+          {
+              fn(2 * (Start + i) + 1);
+              return true;
+          });
+      }
+};
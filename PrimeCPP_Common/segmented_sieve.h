@@ -0,0 +1,264 @@
+// ---------------------------------------------------------------------------
+// segmented_sieve.h : Cache-blocked crossing off over odd_bits, serial or parallel
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "cancel_token.h"
+#include "cross_off.h"
+#include "index_width.h"
+#include "odd_bits.h"
+#include "thread_pool.h"
+
+// basePrimes
+//
+// The odd primes p with p*p < limit, which are all the factors a sieve up to limit ever needs.  Found with a
+// small ordinary sieve of its own, since sqrt(limit) numbers fit in cache for any limit we can store.  Primes below
+// from are left out, for sieves that started from a presieve pattern which already crossed them off.
+
+inline std::vector<uint64_t> basePrimes(uint64_t limit, uint64_t from = 3)
+{
+    const uint64_t q = limit ? isqrt(limit - 1) : 0;            // The largest q with q*q < limit
+
+    std::vector<uint64_t> primes;
+    odd_bits bits(q + 1);
+    for (uint64_t i = 1; i < bits.size(); i++)
+    {
+        if (!bits.test(i))
+            continue;
+        const uint64_t p = 2 * i + 1;
+        if (p >= from)
+            primes.push_back(p);
+        for (uint64_t j = (p * p) >> 1; j < bits.size(); j += p)
+            bits.clear(j);
+    }
+    return primes;
+}
+
+// factorPassWork
+//
+// The work of a whole pass up to limit for an engine that goes a factor at a time: factorWork summed over the base
+// primes from from.  A cancelled pass has done the factorWork of the factors it finished, so that over this is the
+// share of the pass to credit it with.  Only needed once a pass is cancelled, so the base primes are found again.
+
+inline double factorPassWork(uint64_t limit, uint64_t from = 3)
+{
+    double work = 0;
+    for (uint64_t p : basePrimes(limit, from))
+        work += factorWork(limit, p);
+    return work;
+}
+
+// factorPassFraction
+//
+// The share of a pass that done (factorWork summed over the factors crossed off) is, at most one
+
+inline double factorPassFraction(uint64_t limit, uint64_t from, double done)
+{
+    const double work = factorPassWork(limit, from);
+    return work > 0 ? std::min(done / work, 1.0) : 1.0;
+}
+
+// firstMultiple
+//
+// The index of the first odd multiple of p, no smaller than p*p, at or past bit index first.  Odd multiples of p sit
+// p bits apart in odd_bits, starting from p*p at index (p*p)/2.
+
+inline uint64_t firstMultiple(uint64_t p, uint64_t first)
+{
+    const uint64_t start = (p * p) >> 1;
+    if (start >= first)
+        return start;
+    return start + ((first - start + p - 1) / p) * p;
+}
+
+// prime_buckets
+//
+// The large base primes of a segmented sieve, those at least a segment long, each filed under the segment its next
+// multiple falls in (the bucket sieve of Oliveira e Silva).  A large prime strikes a segment at most once, so carrying
+// it along with the small ones means visiting every one of them for every segment, nearly always to find nothing to
+// cross off: past 10^10 most base primes are large, and at 10^12 a 32K segment is hit by about one in seven of the
+// 78,000.  Here a segment sees only the primes that strike it, and each is then filed under the segment of its next
+// multiple.
+//
+// The buckets are a ring, one for each segment from the current one out to the farthest any prime's next multiple
+// can be, and so are reused (with their capacity) as the sieve moves along.  A prime whose first multiple (its square)
+// is further off than that waits in Pending, in ascending order, until the ring gets that far.  An entry is two 32-bit
+// values, the prime and the bit offset of its multiple within the segment, which holds for base primes and segments
+// below 2^32 bits.
+
+class prime_buckets
+{
+  private:
+
+      struct hit
+      {
+          uint32_t prime;
+          uint32_t offset;                                      // Bit of the multiple, from the start of the segment
+      };
+
+      std::vector<std::vector<hit>> Buckets;
+      std::vector<uint64_t> Pending;                            // Primes whose squares are beyond the ring
+      size_t NextPending = 0;
+      uint64_t First;                                           // Bit index where segment 0 starts
+      uint64_t Last;                                            // Multiples at or past this bit are dropped
+      uint64_t SegmentBits;
+
+      void file(uint64_t p, uint64_t j)
+      {
+          if (j >= Last)
+              return;
+          const uint64_t segment = (j - First) / SegmentBits;
+          Buckets[segment % Buckets.size()].push_back({ (uint32_t) p, (uint32_t) (j - First - segment * SegmentBits) });
+      }
+
+  public:
+
+      // The primes are the large ones of the base primes, in ascending order, to sieve bits [first, last) with in
+      // segments of segmentBits
+
+      prime_buckets(const uint64_t *primes, size_t count, uint64_t first, uint64_t last, uint64_t segmentBits)
+        : Buckets(count ? primes[count - 1] / segmentBits + 2 : 1),
+          First(first), Last(last), SegmentBits(segmentBits)
+      {
+          for (size_t i = 0; i < count; i++)
+          {
+              const uint64_t j = firstMultiple(primes[i], first);
+              if ((j - first) / segmentBits < Buckets.size())
+                  file(primes[i], j);
+              else
+                  Pending.push_back(primes[i]);
+          }
+      }
+
+      // sieveSegment
+      //
+      // Calls clear(j) for the bit index j of every large prime's multiple in segment number segment, which must be
+      // visited in order, 0 first.
+
+      template <typename Clear>
+      void sieveSegment(uint64_t segment, Clear &&clear)
+      {
+          for (; NextPending < Pending.size(); NextPending++)
+          {
+              const uint64_t p = Pending[NextPending];
+              if (((p * p) / 2 - First) / SegmentBits >= segment + Buckets.size())
+                  break;
+              file(p, (p * p) / 2);
+          }
+
+          std::vector<hit> &bucket = Buckets[segment % Buckets.size()];
+          const uint64_t low = First + segment * SegmentBits;
+          for (const hit &h : bucket)                           // Never files into this same bucket: see the ring size
+          {
+              const uint64_t j = low + h.offset;
+              clear(j);
+              file(h.prime, j + h.prime);
+          }
+          bucket.clear();
+      }
+};
+
+// largePrimes
+//
+// Where the large primes (at least segmentBits, so at most one multiple per segment) start in ascending primes
+
+inline size_t largePrimes(const std::vector<uint64_t> &primes, uint64_t segmentBits)
+{
+    return (size_t) (std::lower_bound(primes.begin(), primes.end(), segmentBits) - primes.begin());
+}
+
+// sieveRange
+//
+// Crosses off bit indices [first, last) of bits with the given base primes, one block of segmentBits at a time.
+// Each small prime's next multiple is carried from block to block, so it is worked out just once for the whole
+// range; the large primes go through prime_buckets, so a block only sees those that strike it.  Given a token, it
+// is polled before each block; returns the index the blocks crossed off so far reach, last unless cancelled.
+
+inline uint64_t sieveRange(odd_bits &bits, const std::vector<uint64_t> &primes, uint64_t first, uint64_t last, uint64_t segmentBits,
+                           const cancel_token *token = nullptr)
+{
+    const size_t small = largePrimes(primes, segmentBits);
+    std::vector<uint64_t> next(small);
+    for (size_t i = 0; i < small; i++)
+        next[i] = firstMultiple(primes[i], first);
+    prime_buckets large(primes.data() + small, primes.size() - small, first, last, segmentBits);
+
+    uint64_t segment = 0;
+    for (uint64_t low = first; low < last; low += segmentBits, segment++)
+    {
+        if (isCancelled(token))
+            return low;
+        const uint64_t high = std::min(low + segmentBits, last);
+        for (size_t i = 0; i < small; i++)
+            next[i] = crossOff(bits.data(), next[i], primes[i], high);
+        large.sieveSegment(segment, [&bits](uint64_t j) { bits.clear(j); });
+    }
+    return last;
+}
+
+// sieveSegmented
+//
+// Sieves all of bits on the calling thread, a cache-sized block at a time, with the primes from from up.  Returns
+// the share of the array sieved: one, unless the token was cancelled first.  Every block costs about the same, as
+// every small prime strikes each of them, so that is also the share of the pass.
+
+inline double sieveSegmented(odd_bits &bits, uint64_t segmentBytes, uint64_t from = 3, const cancel_token *token = nullptr)
+{
+    const uint64_t reached = sieveRange(bits, basePrimes(bits.limit(), from), 0, bits.size(), segmentBytes * 8, token);
+    return bits.size() ? (double) reached / (double) bits.size() : 1.0;
+}
+
+// sieveRangeParallel
+//
+// Crosses off bit indices [first, last) of bits with the given base primes, using the pool's threads, which never
+// write to the same word.  The range is cut into segments of whole words, each worker is handed one contiguous run
+// of them, and it sieves that run block by block against the one shared, read-only table of base primes.  No locks
+// or atomics are needed, and unlike splitting the work by factor, each thread only ever touches its own part of the
+// array.
+//
+// Given a pattern, each worker also fills its own run from it before sieving, for bits built unfilled.  That
+// spreads the fill over the threads too, and since the run's pages are first touched by the worker that sieves
+// them, on a NUMA machine they end up on that worker's node.
+//
+// Returns the number of bits sieved, as sieveRange does: each worker stops at a block boundary of its own once the
+// token is cancelled, and the runs they got through are added up.
+
+inline uint64_t sieveRangeParallel(odd_bits &bits, const std::vector<uint64_t> &primes, uint64_t first, uint64_t last,
+                                   uint64_t segmentBytes, thread_pool &pool, const presieve_pattern *pattern = nullptr,
+                                   const cancel_token *token = nullptr)
+{
+    const uint64_t segmentBits = std::max<uint64_t>(segmentBytes * 8 / odd_bits::WORD_BITS, 1) * odd_bits::WORD_BITS;
+    const uint64_t start = first / odd_bits::WORD_BITS * odd_bits::WORD_BITS;   // Runs split on words from here
+    const uint64_t segments = (std::max(last, start) - start + segmentBits - 1) / segmentBits;
+    const uint64_t threads = pool.size();
+    std::atomic<uint64_t> swept(0);
+
+    pool.run([&](unsigned t)
+    {
+        const uint64_t from = std::max(first, std::min(last, start + segments * t / threads * segmentBits));
+        const uint64_t to   = std::min(last, start + segments * (t + 1) / threads * segmentBits);
+        if (pattern && to > from)
+            bits.fill(*pattern, from / odd_bits::WORD_BITS, (to + odd_bits::WORD_BITS - 1) / odd_bits::WORD_BITS - from / odd_bits::WORD_BITS);
+        if (to > from)
+            swept += sieveRange(bits, primes, from, to, segmentBits, token) - from;
+    });
+    return swept;
+}
+
+// sieveParallel
+//
+// Sieves all of bits with the pool's threads, as sieveRangeParallel, with the primes from from up.  Returns the share
+// of the array sieved, as sieveSegmented does.
+
+inline double sieveParallel(odd_bits &bits, uint64_t segmentBytes, thread_pool &pool, uint64_t from = 3,
+                            const presieve_pattern *pattern = nullptr, const cancel_token *token = nullptr)
+{
+    const uint64_t swept = sieveRangeParallel(bits, basePrimes(bits.limit(), from), 0, bits.size(), segmentBytes, pool, pattern, token);
+    return bits.size() ? (double) swept / (double) bits.size() : 1.0;
+}
@@ -0,0 +1,304 @@
+// ---------------------------------------------------------------------------
+// sieve_buffer.h : Sieve storage whose pages are first touched by whoever fills it
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+// page_kind
+//
+// The pages a large sieve buffer can be backed by.  At 10^9 a sieve spans 15,000 4K pages, and a big factor's
+// stride touches a new one on nearly every write, so the crossing-off loop spends much of its time on TLB misses;
+// a 2M page covers 512 times as much.  transparent maps ordinary memory aligned to 2M and asks the kernel (madvise)
+// to back it with huge pages when it can.  huge_2m and huge_1g ask for pages from the reserved hugetlbfs pool
+// (vm.nr_hugepages), or on Windows for large pages, which need the "Lock pages in memory" privilege.
+
+enum class page_kind
+{
+    normal,
+    transparent,
+    huge_2m,
+    huge_1g
+};
+
+inline const char *pageKindName(page_kind kind)
+{
+    switch (kind)
+    {
+        case page_kind::transparent: return "thp";
+        case page_kind::huge_2m:     return "2m";
+        case page_kind::huge_1g:     return "1g";
+        default:                     return "4k";
+    }
+}
+
+inline bool parsePageKind(const std::string &name, page_kind &kind)
+{
+    for (page_kind k : { page_kind::normal, page_kind::transparent, page_kind::huge_2m, page_kind::huge_1g })
+    {
+        if (name == pageKindName(k))
+        {
+            kind = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+// sieve_pages
+//
+// Which pages new large buffers should get (requested), and which the most recent one actually got (obtained).
+// Asking is never an error: whatever can't be had falls back a step, 1g to 2m to thp to normal pages.
+
+class sieve_pages
+{
+  private:
+
+      struct mapping
+      {
+          size_t bytes;                                         // Length of the whole mapping
+          page_kind kind;
+      };
+
+      std::atomic<page_kind> Requested { page_kind::normal };
+      std::atomic<page_kind> Obtained { page_kind::normal };
+      std::atomic<size_t> Live { 0 };                           // Mappings not yet freed, so most frees skip the lock
+      std::mutex Lock;
+      std::unordered_map<void *, mapping> Mappings;
+
+      static const size_t HUGE_2M = 2 * 1024 * 1024;
+      static const size_t HUGE_1G = 1024 * 1024 * 1024;
+
+      static size_t roundUp(size_t bytes, size_t to)
+      {
+          return (bytes + to - 1) / to * to;
+      }
+
+      // map
+      //
+      // Memory of exactly one kind, or nullptr if the system won't give it
+
+      static void *map(size_t bytes, page_kind kind, size_t &mapped)
+      {
+#if defined(__linux__)
+          if (kind == page_kind::huge_2m || kind == page_kind::huge_1g)
+          {
+              const int shift = kind == page_kind::huge_1g ? 30 : 21;  // log2 of the page size, as MAP_HUGE_* wants
+              mapped = roundUp(bytes, kind == page_kind::huge_1g ? HUGE_1G : HUGE_2M);
+              void *p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << 26), -1, 0);
+              return p == MAP_FAILED ? nullptr : p;
+          }
+          if (kind == page_kind::transparent)
+          {
+              // Over-map by one huge page, then trim the ends so the buffer starts on a 2M boundary
+
+              mapped = roundUp(bytes, HUGE_2M);
+              void *raw = mmap(nullptr, mapped + HUGE_2M, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+              if (raw == MAP_FAILED)
+                  return nullptr;
+              const uintptr_t start = roundUp((uintptr_t) raw, HUGE_2M);
+              const size_t head = start - (uintptr_t) raw;
+              if (head)
+                  munmap(raw, head);
+              if (HUGE_2M - head)
+                  munmap((char *) start + mapped, HUGE_2M - head);
+              madvise((void *) start, mapped, MADV_HUGEPAGE);
+              return (void *) start;
+          }
+#elif defined(_WIN32)
+          if (kind != page_kind::normal && enableLockMemory())
+          {
+              const size_t large = GetLargePageMinimum();
+              if (large)
+              {
+                  mapped = roundUp(bytes, large);
+                  return VirtualAlloc(nullptr, mapped, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+              }
+          }
+#else
+          (void) bytes;
+          (void) kind;
+          (void) mapped;
+#endif
+          return nullptr;
+      }
+
+      static void unmap(void *p, size_t bytes)
+      {
+#if defined(__linux__)
+          munmap(p, bytes);
+#elif defined(_WIN32)
+          (void) bytes;
+          VirtualFree(p, 0, MEM_RELEASE);
+#else
+          (void) p;
+          (void) bytes;
+#endif
+      }
+
+#if defined(_WIN32)
+      // Large pages need SeLockMemoryPrivilege, which even an account that holds it has to switch on first
+      static bool enableLockMemory()
+      {
+          static const bool enabled = []
+          {
+              HANDLE token;
+              if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+                  return false;
+              TOKEN_PRIVILEGES tp = {};
+              tp.PrivilegeCount = 1;
+              tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+              const bool ok = LookupPrivilegeValueA(nullptr, "SeLockMemoryPrivilege", &tp.Privileges[0].Luid) &&
+                              AdjustTokenPrivileges(token, FALSE, &tp, 0, nullptr, nullptr) &&
+                              GetLastError() == ERROR_SUCCESS;
+              CloseHandle(token);
+              return ok;
+          }();
+          return enabled;
+      }
+#endif
+
+  public:
+
+      static const size_t LARGE_BYTES = HUGE_2M;                // Smaller buffers always use the ordinary heap
+
+      static sieve_pages &get()
+      {
+          static sieve_pages pages;
+          return pages;
+      }
+
+      void request(page_kind kind)      { Requested = kind; Obtained = page_kind::normal; }
+      page_kind requested() const       { return Requested; }
+      page_kind obtained() const        { return Obtained; }
+
+      // allocate
+      //
+      // bytes of the requested kind of pages, or the next best, down to the ordinary heap, which is all a small
+      // buffer ever gets.  Mapped pages are not touched.  Both ways out pair with release, so a caller never has to
+      // know which one it got.
+
+      void *allocate(size_t bytes)
+      {
+          if (bytes < LARGE_BYTES)
+              return ::operator new(bytes);
+
+          for (page_kind kind = Requested;; kind = (page_kind) ((int) kind - 1))
+          {
+              if (kind == page_kind::normal)
+              {
+                  Obtained = kind;
+                  return ::operator new(bytes);
+              }
+              size_t mapped = 0;
+              if (void *p = map(bytes, kind, mapped))
+              {
+                  std::lock_guard<std::mutex> lock(Lock);
+                  Mappings[p] = { mapped, kind };
+                  Live++;
+                  Obtained = kind;
+                  return p;
+              }
+          }
+      }
+
+      // release
+      //
+      // Frees p from allocate: unmaps it if it was mapped, and hands it back to the heap if it wasn't
+
+      void release(void *p)
+      {
+          if (Live)
+          {
+              size_t bytes = 0;                                 // Of the mapping, if p is one
+              {
+                  std::lock_guard<std::mutex> lock(Lock);
+                  auto it = Mappings.find(p);
+                  if (it != Mappings.end())
+                  {
+                      bytes = it->second.bytes;
+                      Mappings.erase(it);
+                      Live--;
+                  }
+              }
+              if (bytes)
+                  return unmap(p, bytes);
+          }
+          ::operator delete(p);
+      }
+};
+
+// first_touch_allocator
+//
+// std::allocator, except that growing a vector default-initializes the new elements instead of zeroing them.  A
+// sieve buffer is always filled (with ones, or a presieve pattern) before it is used, so the zeroing was a wasted
+// pass over memory; more importantly, it touched every page on the thread that allocated the buffer.  The kernel
+// places a page on the NUMA node of the thread that first writes it, so leaving the pages alone until the thread
+// (or each of the threads) that will sieve them does the fill puts the memory next to the core that uses it.
+//
+// Large buffers come from sieve_pages, so they get huge pages when those were asked for.
+
+template <typename T>
+struct first_touch_allocator : std::allocator<T>
+{
+    template <typename U>
+    struct rebind
+    {
+        typedef first_touch_allocator<U> other;
+    };
+
+    first_touch_allocator() = default;
+
+    template <typename U>
+    first_touch_allocator(const first_touch_allocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        if (n > SIZE_MAX / sizeof(T))
+            throw std::bad_array_new_length();
+        return static_cast<T *>(sieve_pages::get().allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t)
+    {
+        sieve_pages::get().release(p);
+    }
+
+    template <typename U>
+    void construct(U *p)
+    {
+        ::new ((void *) p) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U *p, Args &&... args)
+    {
+        ::new ((void *) p) U(std::forward<Args>(args)...);
+    }
+};
+
+// sieve_buffer
+//
+// The vector every sieve keeps its words (or bytes) in; new elements are left uninitialized
+
+template <typename T>
+using sieve_buffer = std::vector<T, first_touch_allocator<T>>;
@@ -0,0 +1,360 @@
+// ---------------------------------------------------------------------------
+// sieve_cache.h : Finished sieves saved to disk and mapped back in without sieving
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "odd_bits.h"
+#include "popcount.h"
+#include "prime_index.h"
+#include "prime_query.h"
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// sieve_file_header
+//
+// The first 64 bytes of a sieve file; the words follow straight after, so they are 64-byte aligned in the mapping.
+// wheel and layout say what the bits mean, so a file from a different engine is refused rather than misread.  The
+// only one written today is wheel 2 (odd numbers only) in packed_bits layout: little-endian 64-bit words, bit i of the
+// file the number 2*i+1, exactly an odd_bits.  primes is the count below limit, 2 included, and checksum is
+// sieveChecksum of the words, carried on over the index by indexChecksum when there is one.  Anything that changes
+// the meaning of a field bumps SIEVE_FILE_VERSION.
+//
+// indexBytes, if not zero, is the size of a prime_count_index stored after the words: its superblock counts as
+// little-endian uint64_t, then its block counts as uint16_t.  Files without one (indexBytes was reserved, and zero,
+// before there was an index) are still version 1.  Version 2 is when the checksum took in the index too; a version 1
+// file still opens, its index checked for size only, and a file without an index sums the same either way.
+
+const char     SIEVE_FILE_MAGIC[8]  = { 'P', 'R', 'I', 'M', 'E', 'S', 'V', '\0' };
+const uint32_t SIEVE_FILE_VERSION   = 2;
+
+enum class sieve_layout : uint32_t
+{
+    packed_bits = 1
+};
+
+struct sieve_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerBytes;
+    uint32_t wheel;
+    sieve_layout layout;
+    uint64_t limit;
+    uint64_t words;
+    uint64_t primes;
+    uint64_t checksum;
+    uint64_t indexBytes;
+};
+
+static_assert(sizeof(sieve_file_header) == 64, "sieve_file_header must stay 64 bytes");
+
+// sieveChecksum
+//
+// FNV-1a, a word at a time rather than a byte at a time, so it runs at memory speed.  Given a hash, carries it on.
+
+inline uint64_t sieveChecksum(const uint64_t *words, size_t count, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    for (size_t w = 0; w < count; w++)
+    {
+        hash ^= words[w];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// indexChecksum
+//
+// Carries the checksum of the words on over a count index's superblock counts, and then its block counts, one each
+
+inline uint64_t indexChecksum(uint64_t hash, const uint64_t *supers, size_t superCount, const uint16_t *blocks, size_t blockCount)
+{
+    hash = sieveChecksum(supers, superCount, hash);
+    for (size_t b = 0; b < blockCount; b++)
+    {
+        hash ^= blocks[b];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// replaceFile
+//
+// Renames from over to, atomically: anyone who had the old to open or mapped keeps reading the old file
+
+inline bool replaceFile(const std::string &from, const std::string &to)
+{
+#if defined(_WIN32)
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+// saveSieve
+//
+// Writes a finished odd_bits to path, and the count index built over it if there is one.  Returns false if the file
+// couldn't be written, with errno saying why if the system did.  The file is written beside path under a name of
+// this process's own, flushed, and only then renamed over path, so a process with the old file mapped never sees it
+// truncated or half written, and a crash leaves either the old file or the new one.
+
+inline bool saveSieve(const std::string &path, const odd_bits &bits, const prime_count_index *index = nullptr)
+{
+    if (index && (!index->built() || index->limit() != bits.limit()))
+        index = nullptr;
+
+    sieve_file_header header = {};
+    memcpy(header.magic, SIEVE_FILE_MAGIC, sizeof(header.magic));
+    header.version     = SIEVE_FILE_VERSION;
+    header.headerBytes = sizeof(header);
+    header.wheel       = 2;
+    header.layout      = sieve_layout::packed_bits;
+    header.limit       = bits.limit();
+    header.words       = bits.wordCount();
+    header.primes      = (bits.limit() >= 2) + bits.count();   // 2 isn't in the bits, one is never set
+    header.checksum    = sieveChecksum(bits.data(), bits.wordCount());
+    if (index)
+        header.checksum = indexChecksum(header.checksum, index->supers(), index->superCount(), index->blocks(), index->blockCount());
+    header.indexBytes  = index ? index->bytes() : 0;
+
+#if defined(_WIN32)
+    const std::string temp = path + ".tmp." + std::to_string(GetCurrentProcessId());
+#else
+    const std::string temp = path + ".tmp." + std::to_string(getpid());
+#endif
+    FILE *f = fopen(temp.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(bits.data(), sizeof(uint64_t), bits.wordCount(), f) == bits.wordCount();
+    if (index)
+        ok = ok && fwrite(index->supers(), sizeof(uint64_t), index->superCount(), f) == index->superCount() &&
+                   fwrite(index->blocks(), sizeof(uint16_t), index->blockCount(), f) == index->blockCount();
+    ok = ok && fflush(f) == 0;
+#if !defined(_WIN32)
+    ok = ok && fsync(fileno(f)) == 0;                           // On disk before it takes the name
+#endif
+    ok = (fclose(f) == 0) && ok;
+    ok = ok && replaceFile(temp, path);
+    if (!ok)
+    {
+        const int saved = errno;                                // Removing the leftover mustn't hide why
+        remove(temp.c_str());
+        errno = saved;
+    }
+    return ok;
+}
+
+// sieve_cache
+//
+// A sieve file mapped read-only, so opening one costs a few system calls however large it is: the pages come in from
+// the page cache (or the disk) only as isPrime touches them, and several processes with the same file open share one
+// copy.  open() checks the header against the file size, and with verify also the checksum, which reads every page.
+//
+// primesBelow and countRange use the file's count index in place; a file saved without one gets one built in memory
+// the first time it is needed.
+
+class sieve_cache
+{
+  private:
+
+      const char *Map = nullptr;
+      size_t Bytes = 0;
+      const sieve_file_header *Header = nullptr;
+      const uint64_t *Words = nullptr;
+      const char *Error = "not open";
+      mutable prime_count_index Index;
+#if defined(_WIN32)
+      HANDLE File = INVALID_HANDLE_VALUE;
+      HANDLE Mapping = nullptr;
+#endif
+
+      bool fail(const char *why)
+      {
+          close();
+          Error = why;
+          return false;
+      }
+
+  public:
+
+      sieve_cache() = default;
+
+      explicit sieve_cache(const std::string &path, bool verify = false)
+      {
+          open(path, verify);
+      }
+
+      ~sieve_cache()
+      {
+          close();
+      }
+
+      sieve_cache(const sieve_cache &) = delete;
+      sieve_cache &operator=(const sieve_cache &) = delete;
+
+      bool open(const std::string &path, bool verify = false)
+      {
+          close();
+#if defined(_WIN32)
+          // Sharing delete lets saveSieve rename a new file over this one while it is open
+
+          File = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+          if (File == INVALID_HANDLE_VALUE)
+              return fail("cannot open file");
+          LARGE_INTEGER size;
+          if (!GetFileSizeEx(File, &size) || (uint64_t) size.QuadPart < sizeof(sieve_file_header))
+              return fail("file too short");
+          Bytes = (size_t) size.QuadPart;
+          Mapping = CreateFileMappingA(File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+          if (!Mapping)
+              return fail("cannot map file");
+          Map = (const char *) MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+          if (!Map)
+              return fail("cannot map file");
+#else
+          const int fd = ::open(path.c_str(), O_RDONLY);
+          if (fd < 0)
+              return fail("cannot open file");
+          struct stat st;
+          if (fstat(fd, &st) != 0 || (uint64_t) st.st_size < sizeof(sieve_file_header))
+          {
+              ::close(fd);
+              return fail("file too short");
+          }
+          Bytes = (size_t) st.st_size;
+          void *p = mmap(nullptr, Bytes, PROT_READ, MAP_SHARED, fd, 0);
+          ::close(fd);                                          // The mapping keeps the file open
+          if (p == MAP_FAILED)
+              return fail("cannot map file");
+          Map = (const char *) p;
+#endif
+          Header = (const sieve_file_header *) Map;
+          Words = (const uint64_t *) (Map + sizeof(sieve_file_header));
+
+          if (memcmp(Header->magic, SIEVE_FILE_MAGIC, sizeof(Header->magic)) != 0)
+              return fail("not a sieve file");
+          if (Header->version < 1 || Header->version > SIEVE_FILE_VERSION || Header->headerBytes != sizeof(sieve_file_header))
+              return fail("unsupported version");
+          if (Header->wheel != 2 || Header->layout != sieve_layout::packed_bits)
+              return fail("unsupported layout");
+          if (Header->words != (Header->limit / 2 + odd_bits::WORD_BITS - 1) / odd_bits::WORD_BITS ||
+              (Bytes - sizeof(sieve_file_header)) / sizeof(uint64_t) < Header->words)
+              return fail("file truncated");
+          if (Header->indexBytes)
+          {
+              const size_t words = (size_t) Header->words;
+              const size_t supers = prime_count_index::superCount(words);
+              const size_t blocks = prime_count_index::blockCount(words);
+              const size_t offset = sizeof(sieve_file_header) + words * sizeof(uint64_t);
+              if (Header->indexBytes != supers * sizeof(uint64_t) + blocks * sizeof(uint16_t) ||
+                  Bytes < offset + Header->indexBytes)
+                  return fail("index truncated");
+              Index.attach(Words, Header->limit, (const uint64_t *) (Map + offset),
+                           (const uint16_t *) (Map + offset + supers * sizeof(uint64_t)));
+          }
+          if (verify)
+          {
+              uint64_t checksum = sieveChecksum(Words, (size_t) Header->words);
+              if (Header->indexBytes && Header->version >= 2)
+                  checksum = indexChecksum(checksum, Index.supers(), Index.superCount(), Index.blocks(), Index.blockCount());
+              if (checksum != Header->checksum)
+                  return fail("checksum mismatch");
+          }
+
+          Error = nullptr;
+          return true;
+      }
+
+      void close()
+      {
+#if defined(_WIN32)
+          if (Map)
+              UnmapViewOfFile(Map);
+          if (Mapping)
+              CloseHandle(Mapping);
+          if (File != INVALID_HANDLE_VALUE)
+              CloseHandle(File);
+          Mapping = nullptr;
+          File = INVALID_HANDLE_VALUE;
+#else
+          if (Map)
+              munmap((void *) Map, Bytes);
+#endif
+          Index = prime_count_index();
+          Map = nullptr;
+          Bytes = 0;
+          Header = nullptr;
+          Words = nullptr;
+          Error = "not open";
+      }
+
+      bool isOpen() const               { return Error == nullptr; }
+      const char *error() const         { return Error ? Error : "none"; }
+
+      uint64_t limit() const            { return isOpen() ? Header->limit : 0; }
+      size_t wordCount() const          { return isOpen() ? (size_t) Header->words : 0; }
+      uint64_t bitCount() const         { return limit() / 2; }  // Bits i, for the odd numbers 2*i+1 below limit()
+      const uint64_t *data() const      { return Words; }
+
+      // countPrimes
+      //
+      // The primes below limit(), from the header, so it costs nothing; countBits recounts them from the words
+
+      uint64_t countPrimes() const      { return isOpen() ? Header->primes : 0; }
+
+      uint64_t countBits() const
+      {
+          return isOpen() ? (Header->limit >= 2) + popcountWords(Words, wordCount()) : 0;
+      }
+
+      // isPrime
+      //
+      // Whether n is prime, for any n below limit()
+
+      bool isPrime(uint64_t n) const
+      {
+          if (!(n & 1))
+              return n == 2;
+          return (Words[n / 128] >> ((n / 2) % 64)) & 1;
+      }
+
+      void isPrimeBatch(const uint64_t *queries, size_t count, uint8_t *answers) const
+      {
+          ::isPrimeBatch(Words, limit(), queries, count, answers);
+      }
+
+      // index
+      //
+      // The count index, from the file or else built now
+
+      bool hasSavedIndex() const        { return isOpen() && Header->indexBytes != 0; }
+
+      const prime_count_index &index() const
+      {
+          if (isOpen() && !Index.built())
+              Index.build(Words, Header->limit);
+          return Index;
+      }
+
+      uint64_t primesBelow(uint64_t x) const                    { return index().primesBelow(x); }
+      uint64_t countRange(uint64_t lo, uint64_t hi) const       { return index().countRange(lo, hi); }
+};
@@ -0,0 +1,478 @@
+// ---------------------------------------------------------------------------
+// sieve_service.h : A long-lived, asynchronous prime query service over cached segments
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "bit_scan.h"
+#include "popcount.h"
+#include "range_sieve.h"
+#include "thread_pool.h"
+
+// service_segment
+//
+// One sieved stretch of SERVICE_SEGMENT numbers, [s * SERVICE_SEGMENT, (s + 1) * SERVICE_SEGMENT) for segment s:
+// bit i of words is the odd number s * SERVICE_SEGMENT + 2i + 1, and count is the primes among all its numbers,
+// 2 included in segment 0.  8M numbers is 512K of bits, a few milliseconds to sieve on one core.
+
+const uint64_t SERVICE_SEGMENT = 1ULL << 23;
+const size_t   SERVICE_SEGMENT_WORDS = (size_t) (SERVICE_SEGMENT / 128);
+
+struct service_segment
+{
+    uint64_t count = 0;
+    std::vector<uint64_t> words;
+};
+
+// sieve_service
+//
+// Answers count, isPrime, range and nth-prime queries from any number of threads, each returning a future at once.
+// One dispatcher thread takes every request waiting when it wakes as a batch: it works out the segments the batch
+// needs (the union of them, so requests for overlapping ranges share one sieving of each segment), sieves the ones it
+// doesn't have on the persistent pool, each worker with a range_sieve of its own to keep its base primes, and then
+// answers the whole batch.  Requests that arrive meanwhile make up the next batch.
+//
+// Two things are kept between batches.  The bits of the most recently used segments, up to cacheSegments of them,
+// in an LRU cache, so repeated and nearby queries don't sieve again.  And the count of every segment ever sieved,
+// 16 bytes or so each, so a count over a range needs bits only for the partial segments at its two ends, and a
+// second count over the same stretch needs no sieving at all.
+//
+// A request holds up the ones batched with it until it's done, so one count over a vast range is a slow batch for
+// everyone in it; such ranges are better served by a sieve file (sieve_cache.h).
+
+class sieve_service
+{
+  public:
+
+      enum class query
+      {
+          count,                                                // Primes in [a, b)
+          is_prime,                                             // Whether a is prime
+          range,                                                // The primes in [a, b), in order
+          nth_prime                                             // The a-th prime, counting 2 as the first
+      };
+
+      struct statistics
+      {
+          uint64_t requests = 0;
+          uint64_t batches = 0;
+          uint64_t sieved = 0;                                  // Segments sieved
+          uint64_t hits = 0;                                    // Segments a batch needed bits of and had cached
+          uint64_t misses = 0;                                  // ... and had to sieve
+          size_t cached = 0;                                    // Segments in the cache now
+      };
+
+  private:
+
+      typedef std::shared_ptr<const service_segment> segment_ptr;
+
+      struct request
+      {
+          query kind;
+          uint64_t a;
+          uint64_t b;
+          std::promise<uint64_t> number;                        // count and nth_prime
+          std::promise<bool> flag;                              // is_prime
+          std::promise<std::vector<uint64_t>> primes;           // range
+          uint64_t located = UINT64_MAX;                        // nth_prime: the segment it's in, once found
+          uint64_t rank = 0;                                    // ... and which prime of that segment it is
+      };
+
+      struct batch_needs
+      {
+          std::unordered_set<uint64_t> bits;                    // Segments whose bits are read
+          std::unordered_set<uint64_t> counts;                  // Segments whose count alone will do
+      };
+
+      thread_pool Pool;
+      std::vector<range_sieve> Sieves;                          // One per pool worker
+      size_t CacheSegments;
+
+      std::list<uint64_t> Recent;                               // Cached segments, most recently used first
+      std::unordered_map<uint64_t, std::pair<segment_ptr, std::list<uint64_t>::iterator>> Cache;
+      std::unordered_map<uint64_t, uint64_t> Counts;            // Every segment sieved so far
+
+      mutable std::mutex Lock;                                  // Guards Pending, Stopping and Stats
+      std::condition_variable Wake;
+      std::vector<std::unique_ptr<request>> Pending;
+      bool Stopping = false;
+      statistics Stats;
+      std::thread Dispatcher;
+
+      std::unordered_map<uint64_t, segment_ptr> Pinned;         // The current batch's segments with bits
+
+      static uint64_t segmentOf(uint64_t n)     { return n / SERVICE_SEGMENT; }
+      static uint64_t segmentLo(uint64_t s)     { return s * SERVICE_SEGMENT; }
+
+      // An upper bound on the nth prime: n (ln n + ln ln n) for n >= 6 (Rosser), with a little to spare for rounding
+
+      static uint64_t nthPrimeBound(uint64_t n)
+      {
+          if (n < 6)
+              return 13;
+          const double ln = std::log((double) n);
+          return (uint64_t) ((double) n * (ln + std::log(ln))) + 16;
+      }
+
+      template <typename Fn>
+      auto submit(query kind, uint64_t a, uint64_t b, Fn &&future) -> decltype(future(std::declval<request &>()))
+      {
+          std::unique_ptr<request> r(new request);
+          r->kind = kind;
+          r->a = a;
+          r->b = b;
+          auto result = future(*r);
+          {
+              std::lock_guard<std::mutex> lock(Lock);
+              Pending.push_back(std::move(r));
+              Stats.requests++;
+          }
+          Wake.notify_one();
+          return result;
+      }
+
+      // What one request needs sieved for the next step of its answer; false if it needs nothing
+
+      bool needs(const request &r, batch_needs &needs) const
+      {
+          switch (r.kind)
+          {
+              case query::is_prime:
+                  if (r.a & 1)
+                      needs.bits.insert(segmentOf(r.a));
+                  return (r.a & 1) != 0;
+
+              case query::count:
+              case query::range:
+                  if (r.b <= r.a)
+                      return false;
+                  for (uint64_t s = segmentOf(r.a); s <= segmentOf(r.b - 1); s++)
+                  {
+                      const bool whole = r.a <= segmentLo(s) && segmentLo(s + 1) <= r.b;
+                      if (r.kind == query::count && whole)
+                          needs.counts.insert(s);
+                      else
+                          needs.bits.insert(s);
+                  }
+                  return true;
+
+              case query::nth_prime:
+                  if (r.a == 0)
+                      return false;
+                  if (r.located != UINT64_MAX)
+                      needs.bits.insert(r.located);
+                  else
+                      for (uint64_t s = 0; s <= segmentOf(nthPrimeBound(r.a)); s++)
+                          needs.counts.insert(s);
+                  return true;
+          }
+          return false;
+      }
+
+      // Sieves the given segments across the pool, into out
+
+      void sieveSegments(const std::vector<uint64_t> &segments, std::vector<segment_ptr> &out)
+      {
+          out.assign(segments.size(), nullptr);
+          std::atomic<size_t> next(0);
+          Pool.run([&](unsigned t)
+          {
+              range_sieve &sieve = Sieves[t];
+              for (size_t i; (i = next++) < segments.size(); )
+              {
+                  const uint64_t lo = segmentLo(segments[i]);
+                  sieve.sieve(lo, lo + SERVICE_SEGMENT);
+                  std::shared_ptr<service_segment> segment(new service_segment);
+                  segment->count = sieve.count();
+                  segment->words.assign(sieve.data(), sieve.data() + sieve.wordCount());
+                  out[i] = std::move(segment);
+              }
+          });
+      }
+
+      void remember(uint64_t s, const segment_ptr &segment)
+      {
+          Counts[s] = segment->count;
+          auto found = Cache.find(s);
+          if (found != Cache.end())
+          {
+              Recent.erase(found->second.second);
+              Cache.erase(found);
+          }
+          Recent.push_front(s);
+          Cache[s] = std::make_pair(segment, Recent.begin());
+          while (Cache.size() > CacheSegments)
+          {
+              Cache.erase(Recent.back());
+              Recent.pop_back();
+          }
+      }
+
+      segment_ptr cached(uint64_t s)
+      {
+          auto found = Cache.find(s);
+          if (found == Cache.end())
+              return nullptr;
+          Recent.splice(Recent.begin(), Recent, found->second.second);
+          return found->second.first;
+      }
+
+      // Primes in [lo, hi), all within segment s, from its bits
+
+      uint64_t countWithin(uint64_t s, uint64_t lo, uint64_t hi) const
+      {
+          const uint64_t *words = Pinned.at(s)->words.data();
+          const uint64_t base = segmentLo(s) / 2;
+          return (lo <= 2 && 2 < hi) + popcountBitRange(words, lo / 2 - base, hi / 2 - base);
+      }
+
+      // Works out the next step of one request, or its answer; false if it needs another step
+
+      bool answer(request &r)
+      {
+          switch (r.kind)
+          {
+              case query::is_prime:
+              {
+                  if (!(r.a & 1))
+                      r.flag.set_value(r.a == 2);
+                  else
+                  {
+                      const uint64_t s = segmentOf(r.a);
+                      const uint64_t bit = r.a / 2 - segmentLo(s) / 2;
+                      r.flag.set_value((Pinned.at(s)->words[bit / 64] >> (bit % 64)) & 1);
+                  }
+                  return true;
+              }
+
+              case query::count:
+              {
+                  uint64_t total = 0;
+                  for (uint64_t s = segmentOf(r.a); r.b > r.a && s <= segmentOf(r.b - 1); s++)
+                  {
+                      const uint64_t lo = std::max(r.a, segmentLo(s));
+                      const uint64_t hi = std::min(r.b, segmentLo(s + 1));
+                      total += (lo == segmentLo(s) && hi == segmentLo(s + 1)) ? Counts.at(s) : countWithin(s, lo, hi);
+                  }
+                  r.number.set_value(total);
+                  return true;
+              }
+
+              case query::range:
+              {
+                  std::vector<uint64_t> primes;
+                  if (r.a <= 2 && 2 < r.b)
+                      primes.push_back(2);
+                  for (uint64_t s = segmentOf(r.a); r.b > r.a && s <= segmentOf(r.b - 1); s++)
+                  {
+                      const uint64_t *words = Pinned.at(s)->words.data();
+                      const uint64_t base = segmentLo(s) / 2;
+                      const uint64_t last = std::min(r.b, segmentLo(s + 1)) / 2 - base;
+                      forEachSetBit(words, std::max(r.a, segmentLo(s)) / 2 - base, last, [&](uint64_t bit)
+                      {
+                          primes.push_back(2 * (base + bit) + 1);
+                          return true;
+                      });
+                  }
+                  r.primes.set_value(std::move(primes));
+                  return true;
+              }
+
+              case query::nth_prime:
+              {
+                  if (r.a == 0)
+                  {
+                      r.number.set_value(0);
+                      return true;
+                  }
+                  if (r.located == UINT64_MAX)
+                  {
+                      uint64_t before = 0;
+                      for (uint64_t s = 0; s <= segmentOf(nthPrimeBound(r.a)); s++)
+                      {
+                          const uint64_t here = Counts.at(s);
+                          if (before + here >= r.a)
+                          {
+                              r.located = s;
+                              r.rank = r.a - before;
+                              return false;                 // Now for the bits of that segment
+                          }
+                          before += here;
+                      }
+                      r.number.set_value(0);                    // Past what the bound allows, which it never is
+                      return true;
+                  }
+                  uint64_t rank = r.rank;
+                  if (r.located == 0 && rank-- == 1)
+                  {
+                      r.number.set_value(2);
+                      return true;
+                  }
+                  const std::vector<uint64_t> &words = Pinned.at(r.located)->words;
+                  for (size_t w = 0; w < words.size(); w++)
+                  {
+                      const uint64_t here = popcount64(words[w]);
+                      if (rank > here)
+                      {
+                          rank -= here;
+                          continue;
+                      }
+                      uint64_t word = words[w];
+                      while (--rank)
+                          word &= word - 1;                     // Drop the lowest set bit, rank - 1 times
+                      r.number.set_value(2 * (segmentLo(r.located) / 2 + w * 64 + trailingZeros64(word)) + 1);
+                      return true;
+                  }
+                  r.number.set_value(0);
+                  return true;
+              }
+          }
+          return true;
+      }
+
+      // Runs one batch to completion, a step at a time for the nth_prime requests that take two
+
+      void dispatch(std::vector<std::unique_ptr<request>> batch)
+      {
+          statistics counted;
+          while (!batch.empty())
+          {
+              batch_needs wanted;
+              for (auto &r : batch)
+                  needs(*r, wanted);
+
+              std::vector<uint64_t> missing;
+              for (uint64_t s : wanted.bits)
+              {
+                  segment_ptr segment = cached(s);
+                  if (segment)
+                  {
+                      Pinned[s] = segment;
+                      counted.hits++;
+                  }
+                  else
+                  {
+                      missing.push_back(s);
+                      counted.misses++;
+                  }
+              }
+              std::vector<segment_ptr> sieved;
+              sieveSegments(missing, sieved);
+              for (size_t i = 0; i < missing.size(); i++)
+              {
+                  Pinned[missing[i]] = sieved[i];
+                  remember(missing[i], sieved[i]);
+              }
+              counted.sieved += missing.size();
+
+              // Segments only counted are sieved a few per worker at a time, so their bits never pile up in memory
+
+              missing.clear();
+              for (uint64_t s : wanted.counts)
+                  if (!Counts.count(s) && !wanted.bits.count(s))
+                      missing.push_back(s);
+              std::sort(missing.begin(), missing.end());
+              const size_t chunk = 4 * (size_t) Pool.size();
+              for (size_t first = 0; first < missing.size(); first += chunk)
+              {
+                  const std::vector<uint64_t> some(missing.begin() + first, missing.begin() + std::min(first + chunk, missing.size()));
+                  sieveSegments(some, sieved);
+                  for (size_t i = 0; i < some.size(); i++)
+                      remember(some[i], sieved[i]);
+              }
+              counted.sieved += missing.size();
+
+              std::vector<std::unique_ptr<request>> again;
+              for (auto &r : batch)
+                  if (!answer(*r))
+                      again.push_back(std::move(r));
+              batch = std::move(again);
+              Pinned.clear();
+          }
+
+          std::lock_guard<std::mutex> lock(Lock);
+          Stats.batches++;
+          Stats.sieved += counted.sieved;
+          Stats.hits += counted.hits;
+          Stats.misses += counted.misses;
+          Stats.cached = Cache.size();
+      }
+
+      void dispatcher()
+      {
+          for (;;)
+          {
+              std::vector<std::unique_ptr<request>> batch;
+              {
+                  std::unique_lock<std::mutex> lock(Lock);
+                  Wake.wait(lock, [this] { return Stopping || !Pending.empty(); });
+                  if (Pending.empty())
+                      return;
+                  batch.swap(Pending);
+              }
+              dispatch(std::move(batch));
+          }
+      }
+
+  public:
+
+      explicit sieve_service(unsigned threads = std::thread::hardware_concurrency(), size_t cacheSegments = 64)
+        : Pool(threads ? threads : 1), Sieves(Pool.size()), CacheSegments(std::max<size_t>(cacheSegments, 1))
+      {
+          Dispatcher = std::thread([this] { dispatcher(); });
+      }
+
+      ~sieve_service()
+      {
+          {
+              std::lock_guard<std::mutex> lock(Lock);
+              Stopping = true;                                  // Whatever is pending is still answered
+          }
+          Wake.notify_all();
+          Dispatcher.join();
+      }
+
+      sieve_service(const sieve_service &) = delete;
+      sieve_service &operator=(const sieve_service &) = delete;
+
+      std::future<uint64_t> count(uint64_t lo, uint64_t hi)
+      {
+          return submit(query::count, lo, hi, [](request &r) { return r.number.get_future(); });
+      }
+
+      std::future<bool> isPrime(uint64_t n)
+      {
+          return submit(query::is_prime, n, 0, [](request &r) { return r.flag.get_future(); });
+      }
+
+      std::future<std::vector<uint64_t>> range(uint64_t lo, uint64_t hi)
+      {
+          return submit(query::range, lo, hi, [](request &r) { return r.primes.get_future(); });
+      }
+
+      std::future<uint64_t> nthPrime(uint64_t n)
+      {
+          return submit(query::nth_prime, n, 0, [](request &r) { return r.number.get_future(); });
+      }
+
+      statistics stats() const
+      {
+          std::lock_guard<std::mutex> lock(Lock);
+          return Stats;
+      }
+};
@@ -0,0 +1,164 @@
+// ---------------------------------------------------------------------------
+// thread_pool.h : Persistent worker threads reused from pass to pass
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "perf_counters.h"
+
+// thread_pool
+//
+// A fixed set of worker threads that sleep between jobs.  run(job) wakes every worker, has worker i call job(i),
+// and returns once they have all finished, so it doubles as a barrier between passes.  The threads are created
+// once when the pool is, which keeps thread creation out of the timing of every pass after that.
+//
+// Each worker also keeps track of how long it spent inside jobs (busy) and how long it then sat waiting for the
+// slowest worker to finish the same job (idle), so an uneven split of work shows up directly.  With countEvents on,
+// it also reads its own hardware counters around each job, so they can be told apart by thread as well.
+
+class thread_pool
+{
+  public:
+
+      struct worker_stats
+      {
+          double busy = 0;                                      // Seconds spent running jobs
+          double idle = 0;                                      // Seconds spent done, waiting on the other workers
+          uint64_t jobs = 0;
+          perf_sample counters;                                 // Hardware counts inside jobs, if countEvents is on
+      };
+
+  private:
+
+      std::vector<std::thread> Workers;
+      std::mutex Mutex;
+      std::condition_variable Wake;                             // Signalled when a new job is posted, or on shutdown
+      std::condition_variable Done;                             // Signalled when the last worker finishes a job
+      const std::function<void(unsigned)> *Job = nullptr;       // Valid for as long as run() is waiting on it
+      uint64_t Generation = 0;                                  // Bumped once per job so workers run each just once
+      unsigned Pending = 0;                                     // Workers still busy with the current job
+      bool Stopping = false;
+      bool Counting = false;                                    // Read perf_counters::local() around each job
+      std::vector<worker_stats> Stats;                          // One per worker, only touched under Mutex
+      std::vector<std::chrono::steady_clock::time_point> Finished;
+
+      void worker(unsigned index)
+      {
+          uint64_t seen = 0;
+          std::unique_lock<std::mutex> lock(Mutex);
+          while (true)
+          {
+              Wake.wait(lock, [&] { return Stopping || Generation != seen; });
+              if (Stopping)
+                  return;
+              seen = Generation;
+              auto job = Job;
+              const bool counting = Counting;
+
+              lock.unlock();
+              perf_sample before, after;
+              if (counting)
+                  before = perf_counters::local().read();
+              auto tStart = std::chrono::steady_clock::now();
+              (*job)(index);
+              auto tEnd = std::chrono::steady_clock::now();
+              if (counting)
+                  after = perf_counters::local().read();
+              lock.lock();
+
+              if (counting)
+                  Stats[index].counters += perfDelta(before, after);
+              Stats[index].busy += std::chrono::duration<double>(tEnd - tStart).count();
+              Stats[index].jobs++;
+              Finished[index] = tEnd;
+
+              if (--Pending == 0)
+                  Done.notify_one();
+          }
+      }
+
+  public:
+
+      explicit thread_pool(unsigned threads)
+        : Stats(threads ? threads : 1), Finished(threads ? threads : 1)
+      {
+          for (unsigned i = 0; i < (threads ? threads : 1); i++)
+              Workers.push_back(std::thread([this, i] { worker(i); }));
+      }
+
+      ~thread_pool()
+      {
+          {
+              std::lock_guard<std::mutex> lock(Mutex);
+              Stopping = true;
+          }
+          Wake.notify_all();
+          for (auto &th : Workers)
+              th.join();
+      }
+
+      thread_pool(const thread_pool &) = delete;
+      thread_pool &operator=(const thread_pool &) = delete;
+
+      unsigned size() const
+      {
+          return (unsigned) Workers.size();
+      }
+
+      // run
+      //
+      // Calls job(i) once on each worker i in [0, size()) and waits for all of them.  One caller at a time.
+
+      void run(const std::function<void(unsigned)> &job)
+      {
+          std::unique_lock<std::mutex> lock(Mutex);
+          Job = &job;
+          Pending = (unsigned) Workers.size();
+          Generation++;
+          Wake.notify_all();
+          Done.wait(lock, [this] { return Pending == 0; });
+          Job = nullptr;
+
+          auto tLast = Finished[0];
+          for (auto &t : Finished)
+              tLast = std::max(tLast, t);
+          for (size_t i = 0; i < Finished.size(); i++)
+              Stats[i].idle += std::chrono::duration<double>(tLast - Finished[i]).count();
+      }
+
+      // countEvents
+      //
+      // Turns the hardware counters around each job on or off, from the next job on
+
+      void countEvents(bool on)
+      {
+          std::lock_guard<std::mutex> lock(Mutex);
+          Counting = on;
+      }
+
+      // stats, resetStats
+      //
+      // Busy and idle time for each worker, summed over every job since the last reset
+
+      std::vector<worker_stats> stats()
+      {
+          std::lock_guard<std::mutex> lock(Mutex);
+          return Stats;
+      }
+
+      void resetStats()
+      {
+          std::lock_guard<std::mutex> lock(Mutex);
+          for (auto &s : Stats)
+              s = worker_stats();
+      }
+};
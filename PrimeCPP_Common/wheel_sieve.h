@@ -0,0 +1,312 @@
+// ---------------------------------------------------------------------------
+// wheel_sieve.h : Wheel-factorized prime sieve (mod 30 or mod 210)
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "buffer_arena.h"
+#include "cancel_token.h"
+#include "index_width.h"
+#include "perf_counters.h"
+#include "popcount.h"
+#include "presieve.h"
+#include "prime_counts.h"
+#include "prime_writer.h"
+#include "segmented_sieve.h"
+#include "sieve_buffer.h"
+
+// wheel30, wheel210
+//
+// The wheels we know how to build.  MODULUS is the product of the small primes the wheel skips, and only the
+// numbers coprime to it are stored: 8 of every 30 (one byte each) or 48 of every 210.
+
+struct wheel30
+{
+    static constexpr uint64_t MODULUS = 30;
+    static constexpr const char *NAME = "wheel30";
+};
+
+struct wheel210
+{
+    static constexpr uint64_t MODULUS = 210;
+    static constexpr const char *NAME = "wheel210";
+};
+
+// wheel_tables
+//
+// Everything about a wheel that doesn't depend on the limit, built once per wheel.  For a prime p = M*i + R[j] and a
+// multiplier q = M*k + R[m], the multiple p*q always lands on residue Target[j][m], and stepping q to the next
+// residue moves p*q forward by i*Gap[m] + Carry[j][m] whole blocks of M numbers.  That lets the crossing-off loop
+// walk from multiple to multiple with nothing but table lookups and adds.
+//
+// Pattern presieves whichever of 7, 11 and 13 the wheel itself doesn't skip, in the wheel's own bit layout.
+
+template <typename Wheel>
+struct wheel_tables
+{
+    static constexpr uint64_t M = Wheel::MODULUS;
+
+    std::vector<uint64_t> SmallPrimes;                          // The primes dividing M, which aren't stored
+    std::vector<uint64_t> Residues;                             // The residues coprime to M, in order
+    std::vector<int>      IndexOf;                              // Residue -> bit within a block, or -1
+    std::vector<uint64_t> Gap;                                  // Distance from residue m to the next one
+    std::vector<uint32_t> Target;                               // [j*K+m] bit of (R[j]*R[m]) % M
+    std::vector<uint32_t> Carry;                                // [j*K+m] blocks carried stepping R[m] to R[m+1]
+    presieve_pattern      Pattern;                              // Small primes past the wheel's, crossed off up front
+
+    wheel_tables() : IndexOf(M, -1)
+    {
+        uint64_t rest = M;
+        for (uint64_t p = 2; p <= rest; p++)
+            if (rest % p == 0)
+            {
+                SmallPrimes.push_back(p);
+                while (rest % p == 0)
+                    rest /= p;
+            }
+
+        for (uint64_t r = 1; r < M; r++)
+        {
+            bool coprime = true;
+            for (auto p : SmallPrimes)
+                coprime = coprime && (r % p != 0);
+            if (coprime)
+            {
+                IndexOf[r] = (int) Residues.size();
+                Residues.push_back(r);
+            }
+        }
+
+        const size_t K = Residues.size();
+        for (size_t m = 0; m < K; m++)
+            Gap.push_back((m + 1 < K ? Residues[m + 1] : Residues[0] + M) - Residues[m]);
+
+        for (size_t j = 0; j < K; j++)
+            for (size_t m = 0; m < K; m++)
+            {
+                uint64_t t = (Residues[j] * Residues[m]) % M;
+                Target.push_back((uint32_t) IndexOf[t]);
+                Carry.push_back((uint32_t) ((t + Residues[j] * Gap[m]) / M));
+            }
+
+        auto number = [this, K](uint64_t i) { return M * (i / K) + Residues[i % K]; };
+        if (M % 7)
+            Pattern.add(K * 7, [number](uint64_t i) { return number(i) % 7 == 0; });
+        Pattern.add(K * 11 * 13, [number](uint64_t i) { return number(i) % 11 == 0 || number(i) % 13 == 0; });
+        for (uint64_t p : { 7, 11, 13 })
+            if (M % p)
+                Pattern.keep((p / M) * K + IndexOf[p % M]);
+        Pattern.setNextPrime(17);
+    }
+
+    static const wheel_tables &get()
+    {
+        static const wheel_tables tables;
+        return tables;
+    }
+};
+
+// wheel_sieve
+//
+// A sieve over only the numbers coprime to the wheel's modulus.  Bit (b*K + k) stands for the number M*b + R[k], so
+// for wheel30 each byte holds one block of 30 numbers.  That is about 27% of the odd-only layout, and the multiples
+// of 3 and 5 (7 too, for wheel210) are never written at all.  The public interface matches prime_sieve, so it can
+// be benchmarked next to it.
+
+template <typename Wheel>
+class wheel_sieve
+{
+  private:
+
+      const wheel_tables<Wheel> &Tables;
+      sieve_buffer<uint64_t> Words;                             // Packed bits, where 1==prime, 0==not
+      uint64_t Limit;                                           // Numbers below this are covered
+      uint64_t Blocks;                                          // Blocks of M numbers, rounded up
+      buffer_arena<uint64_t> *Arena;                            // Where Words came from and goes back to, if anywhere
+      mutable size_t Count = 0;                                 // Primes found, once countPrimes has counted them
+      mutable bool Counted = false;
+
+      static constexpr uint64_t M = Wheel::MODULUS;
+
+      size_t K() const                  { return Tables.Residues.size(); }
+      bool test(uint64_t i) const       { return (Words[i / 64] >> (i % 64)) & 1; }
+      void clear(uint64_t i)            { Words[i / 64] &= ~(1ULL << (i % 64)); }
+
+      // crossOff
+      //
+      // Clears every multiple p*q with q >= p and q coprime to M, where p = M*i + R[j]
+
+      void crossOff(uint64_t i, size_t j)
+      {
+          const size_t k = K();
+          const uint64_t p = M * i + Tables.Residues[j];
+          const uint32_t *target = &Tables.Target[j * k];
+          const uint32_t *carry  = &Tables.Carry[j * k];
+
+          uint64_t block = (p * p) / M;
+          size_t m = j;
+          while (block < Blocks)
+          {
+              clear(block * k + target[m]);
+              block += i * Tables.Gap[m] + carry[m];
+              if (++m == k)
+                  m = 0;
+          }
+      }
+
+  public:
+
+      wheel_sieve(uint64_t n, buffer_arena<uint64_t> *arena = nullptr)
+        : Tables(wheel_tables<Wheel>::get()), Limit(n), Blocks((n + M - 1) / M), Arena(arena)
+      {
+          const size_t words = (Blocks * K() + 63) / 64;
+          if (Arena)
+              Words = Arena->acquire(words);
+          Words.resize(words);
+          Tables.Pattern.fill(Words.data(), 0, Words.size());  // Candidates, less the multiples of 7 to 13
+
+          for (uint64_t i = Blocks * K(); i < Words.size() * 64; i++)
+              clear(i);                                         // Past the last block
+          for (size_t k = 0; Blocks && k < K(); k++)
+              if ((Blocks - 1) * M + Tables.Residues[k] >= n)
+                  clear((Blocks - 1) * K() + k);                // Past the limit within the last block
+          if (Blocks)
+              clear(0);                                         // One is not prime
+      }
+
+      ~wheel_sieve()
+      {
+          if (Arena)
+              Arena->release(std::move(Words));
+      }
+
+      wheel_sieve(const wheel_sieve &) = delete;
+      wheel_sieve &operator=(const wheel_sieve &) = delete;
+
+      // runSieve
+      //
+      // Walk the stored candidates up to sqrt(n), past the presieved ones; each one still set is prime, so cross off
+      // its multiples.  Given a token, it is polled before each factor; returns the share of the pass done, one
+      // unless the token was cancelled first.
+
+      double runSieve(const cancel_token *token = nullptr)
+      {
+          Counted = false;
+          const uint64_t q = isqrt(Limit);
+          double done = 0;                                      // factorWork of the factors crossed off, given a token
+          for (uint64_t i = 0; i * M <= q; i++)
+              for (size_t j = 0; j < K(); j++)
+              {
+                  const uint64_t p = M * i + Tables.Residues[j];
+                  if (p > q)
+                      return 1.0;
+                  if (p >= Tables.Pattern.nextPrime() && test(i * K() + j))
+                  {
+                      if (token)
+                      {
+                          if (token->cancelled())
+                              return factorPassFraction(Limit, Tables.Pattern.nextPrime(), done);
+                          done += factorWork(Limit, p);
+                      }
+                      crossOff(i, j);
+                  }
+              }
+          return 1.0;
+      }
+
+      // countPrimes
+      //
+      // Can be called after runSieve to determine how many primes were found in total.  The count is kept, so
+      // validating and printing the results don't each count the array again.
+
+      size_t countPrimes() const
+      {
+          if (Counted)
+              return Count;
+          Count = popcountWords(Words.data(), Words.size());
+          for (auto p : Tables.SmallPrimes)                     // The wheel's own primes aren't stored
+              Count += (p < Limit);
+          Counted = true;
+          return Count;
+      }
+
+      // isPrime
+      //
+      // Can be called after runSieve to determine whether a given number (below the limit) is prime.
+
+      bool isPrime(uint64_t n) const
+      {
+          for (auto p : Tables.SmallPrimes)
+              if (n % p == 0)
+                  return n == p;
+          return test((n / M) * K() + Tables.IndexOf[n % M]);
+      }
+
+      // validateResults
+      //
+      // Checks to see if the number of primes found matches what we should expect.
+
+      bool validateResults() const
+      {
+          uint64_t expected = 0;
+          return knownPrimeCount(Limit, expected) && expected == countPrimes();
+      }
+
+      // printResults
+      //
+      // Displays stats about what was found as well as (optionally) the primes themselves, and the hardware counters
+      // of each thread over the timed passes when there are some
+
+      void printResults(bool showResults, double duration, double passes, size_t threads,
+                        const std::vector<perf_sample> *counters = nullptr) const
+      {
+          size_t count = 0;                                     // Primes listed, when they are, to check the count by
+          if (showResults)
+          {
+              prime_writer out(stdout);
+              for (auto p : Tables.SmallPrimes)
+              {
+                  if (p < Limit)
+                  {
+                      out.write(p);
+                      count++;
+                  }
+              }
+              for (uint64_t b = 0; b < Blocks; b++)
+              {
+                  for (size_t k = 0; k < K(); k++)
+                  {
+                      if (test(b * K() + k))
+                      {
+                          out.write(M * b + Tables.Residues[k]);
+                          count++;
+                      }
+                  }
+              }
+          }
+          else
+          {
+              count = countPrimes();
+          }
+
+          std::cout << "Passes: "  << passes << ", "
+                    << "Threads: " << threads << ", "
+                    << "Time: "    << duration << ", "
+                    << "Average: " << duration/passes << ", "
+                    << "Limit: "   << Limit << ", "
+                    << "Counts: "  << count << "/" << countPrimes() << ", "
+                    << "Valid : "  << (validateResults() ? "Pass" : "FAIL!") << ", "
+                    << "Engine: "  << Wheel::NAME << ", "
+                    << "Buffers: " << (Arena ? "reused" : "fresh")
+                    << "\n";
+
+          if (counters)
+              printCounters(*counters, passes);
+      }
+};
@@ -0,0 +1,110 @@
+// ---------------------------------------------------------------------------
+// work_stealing.h : Range-splitting work-stealing scheduler over a thread_pool
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "thread_pool.h"
+
+// work_stealing_scheduler
+//
+// Runs a task over every item in [0, count) on the workers of a pool.  Each worker starts with an equal, contiguous
+// share of the items and takes them from the front, grain at a time.  A worker that runs out picks another worker
+// that still has items left and steals the back half of them.  Sieve tasks vary enormously in cost (the factor 3
+// has thousands of times more multiples than a factor near sqrt(n)), so a fixed split leaves most threads idle while
+// one finishes; stealing keeps everyone busy until the very end.
+
+class work_stealing_scheduler
+{
+  private:
+
+      struct alignas(64) worker_range                           // One per worker, on its own cache line
+      {
+          std::mutex Lock;
+          uint64_t Next = 0;                                    // Items [Next, End) are still to be done
+          uint64_t End = 0;
+      };
+
+      thread_pool &Pool;
+      std::unique_ptr<worker_range[]> Ranges;
+
+      // take
+      //
+      // Claims up to grain items from the front of a worker's own range
+
+      bool take(unsigned w, uint64_t grain, uint64_t &begin, uint64_t &end)
+      {
+          std::lock_guard<std::mutex> lock(Ranges[w].Lock);
+          if (Ranges[w].Next >= Ranges[w].End)
+              return false;
+          begin = Ranges[w].Next;
+          end = std::min(begin + grain, Ranges[w].End);
+          Ranges[w].Next = end;
+          return true;
+      }
+
+      // steal
+      //
+      // Moves the back half of some other worker's remaining items into this worker's (empty) range
+
+      bool steal(unsigned w)
+      {
+          const unsigned workers = Pool.size();
+          for (unsigned i = 1; i < workers; i++)
+          {
+              worker_range &victim = Ranges[(w + i) % workers];
+              uint64_t first, last;
+              {
+                  std::lock_guard<std::mutex> lock(victim.Lock);
+                  if (victim.Next >= victim.End)
+                      continue;
+                  last = victim.End;
+                  first = last - (last - victim.Next + 1) / 2;
+                  victim.End = first;
+              }
+              std::lock_guard<std::mutex> lock(Ranges[w].Lock);
+              Ranges[w].Next = first;
+              Ranges[w].End = last;
+              return true;
+          }
+          return false;
+      }
+
+  public:
+
+      explicit work_stealing_scheduler(thread_pool &pool)
+        : Pool(pool), Ranges(new worker_range[pool.size()])
+      {
+      }
+
+      // forEach
+      //
+      // Calls task(worker, begin, end) over consecutive runs of at most grain items until all of [0, count) are done
+
+      void forEach(uint64_t count, uint64_t grain, const std::function<void(unsigned, uint64_t, uint64_t)> &task)
+      {
+          const unsigned workers = Pool.size();
+          for (unsigned w = 0; w < workers; w++)
+          {
+              Ranges[w].Next = count * w / workers;
+              Ranges[w].End = count * (w + 1) / workers;
+          }
+
+          Pool.run([&](unsigned w)
+          {
+              uint64_t begin, end;
+              do
+              {
+                  while (take(w, grain ? grain : 1, begin, end))
+                      task(w, begin, end);
+              }
+              while (steal(w));
+          });
+      }
+};
@@ -0,0 +1,556 @@
+// ---------------------------------------------------------------------------
+// PrimeCPP_Bench.cpp : Every sieve engine across a matrix of limits and thread counts
+// ---------------------------------------------------------------------------
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../PrimeCPP_Common/buffer_arena.h"
+#include "../PrimeCPP_Common/cancel_token.h"
+#include "../PrimeCPP_Common/fixed_sieve.h"
+#include "../PrimeCPP_Common/prime_counts.h"
+#include "../PrimeCPP_Common/sieve_buffer.h"
+#include "../PrimeCPP_Common/thread_pool.h"
+#include "../PrimeCPP_Common/wheel_sieve.h"
+#include "../PrimeCPP/PrimeCPP.h"
+#include "PrimeCPP_PAR.h"
+#include "PrimeCPP_Threaded.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// bench_runner
+//
+// One engine, ready to run at one limit on one pool.  pass() builds a sieve, runs it and tears it down again, which
+// is what each of the programs times, and returns the share of the pass done before the token (if any) stopped it;
+// check() runs one to the end and returns the count of primes it found.
+
+struct bench_runner
+{
+    function<double(const cancel_token *)> pass;
+    function<uint64_t()> check;
+};
+
+template <typename MakeSieve>
+bench_runner makeRunner(MakeSieve makeSieve)
+{
+    return {
+        [makeSieve](const cancel_token *token) { return makeSieve()->runSieve(token); },
+        [makeSieve] { auto sieve = makeSieve(); sieve->runSieve(); return (uint64_t) sieve->countPrimes(); }
+    };
+}
+
+// bench_engine
+//
+// A named engine.  A shared engine spreads one sieve over all of the pool's workers itself, so a round is one pass;
+// any other engine runs one sieve per worker side by side, as PrimeCPP_PAR does, and a round is one pass per worker.
+// prepare() returns false if the engine can't run at the given limit.
+
+struct bench_engine
+{
+    string name;
+    bool shared;
+    function<bool(uint64_t limit, thread_pool &pool, bench_runner &runner)> prepare;
+};
+
+// bench_options
+//
+// What to run, and for how long.  The limits, threads and pages lists are crossed with each other and with the
+// engines.
+
+struct bench_options
+{
+    vector<uint64_t> limits = { 1'000'000LLU };
+    vector<unsigned> threads = { 1 };
+    vector<page_kind> pages = { page_kind::normal };            // What large sieve buffers are asked to live on
+    vector<string> engines;                                     // Names, or prefixes such as "par/"; empty runs all
+    unsigned warmup = 1;                                        // Untimed rounds before the timed ones
+    double seconds = 1;                                         // Timed rounds start until this much time has passed
+    uint64_t segmentKB = par::DEFAULT_SEGMENT_KB;
+    bool reuse = false;
+    uint64_t queries = 0;                                       // With -Q, the batch size of the isPrime benchmark
+};
+
+// bench_result
+//
+// One row of the matrix.  Latencies are in seconds, one sample per sieve; passesPerSecond is the passes divided by
+// the time the rounds that produced them took.
+
+struct bench_result
+{
+    string engine;
+    uint64_t limit = 0;
+    unsigned threads = 0;
+    const char *pages = "4k";                                   // What the buffers actually got
+    uint64_t passes = 0;
+    double min = 0;
+    double median = 0;
+    double p99 = 0;
+    double mean = 0;
+    double passesPerSecond = 0;
+    bool valid = false;
+};
+
+// percentile
+//
+// Nearest-rank percentile of samples already sorted in ascending order
+
+double percentile(const vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t rank = (size_t) ceil(p * sorted.size());
+    return sorted[min(sorted.size(), max<size_t>(rank, 1)) - 1];
+}
+
+// allEngines
+//
+// The engines of PrimeCPP, PrimeCPP_PAR and PrimeCPP_Threaded, named after the program they come from
+
+vector<bench_engine> allEngines(const bench_options &options)
+{
+    vector<bench_engine> engines;
+    const uint64_t cbSegment = options.segmentKB * 1024;
+    const bool bReuse = options.reuse;
+    auto arena = [bReuse] { return bReuse ? &buffer_arena<uint64_t>::local() : nullptr; };
+
+    for (bool segmented : { false, true })
+    {
+        engines.push_back({ segmented ? "primecpp/segmented" : "primecpp/basic", false,
+            [=](uint64_t limit, thread_pool &, bench_runner &runner)
+            {
+                runner = makeRunner([=]
+                {
+                    struct sieve : primecpp::prime_sieve
+                    {
+                        bool Segmented;
+                        sieve(uint64_t n, buffer_arena<uint64_t> *a, bool s) : primecpp::prime_sieve(n, a), Segmented(s) {}
+                        double runSieve(const cancel_token *token = nullptr)
+                        {
+                            return Segmented ? runSieveSegmented(token) : primecpp::prime_sieve::runSieve(token);
+                        }
+                    };
+                    return unique_ptr<sieve>(new sieve(limit, arena(), segmented));
+                });
+                return true;
+            } });
+    }
+
+    for (auto &e : par::ENGINES)
+    {
+        const par::sieve_engine engine = e.engine;
+        const string name = string("par/") + e.name;
+
+        auto fixed = [](auto storage, auto wheel)
+        {
+            return [](uint64_t limit, thread_pool &, bench_runner &runner)
+            {
+                return withFixedLimit(limit, [&](auto fixedLimit)
+                {
+                    typedef fixed_sieve<decltype(fixedLimit)::value, decltype(storage), decltype(wheel)> sieve;
+                    runner = makeRunner([] { return unique_ptr<sieve>(new sieve); });
+                });
+            };
+        };
+
+        switch (engine)
+        {
+            case par::sieve_engine::fixed_odd:       engines.push_back({ name, false, fixed(packed_bits(), wheel2()) });   break;
+            case par::sieve_engine::fixed_odd_bytes: engines.push_back({ name, false, fixed(byte_flags(), wheel2()) });    break;
+            case par::sieve_engine::fixed_wheel30:   engines.push_back({ name, false, fixed(packed_bits(), wheel30()) });  break;
+            case par::sieve_engine::fixed_wheel210:  engines.push_back({ name, false, fixed(packed_bits(), wheel210()) }); break;
+
+            case par::sieve_engine::wheel30:
+                engines.push_back({ name, false, [=](uint64_t limit, thread_pool &, bench_runner &runner)
+                {
+                    runner = makeRunner([=] { return unique_ptr<wheel_sieve<wheel30>>(new wheel_sieve<wheel30>(limit, arena())); });
+                    return true;
+                } });
+                break;
+
+            case par::sieve_engine::wheel210:
+                engines.push_back({ name, false, [=](uint64_t limit, thread_pool &, bench_runner &runner)
+                {
+                    runner = makeRunner([=] { return unique_ptr<wheel_sieve<wheel210>>(new wheel_sieve<wheel210>(limit, arena())); });
+                    return true;
+                } });
+                break;
+
+            default:
+                engines.push_back({ name, engine == par::sieve_engine::parallel, [=](uint64_t limit, thread_pool &pool, bench_runner &runner)
+                {
+                    thread_pool *shared = engine == par::sieve_engine::parallel ? &pool : nullptr;
+                    runner = makeRunner([=] { return unique_ptr<par::prime_sieve>(new par::prime_sieve(limit, engine, cbSegment, shared, arena())); });
+                    return true;
+                } });
+                break;
+        }
+    }
+
+    for (auto &e : threaded::ENGINES)
+    {
+        const threaded::sieve_engine engine = e.engine;
+        engines.push_back({ string("threaded/") + e.name, true, [=](uint64_t limit, thread_pool &pool, bench_runner &runner)
+        {
+            runner = makeRunner([=, &pool] { return unique_ptr<threaded::prime_sieve>(new threaded::prime_sieve(limit, pool, engine, cbSegment, bReuse)); });
+            return true;
+        } });
+    }
+
+    return engines;
+}
+
+// runBenchmark
+//
+// Times one engine at one limit on one pool.  Rounds are started until options.seconds have passed; the round that
+// runs past that point is left out (unless it is the only one), so a long final pass can't skew the rate, and every
+// pass counted was timed on its own from start to finish.  Once there is a round to report, the timed rounds carry a
+// token with the deadline on it, so the one left out stops at the deadline instead of running to its end.
+
+bench_result runBenchmark(const bench_engine &engine, const bench_runner &runner, uint64_t limit, thread_pool &pool,
+                          const bench_options &options)
+{
+    const unsigned cThreads = (unsigned) pool.size();
+    vector<double> sieveTimes(engine.shared ? 1 : cThreads);
+    vector<double> sieveShares(sieveTimes.size());
+
+    auto round = [&](const cancel_token *token)
+    {
+        if (engine.shared)
+        {
+            auto tStart = steady_clock::now();
+            sieveShares[0] = runner.pass(token);
+            sieveTimes[0] = duration<double>(steady_clock::now() - tStart).count();
+        }
+        else
+        {
+            pool.run([&](unsigned w)
+            {
+                auto tStart = steady_clock::now();
+                sieveShares[w] = runner.pass(token);
+                sieveTimes[w] = duration<double>(steady_clock::now() - tStart).count();
+            });
+        }
+        return *min_element(sieveShares.begin(), sieveShares.end()) >= 1.0;
+    };
+
+    for (unsigned i = 0; i < options.warmup; i++)
+        round(nullptr);
+
+    vector<double> samples;
+    double roundTime = 0;
+    const auto tStart = steady_clock::now();
+    const auto tDeadline = tStart + duration_cast<steady_clock::duration>(duration<double>(options.seconds));
+    const cancel_token deadline(tDeadline);
+    while (steady_clock::now() < tDeadline)
+    {
+        auto tRound = steady_clock::now();
+        const bool whole = round(samples.empty() ? nullptr : &deadline);
+        auto tEnd = steady_clock::now();
+        if ((tEnd > tDeadline || !whole) && !samples.empty())
+            break;
+        roundTime += duration<double>(tEnd - tRound).count();
+        samples.insert(samples.end(), sieveTimes.begin(), sieveTimes.end());
+    }
+
+    bench_result result;
+    result.engine = engine.name;
+    result.limit = limit;
+    result.threads = cThreads;
+    result.pages = pageKindName(sieve_pages::get().obtained());
+    result.passes = samples.size();
+
+    sort(samples.begin(), samples.end());
+    double total = 0;
+    for (auto t : samples)
+        total += t;
+    result.min = samples.empty() ? 0 : samples.front();
+    result.median = percentile(samples, 0.5);
+    result.p99 = percentile(samples, 0.99);
+    result.mean = samples.empty() ? 0 : total / samples.size();
+    result.passesPerSecond = roundTime > 0 ? samples.size() / roundTime : 0;
+
+    const uint64_t expected = expectedPrimeCount(limit);
+    result.valid = expected && runner.check() == expected;
+    return result;
+}
+
+// runQueryBenchmark
+//
+// Times isPrime queries against a finished PrimeCPP_PAR sieve at one limit: the same random batch (uniform below the
+// limit, with a few past it) answered by looping over isPrime and by isPrimeBatch, each repeated until
+// options.seconds have passed.  Prints nanoseconds per query for both, and returns whether they agreed.
+
+bool runQueryBenchmark(uint64_t limit, const bench_options &options, bool bQuiet)
+{
+    par::prime_sieve sieve(limit, par::sieve_engine::segmented, options.segmentKB * 1024);
+    sieve.runSieve();
+
+    mt19937_64 random(limit);
+    vector<uint64_t> queries(options.queries);
+    for (auto &q : queries)
+        q = random() % (limit + limit / 64 + 1);
+    vector<uint8_t> looped(queries.size()), batched(queries.size());
+
+    auto time = [&](auto answer)
+    {
+        uint64_t rounds = 0;
+        const auto tStart = steady_clock::now();
+        const auto tDeadline = tStart + duration_cast<steady_clock::duration>(duration<double>(options.seconds));
+        do
+        {
+            answer();
+            rounds++;
+        } while (steady_clock::now() < tDeadline);
+        return duration<double>(steady_clock::now() - tStart).count() * 1e9 / (rounds * max<size_t>(queries.size(), 1));
+    };
+
+    const double loop = time([&]
+    {
+        for (size_t i = 0; i < queries.size(); i++)
+            looped[i] = queries[i] < limit && sieve.isPrime(queries[i]);
+    });
+    const double batch = time([&] { sieve.isPrimeBatch(queries.data(), queries.size(), batched.data()); });
+
+    const bool valid = looped == batched;
+    if (!bQuiet)
+        printf("Queries: %llu, Limit: %llu, Loop: %.2f ns, Batch: %.2f ns, Speedup: %.2fx, Valid : %s\n",
+            (unsigned long long) queries.size(), (unsigned long long) limit, loop, batch, batch > 0 ? loop / batch : 0.0,
+            valid ? "Pass" : "FAIL!");
+    return valid;
+}
+
+// writeCsv, writeJson
+//
+// The results in a form that can be diffed and plotted from build to build
+
+void writeCsv(FILE *out, const vector<bench_result> &results)
+{
+    fprintf(out, "engine,limit,threads,pages,passes,min,median,p99,mean,passes_per_sec,valid\n");
+    for (auto &r : results)
+        fprintf(out, "%s,%llu,%u,%s,%llu,%.9f,%.9f,%.9f,%.9f,%.3f,%s\n",
+            r.engine.c_str(), (unsigned long long) r.limit, r.threads, r.pages, (unsigned long long) r.passes,
+            r.min, r.median, r.p99, r.mean, r.passesPerSecond, r.valid ? "true" : "false");
+}
+
+void writeJson(FILE *out, const vector<bench_result> &results)
+{
+    fprintf(out, "[\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        auto &r = results[i];
+        fprintf(out, "  { \"engine\": \"%s\", \"limit\": %llu, \"threads\": %u, \"pages\": \"%s\", \"passes\": %llu, \"min\": %.9f, "
+                     "\"median\": %.9f, \"p99\": %.9f, \"mean\": %.9f, \"passes_per_sec\": %.3f, \"valid\": %s }%s\n",
+            r.engine.c_str(), (unsigned long long) r.limit, r.threads, r.pages, (unsigned long long) r.passes,
+            r.min, r.median, r.p99, r.mean, r.passesPerSecond, r.valid ? "true" : "false",
+            i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "]\n");
+}
+
+bool writeResults(const string &path, void (*write)(FILE *, const vector<bench_result> &), const vector<bench_result> &results)
+{
+    if (path == "-")
+    {
+        write(stdout, results);
+        return true;
+    }
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out)
+    {
+        fprintf(stderr, "Can't write %s\n", path.c_str());
+        return false;
+    }
+    write(out, results);
+    fclose(out);
+    return true;
+}
+
+// splitList
+//
+// "a,b,c" as its comma-separated items, each passed through parse
+
+template <typename T, typename Parse>
+vector<T> splitList(const string &list, Parse parse)
+{
+    vector<T> items;
+    size_t start = 0;
+    while (start <= list.size())
+    {
+        size_t end = list.find(',', start);
+        if (end == string::npos)
+            end = list.size();
+        if (end > start)
+            items.push_back(parse(list.substr(start, end - start)));
+        start = end + 1;
+    }
+    return items;
+}
+
+int main(int argc, char **argv)
+{
+    vector<string> args(argv + 1, argv + argc);         // From first to last argument in the argv array
+    bench_options options;
+    string csvPath, jsonPath;
+    auto bQuiet = false;
+
+    options.threads = { 1, max(1u, thread::hardware_concurrency()) };
+    if (options.threads[1] == 1)
+        options.threads.pop_back();
+
+    // Process command-line args
+
+    for (auto i = args.begin(); i != args.end(); ++i)
+    {
+        auto next = [&] { return ++i == args.end() ? (--i, string()) : *i; };
+
+        if (*i == "-h" || *i == "--help") {
+              cout << "Syntax: " << argv[0] << " [-l,--limits limit,...] [-t,--threads threads,...] [-P,--pages 4k|thp|2m|1g,...] [-e,--engines name|prefix,...] [-w,--warmup rounds] [-s,--seconds seconds] [-g,--segment KB] [-r,--reuse] [-c,--csv file|-] [-j,--json file|-] [-q,--quiet] [-L,--list] [-Q,--queries count] [-h] " << endl;
+            return 0;
+        }
+        else if (*i == "-l" || *i == "--limits")
+            options.limits = splitList<uint64_t>(next(), [](const string &s) { return (uint64_t) max(1LL, atoll(s.c_str())); });
+        else if (*i == "-t" || *i == "--threads")
+            options.threads = splitList<unsigned>(next(), [](const string &s) { return (unsigned) max(1, atoi(s.c_str())); });
+        else if (*i == "-P" || *i == "--pages")
+        {
+            options.pages.clear();
+            for (auto &name : splitList<string>(next(), [](const string &s) { return s; }))
+            {
+                page_kind kind;
+                if (!parsePageKind(name, kind))
+                {
+                    fprintf(stderr, "Unknown page size: %s\n", name.c_str());
+                    return 1;
+                }
+                options.pages.push_back(kind);
+            }
+        }
+        else if (*i == "-e" || *i == "--engines")
+            options.engines = splitList<string>(next(), [](const string &s) { return s; });
+        else if (*i == "-w" || *i == "--warmup")
+            options.warmup = (unsigned) max(0, atoi(next().c_str()));
+        else if (*i == "-s" || *i == "--seconds")
+            options.seconds = max(0.001, atof(next().c_str()));
+        else if (*i == "-g" || *i == "--segment")
+            options.segmentKB = (uint64_t) max(1LL, atoll(next().c_str()));
+        else if (*i == "-r" || *i == "--reuse")
+            options.reuse = true;
+        else if (*i == "-c" || *i == "--csv")
+            csvPath = next();
+        else if (*i == "-j" || *i == "--json")
+            jsonPath = next();
+        else if (*i == "-q" || *i == "--quiet")
+            bQuiet = true;
+        else if (*i == "-Q" || *i == "--queries")
+            options.queries = (uint64_t) max(1LL, atoll(next().c_str()));
+        else if (*i == "-L" || *i == "--list")
+        {
+            for (auto &e : allEngines(options))
+                cout << e.name << endl;
+            return 0;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown argument: %s\n", i->c_str());
+            return 1;
+        }
+    }
+
+    // -Q benchmarks isPrime queries instead of sieving, at each of the limits
+
+    if (options.queries)
+    {
+        auto bValid = true;
+        for (auto limit : options.limits)
+            bValid = runQueryBenchmark(limit, options, bQuiet) && bValid;
+        return bValid ? 0 : 1;
+    }
+
+    // An engine is picked if its name is on the list, or starts with an entry ending in '/', such as "par/"
+
+    vector<bench_engine> engines;
+    for (auto &e : allEngines(options))
+    {
+        bool picked = options.engines.empty();
+        for (auto &name : options.engines)
+            picked = picked || name == e.name || name == "all" ||
+                     (!name.empty() && name.back() == '/' && e.name.compare(0, name.size(), name) == 0);
+        if (picked)
+            engines.push_back(e);
+    }
+    if (engines.empty())
+    {
+        fprintf(stderr, "No engines match\n");
+        return 1;
+    }
+
+    if (!bQuiet)
+    {
+        cout << "Primes Benchmark (c) 2021 Dave's Garage - http://github.com/davepl/primes" << endl;
+        cout << "-------------------------------------------------------------------------" << endl;
+    }
+
+    // The pool for each thread count is made once and shared by every engine and limit run on it, so thread
+    // creation is never part of a round.
+
+    vector<bench_result> results;
+    auto bValid = true;
+    for (auto cThreads : options.threads)
+    {
+        thread_pool pool(cThreads);
+        for (auto limit : options.limits)
+        {
+            for (auto &engine : engines)
+            {
+                bench_runner runner;
+                if (!engine.prepare(limit, pool, runner))
+                {
+                    if (!bQuiet)
+                        fprintf(stderr, "Skipping %s at limit %llu\n", engine.name.c_str(), (unsigned long long) limit);
+                    continue;
+                }
+
+                // Each page size gets its own row, next to the others.  Emptying the arenas makes the next buffers
+                // new ones, on the pages now asked for.
+
+                for (auto kind : options.pages)
+                {
+                    sieve_pages::get().request(kind);
+                    buffer_arena<uint64_t>::local().clear();
+                    pool.run([](unsigned) { buffer_arena<uint64_t>::local().clear(); });
+
+                    auto result = runBenchmark(engine, runner, limit, pool, options);
+                    results.push_back(result);
+                    bValid = bValid && result.valid;
+
+                    if (!bQuiet)
+                        printf("Engine: %s, Limit: %llu, Threads: %u, Pages: %s, Passes: %llu, Min: %.6f, Median: %.6f, "
+                               "P99: %.6f, Mean: %.6f, Passes/sec: %.2f, Valid : %s\n",
+                            result.engine.c_str(), (unsigned long long) result.limit, result.threads, result.pages,
+                            (unsigned long long) result.passes, result.min, result.median, result.p99, result.mean,
+                            result.passesPerSecond, result.valid ? "Pass" : "FAIL!");
+                }
+            }
+        }
+    }
+
+    if (!csvPath.empty() && !writeResults(csvPath, writeCsv, results))
+        return 1;
+    if (!jsonPath.empty() && !writeResults(jsonPath, writeJson, results))
+        return 1;
+
+    // Unlike the single-engine programs, which return their count, this returns nonzero if any engine was wrong
+
+    return bValid ? 0 : 1;
+}
@@ -2,6 +2,7 @@
 // PrimeCPP.cpp : Dave's Garage Prime Sieve in C++ - No warranty for anything!
 // ---------------------------------------------------------------------------
 
+#include <cerrno>
 #include <chrono>
 #include <ctime>
 #include <iostream>
@@ -12,143 +13,67 @@
 #include <vector>
 #include <thread>
 #include <memory>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+#include "../PrimeCPP_Common/buffer_arena.h"
+#include "../PrimeCPP_Common/cancel_token.h"
+#include "../PrimeCPP_Common/distributed_sieve.h"
+#include "../PrimeCPP_Common/fixed_sieve.h"
+#include "../PrimeCPP_Common/numa.h"
+#include "../PrimeCPP_Common/odd_bits.h"
+#include "../PrimeCPP_Common/perf_counters.h"
+#include "../PrimeCPP_Common/presieve.h"
+#include "../PrimeCPP_Common/prime_counts.h"
+#include "../PrimeCPP_Common/prime_stream.h"
+#include "../PrimeCPP_Common/prime_writer.h"
+#include "../PrimeCPP_Common/range_sieve.h"
+#include "../PrimeCPP_Common/segmented_sieve.h"
+#include "../PrimeCPP_Common/sieve_buffer.h"
+#include "../PrimeCPP_Common/sieve_cache.h"
+#include "../PrimeCPP_Common/sieve_service.h"
+#include "../PrimeCPP_Common/thread_pool.h"
+#include "../PrimeCPP_Common/wheel_sieve.h"
+#include "PrimeCPP_PAR.h"
 
 using namespace std;
 using namespace std::chrono;
+using namespace par;
 
 const uint64_t DEFAULT_UPPER_LIMIT = 10'000'000LLU;
+const uint64_t DEFAULT_SHARD       = 1'000'000'000LLU;    // Numbers per shard handed to a worker
 
-// prime_sieve
+// parseRange
 //
-// Represents the data comprising the sieve (an array of N bits, where N is the upper limit prime being tested)
-// as well as the code needed to eliminate non-primes from its array, which you perform by calling runSieve.
+// "lo:hi", or just "hi" for 0:hi.  Returns false for an empty argument.
 
-class prime_sieve
+bool parseRange(const string &range, uint64_t &lo, uint64_t &hi)
 {
-  private:
-
-      vector<bool> Bits;                                        // Sieve data, where 1==prime, 0==not
-
-   public:
-
-      prime_sieve(uint64_t n) : Bits(n, true)                  // Initialize all to true (potential primes)
-      {
-      }
-
-      ~prime_sieve()
-      {
-      }
-
-      // runSieve
-      //
-      // Scan the array for the next factor (>2) that hasn't yet been eliminated from the array, and then
-      // walk through the array crossing off every multiple of that factor.
-
-      void runSieve()
-      {
-          uint64_t factor = 3;
-          uint64_t q = (int) sqrt(Bits.size());
-
-          while (factor <= q)
-          {
-              for (uint64_t num = factor; num < Bits.size(); num += 2)
-              {
-                  if (Bits[num])
-                  {
-                      factor = num;
-                      break;
-                  }
-              }
-              for (uint64_t num = factor * factor; num < Bits.size(); num += factor * 2)
-                  Bits[num] = false;
-
-              factor += 2;            
-          }
-      }
-
-      // countPrimes
-      //
-      // Can be called after runSieve to determine how many primes were found in total
-
-      size_t countPrimes() const
-      {
-          size_t count = (Bits.size() >= 2);                   // Count 2 as prime if within range
-          for (int i = 3; i < Bits.size(); i+=2)
-              if (Bits[i])
-                  count++;
-          return count;
-      }
-
-      // isPrime 
-      // 
-      // Can be called after runSieve to determine whether a given number is prime. 
-
-      bool isPrime(uint64_t n) const
-      {
-          if (n & 1)
-              return Bits[n];
-          else
-              return false;
-      }
-
-      // validateResults
-      //
-      // Checks to see if the number of primes found matches what we should expect.  This data isn't used in the
-      // sieve processing at all, only to sanity check that the results are right when done.
-
-      bool validateResults() const
-      {
-          const std::map<const uint64_t, const int> resultsDictionary =
-          {
-                {             10LLU, 4         },               // Historical data for validating our results - the number of primes
-                {            100LLU, 25        },               // to be found under some limit, such as 168 primes under 1000
-                {          1'000LLU, 168       },
-                {         10'000LLU, 1229      },
-                {        100'000LLU, 9592      },
-                {      1'000'000LLU, 78498     },
-                {     10'000'000LLU, 664579    },
-                {    100'000'000LLU, 5761455   },
-                {  1'000'000'000LLU, 50847534  },
-                { 10'000'000'000LLU, 455052511 },
-          };
-          if (resultsDictionary.end() == resultsDictionary.find(Bits.size()))
-              return false;
-          return resultsDictionary.find(Bits.size())->second == countPrimes();
-      }
-
-      // printResults
-      //
-      // Displays stats about what was found as well as (optionally) the primes themselves
-
-      void printResults(bool showResults, double duration, size_t passes, size_t threads) const
-      {
-          if (showResults)
-              cout << "2, ";
-
-          size_t count = (Bits.size() >= 2);                   // Count 2 as prime if in range
-          for (uint64_t num = 3; num <= Bits.size(); num+=2)
-          {
-              if (Bits[num])
-              {
-                  if (showResults)
-                      cout << num << ", ";
-                  count++;
-              }
-          }
-
-          if (showResults)
-              cout << "\n";
-          
-          cout << "Passes: "  << passes << ", "
-               << "Threads: " << threads << ", "
-               << "Time: "    << duration << ", " 
-               << "Average: " << duration/passes << ", "
-               << "Limit: "   << Bits.size() << ", "
-               << "Counts: "  << count << "/" << countPrimes() << ", "
-               << "Valid : "  << (validateResults() ? "Pass" : "FAIL!") 
-               << "\n";
-      }
-};
+    auto colon = range.find(':');
+    lo = (colon == string::npos) ? 0 : strtoull(range.c_str(), nullptr, 10);
+    hi = strtoull(range.c_str() + (colon == string::npos ? 0 : colon + 1), nullptr, 10);
+    return !range.empty();
+}
+
+// parseLimits
+//
+// "a,b,c", a comma separated list of limits.  Returns false if there are none.
+
+bool parseLimits(const string &list, vector<uint64_t> &limits)
+{
+    for (size_t start = 0; start < list.size(); )
+    {
+        auto comma = list.find(',', start);
+        if (comma == string::npos)
+            comma = list.size();
+        if (comma > start)
+            limits.push_back(strtoull(list.substr(start, comma - start).c_str(), nullptr, 10));
+        start = comma + 1;
+    }
+    return !limits.empty();
+}
 
 int main(int argc, char **argv)
 {
@@ -159,13 +84,40 @@ int main(int argc, char **argv)
     auto bPrintPrimes      = false;
     auto bOneshot          = false;
     auto bQuiet            = false;
+    auto bReuse            = false;
+    auto bCounters         = false;
+    auto bPin              = false;
+    auto bNuma             = false;
+    auto ePages            = page_kind::normal;
+    auto bStream           = false;
+    uint64_t ullStreamLo   = 0;
+    uint64_t ullStreamHi   = 0;
+    auto bRange            = false;
+    uint64_t ullRangeLo    = 0;
+    uint64_t ullRangeHi    = 0;
+    uint64_t ullWindow     = 0;
+    vector<uint64_t> extendLimits;
+    auto uWorkerPort       = 0;
+    vector<string> workers;
+    uint64_t ullShard      = DEFAULT_SHARD;
+    uint64_t ullStride     = 0;
+    auto eFormat           = prime_format::text;
+    string strOutput;
+    string strCache;
+    auto bCount            = false;
+    uint64_t ullCountLo    = 0;
+    uint64_t ullCountHi    = 0;
+    auto bServe            = false;
+    uint64_t ullLru        = 64;
+    auto ullSegmentKB      = DEFAULT_SEGMENT_KB;
+    vector<sieve_engine> engines;
 
     // Process command-line args
 
     for (auto i = args.begin(); i != args.end(); ++i) 
     {
         if (*i == "-h" || *i == "--help") {
-              cout << "Syntax: " << argv[0] << " [-t,--threads threads] [-s,--seconds seconds] [-l,--limit limit] [-1,--oneshot] [-q,--quiet] [-h] " << endl;
+              cout << "Syntax: " << argv[0] << " [-t,--threads threads] [-s,--seconds seconds] [-l,--limit limit] [-1,--oneshot] [-q,--quiet] [-e,--engine basic|segmented|parallel|wheel30|wheel210|fixed-odd|fixed-odd-bytes|fixed-wheel30|fixed-wheel210|all] [-g,--segment KB] [-r,--reuse] [-c,--counters] [--pin] [--numa] [-H,--hugepages thp|2m|1g] [--stream [lo:]hi] [--range [lo:]hi [--window numbers]] [--extend limit,limit,...] [--worker port] [--coordinate host:port|local[,...] [--shard numbers] [--stride numbers]] [-f,--format text|u32|u64|delta] [-o,--output file] [--cache file [--count [lo:]hi]] [--serve [--lru segments]] [-h] " << endl;
             return 0;
         }
         else if (*i == "-t" || *i == "--threads") 
@@ -197,6 +149,146 @@ int main(int argc, char **argv)
         {
              bQuiet = true;
         }        
+        else if (*i == "-e" || *i == "--engine") 
+        {
+            i++;
+            string name = (i == args.end()) ? "" : *i;
+            auto cEngines = engines.size();
+            for (auto &e : ENGINES)
+                if (name == e.name || name == "all")
+                    engines.push_back(e.engine);
+            if (engines.size() == cEngines)
+            {
+                fprintf(stderr, "Unknown engine: %s", name.c_str());
+                return 0;
+            }
+        }
+        else if (*i == "-g" || *i == "--segment") 
+        {
+            i++;
+            ullSegmentKB = (i == args.end()) ? DEFAULT_SEGMENT_KB : max((long long)1, atoll(i->c_str()));
+        }
+        else if (*i == "-r" || *i == "--reuse") 
+        {
+             bReuse = true;
+        }
+        else if (*i == "-c" || *i == "--counters") 
+        {
+             bCounters = true;
+        }
+        else if (*i == "--pin") 
+        {
+             bPin = true;
+        }
+        else if (*i == "--numa") 
+        {
+             bPin = bNuma = true;
+        }
+        else if (*i == "-H" || *i == "--hugepages") 
+        {
+            i++;
+            if (i == args.end() || !parsePageKind(*i, ePages) || ePages == page_kind::normal)
+            {
+                fprintf(stderr, "Unknown page size: %s", i == args.end() ? "" : i->c_str());
+                return 0;
+            }
+        }
+        else if (*i == "--stream") 
+        {
+            i++;
+            bStream = parseRange((i == args.end()) ? "" : *i, ullStreamLo, ullStreamHi);
+        }
+        else if (*i == "--range") 
+        {
+            i++;
+            bRange = parseRange((i == args.end()) ? "" : *i, ullRangeLo, ullRangeHi);
+        }
+        else if (*i == "--window") 
+        {
+            i++;
+            ullWindow = (i == args.end()) ? 0 : strtoull(i->c_str(), nullptr, 10);
+        }
+        else if (*i == "--extend") 
+        {
+            i++;
+            if (!parseLimits((i == args.end()) ? "" : *i, extendLimits))
+            {
+                fprintf(stderr, "No limits to extend to\n");
+                return 0;
+            }
+        }
+        else if (*i == "--worker") 
+        {
+            i++;
+            uWorkerPort = (i == args.end()) ? 0 : atoi(i->c_str());
+            if (uWorkerPort <= 0 || uWorkerPort > 65535)
+            {
+                fprintf(stderr, "Bad port: %s", i == args.end() ? "" : i->c_str());
+                return 0;
+            }
+        }
+        else if (*i == "--coordinate") 
+        {
+            i++;
+            string list = (i == args.end()) ? "" : *i;
+            for (size_t start = 0; start < list.size(); )
+            {
+                auto comma = list.find(',', start);
+                if (comma == string::npos)
+                    comma = list.size();
+                if (comma > start)
+                    workers.push_back(list.substr(start, comma - start));
+                start = comma + 1;
+            }
+            if (workers.empty())
+            {
+                fprintf(stderr, "No workers to coordinate");
+                return 0;
+            }
+        }
+        else if (*i == "--shard") 
+        {
+            i++;
+            ullShard = (i == args.end()) ? DEFAULT_SHARD : max(1ULL, strtoull(i->c_str(), nullptr, 10));
+        }
+        else if (*i == "--stride") 
+        {
+            i++;
+            ullStride = (i == args.end()) ? 0 : strtoull(i->c_str(), nullptr, 10);
+        }
+        else if (*i == "-f" || *i == "--format") 
+        {
+            i++;
+            if (i == args.end() || !parsePrimeFormat(*i, eFormat))
+            {
+                fprintf(stderr, "Unknown format: %s", i == args.end() ? "" : i->c_str());
+                return 0;
+            }
+        }
+        else if (*i == "-o" || *i == "--output") 
+        {
+            i++;
+            strOutput = (i == args.end()) ? "" : *i;
+        }
+        else if (*i == "--cache") 
+        {
+            i++;
+            strCache = (i == args.end()) ? "" : *i;
+        }
+        else if (*i == "--count") 
+        {
+            i++;
+            bCount = parseRange((i == args.end()) ? "" : *i, ullCountLo, ullCountHi);
+        }
+        else if (*i == "--serve") 
+        {
+            bServe = true;
+        }
+        else if (*i == "--lru") 
+        {
+            i++;
+            ullLru = (i == args.end()) ? 64 : max(1ULL, strtoull(i->c_str(), nullptr, 10));
+        }
         else 
         {
             fprintf(stderr, "Unknown argument: %s", i->c_str());
@@ -219,10 +311,369 @@ int main(int argc, char **argv)
         return 0;
     }
 
-    auto cPasses      = 0;
     auto cSeconds     = (cSecondsRequested ? cSecondsRequested : 5);
     auto cThreads     = (cThreadsRequested ? cThreadsRequested : thread::hardware_concurrency());
     auto llUpperLimit = (ullLimitRequested ? ullLimitRequested : DEFAULT_UPPER_LIMIT);
+    auto cbSegment    = ullSegmentKB * 1024;
+
+    if (engines.empty())
+        engines.push_back(sieve_engine::basic);
+
+    // --stream lists (with -p or -o) or just counts the primes in [lo, hi) without ever holding the whole range:
+    // the segmented engine sieves one segment at a time and hands over its primes before moving on, so hi can be
+    // far past any limit we could allocate a sieve for.  The list goes to stdout, or with -o to a file, in the
+    // --format asked for; the writer formats into a buffer and leaves the writing to a thread of its own.
+
+    if (bStream)
+    {
+        if (eFormat == prime_format::u32 && ullStreamHi > (1ULL << 32))
+        {
+            fprintf(stderr, "Primes up to %llu don't fit in u32", (unsigned long long) ullStreamHi);
+            return 0;
+        }
+        FILE *fOutput = strOutput.empty() ? stdout : fopen(strOutput.c_str(), "wb");
+        if (!fOutput)
+        {
+            fprintf(stderr, "Cannot open output: %s", strOutput.c_str());
+            return 0;
+        }
+
+        auto tStart = steady_clock::now();
+        uint64_t found = 0;
+        if (bPrintPrimes || !strOutput.empty())
+        {
+            prime_writer out(fOutput, eFormat);
+            found = forEachPrime(ullStreamLo, ullStreamHi, [&out](uint64_t p) { out.write(p); }, cbSegment);
+            out.finish();
+            if (!out.ok())
+                fprintf(stderr, "Writing the primes failed\n");
+        }
+        else
+            found = forEachPrime(ullStreamLo, ullStreamHi, [](uint64_t) {}, cbSegment);
+        auto duration = duration_cast<microseconds>(steady_clock::now() - tStart).count()/1000000.0;
+        if (fOutput != stdout)
+            fclose(fOutput);
+
+        uint64_t expected = 0;
+        auto bKnown = ullStreamLo <= 2 && knownPrimeCount(ullStreamHi, expected);
+        printf("Range: %llu:%llu, Time: %f, Count: %llu, Valid : %s, Engine: stream\n",
+            (unsigned long long) ullStreamLo, (unsigned long long) ullStreamHi, duration, (unsigned long long) found,
+            !bKnown ? "n/a" : found == expected ? "Pass" : "FAIL!");
+        return bKnown && found != expected ? 0 : (int) found;
+    }
+
+    // --worker serves shards to a coordinator, from now until it's killed, one thread and range_sieve per connection.
+
+    if (uWorkerPort)
+    {
+        shard_worker worker;
+        if (!worker.listen((uint16_t) uWorkerPort))
+        {
+            fprintf(stderr, "Worker: %s (%d)\n", worker.error(), uWorkerPort);
+            return 0;
+        }
+        printf("Worker listening on port %d\n", uWorkerPort);
+        fflush(stdout);
+        worker.serve();
+        return 0;
+    }
+
+    // --coordinate shards [0, limit), or the --range, across the workers listed and merges their counts.  Each
+    // shard's end is a checkpoint, and with --stride so is every multiple of it; any PRIME_COUNTS has an entry for is
+    // checked, so with the default shard of 10^9 a run to 10^12 checks pi at 10^9, 10^10, 10^11 and 10^12.
+
+    if (!workers.empty())
+    {
+        const uint64_t lo = bRange ? ullRangeLo : 0;
+        const uint64_t hi = bRange ? ullRangeHi : llUpperLimit;
+        auto tStart = steady_clock::now();
+        shard_coordinator coordinator(workers);
+        const bool ok = coordinator.run(lo, hi, ullShard, ullStride);
+        auto duration = duration_cast<microseconds>(steady_clock::now() - tStart).count()/1000000.0;
+
+        for (const auto &w : coordinator.workers())
+            printf("Worker: %s, Shards: %llu, Busy: %f%s\n", w.address.c_str(), (unsigned long long) w.shards, w.busy,
+                w.failed ? ", Failed" : "");
+        if (!ok)
+        {
+            fprintf(stderr, "Coordinator: %s\n", coordinator.error());
+            return 0;
+        }
+        if (ullStride && !bQuiet)
+        {
+            for (const auto &point : coordinator.checkpoints())
+            {
+                uint64_t expected = 0;
+                const bool bKnown = lo <= 2 && knownPrimeCount(point.limit, expected);
+                printf("Checkpoint: %llu, Count: %llu%s\n", (unsigned long long) point.limit, (unsigned long long) point.count,
+                    !bKnown ? "" : expected == point.count ? ", Valid : Pass" : ", Valid : FAIL!");
+            }
+        }
+
+        size_t checked = 0;
+        const bool valid = coordinator.validate(checked);
+        const uint64_t found = coordinator.count();
+        printf("Range: %llu:%llu, Shards: %zu, Workers: %zu, Time: %f, Count: %llu, Checked: %zu, Valid : %s, Engine: distributed\n",
+            (unsigned long long) lo, (unsigned long long) hi, coordinator.shards().size(), workers.size(), duration,
+            (unsigned long long) found, checked, !valid ? "FAIL!" : checked ? "Pass" : "n/a");
+        return valid ? (int) found : 0;
+    }
+
+    // --range sieves [lo, hi) as windows of --window numbers each (all of it in one window by default), one after the
+    // other through one range_sieve: memory goes on one window and the base primes up to sqrt(hi), which are worked
+    // out for the first window and reused by the rest.  Like --stream it lists the primes with -p or -o.
+
+    if (bRange)
+    {
+        if (eFormat == prime_format::u32 && ullRangeHi > (1ULL << 32))
+        {
+            fprintf(stderr, "Primes up to %llu don't fit in u32", (unsigned long long) ullRangeHi);
+            return 0;
+        }
+        FILE *fOutput = strOutput.empty() ? stdout : fopen(strOutput.c_str(), "wb");
+        if (!fOutput)
+        {
+            fprintf(stderr, "Cannot open output: %s", strOutput.c_str());
+            return 0;
+        }
+
+        auto tStart = steady_clock::now();
+        const uint64_t window = ullWindow ? ullWindow : std::max<uint64_t>(ullRangeHi - std::min(ullRangeLo, ullRangeHi), 1);
+        range_sieve sieve(ullRangeHi, cbSegment);
+        uint64_t found = 0, windows = 0;
+        auto sieveWindows = [&](auto &&each)
+        {
+            for (uint64_t lo = ullRangeLo; lo < ullRangeHi; lo += std::min(window, ullRangeHi - lo), windows++)
+            {
+                sieve.sieve(lo, lo + std::min(window, ullRangeHi - lo));
+                found += sieve.count();
+                each();
+            }
+        };
+        if (bPrintPrimes || !strOutput.empty())
+        {
+            prime_writer out(fOutput, eFormat);
+            sieveWindows([&] { sieve.forEachPrime([&out](uint64_t p) { out.write(p); }); });
+            out.finish();
+            if (!out.ok())
+                fprintf(stderr, "Writing the primes failed\n");
+        }
+        else
+            sieveWindows([] {});
+        auto duration = duration_cast<microseconds>(steady_clock::now() - tStart).count()/1000000.0;
+        if (fOutput != stdout)
+            fclose(fOutput);
+
+        uint64_t expected = 0;
+        auto bKnown = ullRangeLo <= 2 && knownPrimeCount(ullRangeHi, expected);
+        printf("Range: %llu:%llu, Windows: %llu, Base primes: %zu, Time: %f, Count: %llu, Valid : %s, Engine: range\n",
+            (unsigned long long) ullRangeLo, (unsigned long long) ullRangeHi, (unsigned long long) windows,
+            sieve.basePrimes().size(), duration, (unsigned long long) found,
+            !bKnown ? "n/a" : found == expected ? "Pass" : "FAIL!");
+        return bKnown && found != expected ? 0 : (int) found;
+    }
+
+    // --extend sieves to the first limit, builds the count index, and then extends the same sieve to each limit after
+    // it in turn, with each -e engine that can (basic, segmented and parallel).  Every step's count is checked
+    // against PRIME_COUNTS where it has the limit, and the index against it at every limit of the list so far, so
+    // the grown words, the added base primes and the extended index are all checked together.
+
+    if (!extendLimits.empty())
+    {
+        uint64_t found = 0;
+        auto bFailed = false;
+        unique_ptr<thread_pool> pool;
+        for (auto engine : engines)
+        {
+            if (engine != sieve_engine::basic && engine != sieve_engine::segmented && engine != sieve_engine::parallel)
+            {
+                fprintf(stderr, "No extend for engine %s\n", engineName(engine));
+                continue;
+            }
+            if (engine == sieve_engine::parallel && !pool)
+                pool.reset(new thread_pool(cThreads));
+
+            prime_sieve sieve(extendLimits[0], engine, cbSegment, engine == sieve_engine::parallel ? pool.get() : nullptr);
+            for (size_t step = 0; step < extendLimits.size(); step++)
+            {
+                auto tStart = steady_clock::now();
+                if (step == 0)
+                {
+                    sieve.runSieve();
+                    sieve.buildIndex();
+                }
+                else
+                    sieve.extend(extendLimits[step]);
+                auto duration = duration_cast<microseconds>(steady_clock::now() - tStart).count()/1000000.0;
+
+                const uint64_t limit = sieve.bits().limit();
+                found = sieve.countPrimes();
+                uint64_t expected = 0;
+                auto bKnown = knownPrimeCount(limit, expected);
+                auto bValid = (!bKnown || found == expected) && sieve.primesBelow(limit) == found;
+                for (size_t k = 0; k <= step; k++)
+                    if (knownPrimeCount(extendLimits[k], expected) && extendLimits[k] <= limit)
+                        bValid = bValid && sieve.primesBelow(extendLimits[k]) == expected;
+                bFailed = bFailed || !bValid;
+
+                printf("Extend: %llu, Engine: %s, Time: %f, Count: %llu, Index: %llu, Valid : %s\n",
+                    (unsigned long long) limit, engineName(engine), duration, (unsigned long long) found,
+                    (unsigned long long) sieve.primesBelow(limit), !bValid ? "FAIL!" : bKnown ? "Pass" : "n/a");
+            }
+        }
+        return bFailed ? 0 : (int) found;
+    }
+
+    // --serve answers queries read from stdin, one per line, through a sieve_service on -t threads: "count lo hi",
+    // "isprime n", "range lo hi" and "nth n".  Each is handed to the service as soon as it's read and answered as
+    // "query: answer" in the order asked, so a burst of queries piped in is batched, and cached segments (up to --lru
+    // of them, 8M numbers each) are reused by the queries that follow.
+
+    if (bServe)
+    {
+        sieve_service service(cThreads, (size_t) ullLru);
+        std::deque<std::pair<string, std::function<string()>>> answers;
+        std::mutex lock;
+        std::condition_variable ready;
+        auto bDone = false;
+
+        std::thread printer([&]
+        {
+            for (;;)
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                if (answers.empty())
+                    fflush(stdout);                             // Caught up, so the asker sees everything so far
+                ready.wait(guard, [&] { return bDone || !answers.empty(); });
+                if (answers.empty())
+                    return;
+                auto next = std::move(answers.front());
+                answers.pop_front();
+                guard.unlock();
+                printf("%s: %s\n", next.first.c_str(), next.second().c_str());
+            }
+        });
+
+        string line;
+        while (getline(cin, line))
+        {
+            char verb[16] = "";
+            unsigned long long a = 0, b = 0;
+            const int fields = sscanf(line.c_str(), "%15s %llu %llu", verb, &a, &b);
+            std::function<string()> answer;
+            if (fields == 3 && !strcmp(verb, "count"))
+            {
+                auto f = service.count(a, b).share();
+                answer = [f] { return to_string(f.get()); };
+            }
+            else if (fields >= 2 && !strcmp(verb, "isprime"))
+            {
+                auto f = service.isPrime(a).share();
+                answer = [f] { return string(f.get() ? "prime" : "composite"); };
+            }
+            else if (fields == 3 && !strcmp(verb, "range"))
+            {
+                auto f = service.range(a, b).share();
+                answer = [f]
+                {
+                    string list;
+                    for (auto p : f.get())
+                        list += (list.empty() ? "" : ", ") + to_string(p);
+                    return list;
+                };
+            }
+            else if (fields >= 2 && !strcmp(verb, "nth"))
+            {
+                auto f = service.nthPrime(a).share();
+                answer = [f] { return to_string(f.get()); };
+            }
+            else if (fields <= 0)
+                continue;
+            else
+                answer = [] { return string("unknown query, try count lo hi, isprime n, range lo hi or nth n"); };
+
+            std::lock_guard<std::mutex> guard(lock);
+            answers.emplace_back(line, std::move(answer));
+            ready.notify_one();
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            bDone = true;
+        }
+        ready.notify_one();
+        printer.join();
+
+        if (!bQuiet)
+        {
+            auto stats = service.stats();
+            printf("Service: Requests: %llu, Batches: %llu, Segments sieved: %llu, Hits: %llu, Misses: %llu, Cached: %zu\n",
+                (unsigned long long) stats.requests, (unsigned long long) stats.batches, (unsigned long long) stats.sieved,
+                (unsigned long long) stats.hits, (unsigned long long) stats.misses, stats.cached);
+        }
+        return 0;
+    }
+
+    // --cache answers from a sieve file instead of sieving: the file is mapped, not read, so opening it takes the
+    // same few milliseconds at any limit.  If it doesn't exist yet (or -l asks for a different limit) the segmented
+    // engine sieves the limit once and saves it there for next time, with its count index, so that --count can
+    // answer how many primes are in [lo, hi) from two table reads and a popcount.
+
+    if (!strCache.empty())
+    {
+        auto tStart = steady_clock::now();
+        auto source = "mapped";
+        sieve_cache cache;
+        if (!cache.open(strCache) || (ullLimitRequested && cache.limit() != llUpperLimit))
+        {
+            prime_sieve sieve(llUpperLimit, sieve_engine::segmented, cbSegment);
+            sieve.runSieve();
+            sieve.buildIndex();
+            errno = 0;
+            if (!saveSieve(strCache, sieve.bits(), &sieve.countIndex()))
+            {
+                fprintf(stderr, "Cannot write cache %s: %s\n", strCache.c_str(), errno ? strerror(errno) : "write failed");
+                return 0;
+            }
+            if (!cache.open(strCache))
+            {
+                fprintf(stderr, "Cannot open cache %s after writing it: %s\n", strCache.c_str(), cache.error());
+                return 0;
+            }
+            source = "sieved";
+        }
+        auto duration = duration_cast<microseconds>(steady_clock::now() - tStart).count()/1000000.0;
+
+        if (bPrintPrimes)
+        {
+            prime_writer out(stdout);
+            if (cache.limit() > 2)
+                out.write(2);
+            forEachSetBit(cache.data(), 1, cache.bitCount(), [&](uint64_t i) { out.write(2 * i + 1); return true; });
+        }
+
+        uint64_t expected = 0;
+        auto bKnown = knownPrimeCount(cache.limit(), expected);
+        printf("Cache: %s, Source: %s, Time: %f, Limit: %llu, Count: %llu, Valid : %s\n",
+            strCache.c_str(), source, duration, (unsigned long long) cache.limit(), (unsigned long long) cache.countPrimes(),
+            !bKnown ? "n/a" : cache.countPrimes() == expected ? "Pass" : "FAIL!");
+
+        if (bCount)
+        {
+            auto tCount = steady_clock::now();
+            auto count = cache.countRange(ullCountLo, ullCountHi);
+            auto countTime = duration_cast<nanoseconds>(steady_clock::now() - tCount).count()/1000000000.0;
+            printf("Range: %llu:%llu, Count: %llu, Time: %f, Index: %s%s\n",
+                (unsigned long long) ullCountLo, (unsigned long long) ullCountHi, (unsigned long long) count, countTime,
+                cache.hasSavedIndex() ? "saved" : "built",
+                ullCountHi > cache.limit() ? ", Clipped to limit" : "");
+        }
+        return bKnown && cache.countPrimes() != expected ? 0 : (int) cache.countPrimes();
+    }
+    if (bCount)
+    {
+        fprintf(stderr, "--count needs --cache\n");
+        return 0;
+    }
 
     if (!bQuiet)
     {
@@ -234,50 +685,170 @@ int main(int argc, char **argv)
             cSeconds == 1 ? "" : "s"
         );
     }
-    auto tStart       = steady_clock::now();
 
-    if (!bOneshot)
+    // benchmark
+    //
+    // Times passes of one engine, then validates one more sieve and prints the results line.  makeSieve builds a
+    // sieve on the heap, rather than the stack, due to its possible enormity; the unique_ptr it returns frees
+    // the sieve again as soon as the pass is done.  Each round either runs one sieve per worker of the pool side
+    // by side, or (bShared) one sieve on this thread for an engine that spreads it over the pool's workers itself.
+    // Returns the count of primes found, or 0 if they weren't right.  With --counters, the pool's workers read their
+    // hardware counters around every job, and the totals for the timed passes are printed with the results.
+
+    thread_pool pool(cThreads);
+    pool.countEvents(bCounters);
+
+    // --pin binds each worker to a core, one node's cores before the next.  A sieve's pages land on the node of the
+    // thread that first writes them, and each worker builds and fills its own sieves (as do the parallel engine's
+    // workers their own runs of the shared one), so once it can no longer migrate its memory stays local.  --numa
+    // also reports the throughput of each node.
+
+    const numa_topology &topology = numa_topology::get();
+    vector<int> workerNodes(pool.size(), 0);
+    if (bPin)
+        workerNodes = pinPool(pool, topology);
+    if (bNuma && !bQuiet)
+        printf("NUMA nodes: %d, CPUs: %zu\n", topology.nodes(), topology.cpus());
+
+    auto benchmark = [&](auto makeSieve, bool bShared) -> size_t
     {
-        while (duration_cast<seconds>(steady_clock::now() - tStart).count() < cSeconds)
+        auto cPasses      = 0.0;
+        pool.resetStats();
+        auto tStart       = steady_clock::now();
+
+        if (!bOneshot)
+        {
+            // Every pass is given a token with the deadline on it, so the passes running when time is up stop there
+            // (at their next block, or factor) rather than running on past it, and are credited with the share of
+            // a pass each got through (see pass_tally).  The time is then the time asked for, and the passes are
+            // what fit in it.
+
+            cancel_token deadline(tStart + seconds(cSeconds));
+            vector<pass_tally> tallies(pool.size());
+            auto pass = [&makeSieve, &deadline](pass_tally &tally)
+            {
+                auto tPass = steady_clock::now();
+                auto share = makeSieve()->runSieve(&deadline);
+                tally.add(share, duration_cast<microseconds>(steady_clock::now() - tPass).count()/1000000.0);
+            };
+            while (!deadline.cancelled())
+            {
+                // We give each of the N pooled threads the job of runing the 'runSieve' method on a sieve of
+                // their own, and wait for all of them to finish before we repeat.  The threads themselves are
+                // created just once, up above, so their startup cost isn't part of any pass.
+
+                if (bShared)
+                    pass(tallies[0]);
+                else
+                    pool.run([&pass, &tallies](unsigned w)
+                    { 
+                        pass(tallies[w]); 
+                    });
+            }
+
+            // Credit us with one pass for each of the sieves we did work on, or the part of it we did
+            pass_tally tally;
+            for (auto &t : tallies)
+                tally += t;
+            cPasses = tally.passes();
+        }
+        else
         {
-            vector<thread> threadPool;
-            
-            // We create N threads and give them each the job of runing the 'runSieve' method on a sieve
-            // that we create on the heap, rather than the stack, due to their possible enormity.  By using
-            // a unique_ptr it will automatically free resources as soon as its torn down.
+            cPasses++;
+        }
 
-            for (unsigned int i = 0; i < cThreads; i++)
-                threadPool.push_back(thread([llUpperLimit] 
-                { 
-                    std::unique_ptr<prime_sieve>(new prime_sieve(llUpperLimit))->runSieve(); 
-                }));
+        auto tEnd = steady_clock::now() - tStart;
+        auto duration = duration_cast<microseconds>(tEnd).count()/1000000.0;
 
-            // Now we wait for all of the threads to finish before we repeat
+        auto workerStats = pool.stats();
+        vector<perf_sample> counters;
+        for (auto &stats : workerStats)
+            counters.push_back(stats.counters);
+        
+        auto checkSieve = makeSieve();
+        checkSieve->runSieve();
+        auto result = checkSieve->validateResults() ? checkSieve->countPrimes() : 0;
+      
+        if (!bQuiet)
+            checkSieve->printResults(bPrintPrimes, duration , cPasses, cThreads, bCounters ? &counters : nullptr);
+        else
+            cout << cPasses << ", " << duration / cPasses << endl;
 
-            for (auto &th : threadPool) 
-                th.join();
+        if (bNuma && !bOneshot)
+            printNodeThroughput(workerStats, workerNodes, topology.nodes(), bShared ? 1.0 / pool.size() : 1.0, duration);
 
-            // Credit us with one pass for each of the threads we did work on
-            cPasses += cThreads;
-        }
-    }
-    else
+        return result;
+    };
+
+    // Each requested engine gets its own timed run and results line, so their throughput can be compared.  With
+    // --reuse, every sieve takes its buffer from the arena of the thread building it, so after the first pass on
+    // each thread there is no allocation, zero-fill or page faulting left in the loop.
+
+    auto arena = [bReuse] { return bReuse ? &buffer_arena<uint64_t>::local() : nullptr; };
+
+    // The fixed engines are compiled once for each limit we have a known count for, and withFixedLimit picks the
+    // one for this run; any other limit has no fixed engine to run.
+
+    auto fixed = [&](auto storage, auto wheel) -> size_t
+    {
+        size_t found = 0;
+        if (!withFixedLimit(llUpperLimit, [&](auto limit)
+        {
+            typedef fixed_sieve<decltype(limit)::value, decltype(storage), decltype(wheel)> sieve;
+            found = benchmark([] { return std::unique_ptr<sieve>(new sieve); }, false);
+        }))
+            fprintf(stderr, "No fixed engine for limit %llu\n", (unsigned long long) llUpperLimit);
+        return found;
+    };
+
+    auto run = [&](sieve_engine engine) -> size_t
     {
-        cPasses++;
+        size_t result = 0;
+        if (engine == sieve_engine::fixed_odd)
+            result = fixed(packed_bits(), wheel2());
+        else if (engine == sieve_engine::fixed_odd_bytes)
+            result = fixed(byte_flags(), wheel2());
+        else if (engine == sieve_engine::fixed_wheel30)
+            result = fixed(packed_bits(), wheel30());
+        else if (engine == sieve_engine::fixed_wheel210)
+            result = fixed(packed_bits(), wheel210());
+        else if (engine == sieve_engine::wheel30)
+            result = benchmark([=] { return std::unique_ptr<wheel_sieve<wheel30>>(new wheel_sieve<wheel30>(llUpperLimit, arena())); }, false);
+        else if (engine == sieve_engine::wheel210)
+            result = benchmark([=] { return std::unique_ptr<wheel_sieve<wheel210>>(new wheel_sieve<wheel210>(llUpperLimit, arena())); }, false);
+        else if (engine == sieve_engine::parallel)
+            result = benchmark([=, &pool] { return std::unique_ptr<prime_sieve>(new prime_sieve(llUpperLimit, engine, cbSegment, &pool, arena())); }, true);
+        else
+            result = benchmark([=] { return std::unique_ptr<prime_sieve>(new prime_sieve(llUpperLimit, engine, cbSegment, nullptr, arena())); }, false);
+        return result;
+    };
+
+    // With --hugepages, each engine runs twice, on ordinary pages and then on huge ones, so the two results lines
+    // sit next to each other.  The arenas are emptied in between, or reused buffers would keep their old pages.
+
+    vector<page_kind> pages = { page_kind::normal };
+    if (ePages != page_kind::normal)
+        pages.push_back(ePages);
+
+    size_t result = 0;
+    for (auto engine : engines)
+    {
+        for (auto kind : pages)
+        {
+            sieve_pages::get().request(kind);
+            buffer_arena<uint64_t>::local().clear();
+            pool.run([](unsigned) { buffer_arena<uint64_t>::local().clear(); });
+
+            result = run(engine);
+            if (ePages != page_kind::normal && !bQuiet)
+                printf("Pages: %s, Requested: %s\n", pageKindName(sieve_pages::get().obtained()), pageKindName(kind));
+            if (!result)
+                break;
+        }
+        if (!result)
+            break;
     }
 
-    auto tEnd = steady_clock::now() - tStart;
-    auto duration = duration_cast<microseconds>(tEnd).count()/1000000.0;
-    
-    prime_sieve checkSieve(llUpperLimit);
-    checkSieve.runSieve();
-    auto result = checkSieve.validateResults() ? checkSieve.countPrimes() : 0;
-  
-    if (!bQuiet)
-        checkSieve.printResults(bPrintPrimes, duration , cPasses, cThreads);
-    else
-        cout << cPasses << ", " << duration / cPasses << endl;
-
     // On success return the count of primes found; on failure, return 0
 
     return (int) result;
@@ -0,0 +1,339 @@
+// ---------------------------------------------------------------------------
+// PrimeCPP_PAR.h : The PrimeCPP_PAR engines, shared by PrimeCPP_PAR and the benchmark harness
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "../PrimeCPP_Common/buffer_arena.h"
+#include "../PrimeCPP_Common/cancel_token.h"
+#include "../PrimeCPP_Common/index_width.h"
+#include "../PrimeCPP_Common/odd_bits.h"
+#include "../PrimeCPP_Common/perf_counters.h"
+#include "../PrimeCPP_Common/presieve.h"
+#include "../PrimeCPP_Common/prime_counts.h"
+#include "../PrimeCPP_Common/prime_index.h"
+#include "../PrimeCPP_Common/prime_query.h"
+#include "../PrimeCPP_Common/prime_writer.h"
+#include "../PrimeCPP_Common/segmented_sieve.h"
+#include "../PrimeCPP_Common/thread_pool.h"
+
+// par
+//
+// The engines of PrimeCPP_PAR, where each thread runs a sieve of its own (or all of them share the parallel one), in
+// a namespace of their own so the benchmark harness can build them next to the others.
+
+namespace par
+{
+
+using namespace std;
+
+const uint64_t DEFAULT_SEGMENT_KB  = 32;                       // One L1 data cache; 256 or so targets L2 instead
+
+// sieve_engine
+//
+// Which algorithm is used to cross off the array.  Every engine finds the same primes; the wheel engines use a
+// wheel_sieve in place of prime_sieve, and the fixed engines a fixed_sieve compiled for the given limit.
+
+enum class sieve_engine
+{
+    basic,                                                      // One pass over the whole array per factor
+    segmented,                                                  // All factors over one cache-sized block at a time
+    parallel,                                                   // One sieve, its blocks split among all the threads
+    wheel30,                                                    // Only numbers coprime to 30 are stored
+    wheel210,                                                   // Only numbers coprime to 210 are stored
+    fixed_odd,                                                  // Compile-time limit, odd numbers, one bit each
+    fixed_odd_bytes,                                            // Compile-time limit, odd numbers, one byte each
+    fixed_wheel30,                                              // Compile-time limit, coprime to 30, one bit each
+    fixed_wheel210                                              // Compile-time limit, coprime to 210, one bit each
+};
+
+const struct { sieve_engine engine; const char *name; } ENGINES[] =
+{
+    { sieve_engine::basic,           "basic"           },
+    { sieve_engine::segmented,       "segmented"       },
+    { sieve_engine::parallel,        "parallel"        },
+    { sieve_engine::wheel30,         "wheel30"         },
+    { sieve_engine::wheel210,        "wheel210"        },
+    { sieve_engine::fixed_odd,       "fixed-odd"       },
+    { sieve_engine::fixed_odd_bytes, "fixed-odd-bytes" },
+    { sieve_engine::fixed_wheel30,   "fixed-wheel30"   },
+    { sieve_engine::fixed_wheel210,  "fixed-wheel210"  },
+};
+
+inline const char *engineName(sieve_engine engine)
+{
+    for (auto &e : ENGINES)
+        if (e.engine == engine)
+            return e.name;
+    return "unknown";
+}
+
+// prime_sieve
+//
+// Represents the data comprising the sieve (an array of N/2 bits, one for each odd number below the upper limit N)
+// as well as the code needed to eliminate non-primes from its array, which you perform by calling runSieve.
+
+class prime_sieve
+{
+  private:
+
+      odd_bits Bits;                                            // Sieve data, one bit per odd number, where 1==prime, 0==not
+      sieve_engine Engine;                                      // How runSieve crosses off the array
+      uint64_t SegmentBytes;                                    // Block size for the segmented engines
+      thread_pool *Pool;                                        // Threads sharing this one sieve (parallel engine only)
+      mutable size_t Count = 0;                                 // Primes found, once countPrimes has counted them
+      mutable bool Counted = false;
+      prime_count_index Index;                                  // Running counts, once buildIndex has built them
+      bool Indexed = false;                                     // Whether buildIndex was asked for, so extend keeps it
+      bool Sieved = false;                                      // Whether runSieve has run to the end
+      vector<uint64_t> Primes;                                  // Base primes from 17 up to PrimesRoot, kept by extend
+      uint64_t PrimesRoot = 0;
+
+      // The parallel engine has each worker fill and sieve its own run of the array, so that the pages are first
+      // touched (and placed, on a NUMA machine) by the thread that uses them
+
+      bool workersFill() const
+      {
+          return Engine == sieve_engine::parallel && Pool;
+      }
+
+   public:
+
+      prime_sieve(uint64_t n, sieve_engine engine = sieve_engine::basic, uint64_t segmentBytes = DEFAULT_SEGMENT_KB * 1024,
+                  thread_pool *pool = nullptr, buffer_arena<uint64_t> *arena = nullptr)
+        : Bits(engine == sieve_engine::parallel && pool ? odd_bits(n, unfilled_words(), arena)  // Filled by the workers
+                                                        : odd_bits(n, oddPattern(), arena)),    // Potential primes, less multiples of 3 to 13
+          Engine(engine), SegmentBytes(segmentBytes), Pool(pool)
+      {
+          if (Bits.size() && !workersFill())
+              Bits.clear(0);                                    // Except one, which is not prime
+      }
+
+      ~prime_sieve()
+      {
+      }
+
+      // runSieve
+      //
+      // Crosses off the array with whichever engine the sieve was built for.  Given a token, the engine polls it
+      // between blocks (or between factors, for basic) and stops once it's cancelled, leaving the array unfinished;
+      // returns the share of the pass that was done, which is one if it wasn't.
+
+      double runSieve(const cancel_token *token = nullptr)
+      {
+          Counted = false;
+          Index = prime_count_index();
+          Indexed = false;
+          const uint64_t from = oddPattern().nextPrime();
+          double done = 1.0;
+          if (Engine == sieve_engine::segmented)
+              done = sieveSegmented(Bits, SegmentBytes, from, token);
+          else if (workersFill())
+          {
+              done = sieveParallel(Bits, SegmentBytes, *Pool, from, &oddPattern(), token);
+              if (Bits.size())
+                  Bits.clear(0);
+          }
+          else if (Engine == sieve_engine::parallel)
+              done = sieveSegmented(Bits, SegmentBytes, from, token);
+          else
+              done = runSieveBasic(token);
+          Sieved = done >= 1.0;
+          return done;
+      }
+
+      // runSieveBasic
+      //
+      // Scan the array for the next factor (past the presieved ones) that hasn't yet been eliminated from the array,
+      // and then walk through the array crossing off every multiple of that factor.
+
+      double runSieveBasic(const cancel_token *token = nullptr)
+      {
+          uint64_t factor = oddPattern().nextPrime();
+          uint64_t q = isqrt(Bits.limit());
+          double done = 0;                                      // factorWork of the factors crossed off, given a token
+
+          while (factor <= q)
+          {
+              factor = 2 * Bits.next(factor >> 1) + 1;          // The next number still standing, a word at a time
+              if (factor > q)
+                  break;
+              if (token)
+              {
+                  if (token->cancelled())
+                      return factorPassFraction(Bits.limit(), oddPattern().nextPrime(), done);
+                  done += factorWork(Bits.limit(), factor);
+              }
+              crossOff(Bits.data(), (factor * factor) >> 1, factor, Bits.size());   // Bit i is 2i+1, so odd
+                                                                                     // multiples are factor bits apart
+
+              factor += 2;            
+          }
+          return 1.0;
+      }
+
+      // extend
+      //
+      // Raises the limit of the sieve to limit, sieving only the numbers from the old limit up rather than starting
+      // over.  The new words are presieved and then crossed off a block at a time with the base primes up to
+      // sqrt(limit), whatever the engine (the parallel one spreads the blocks over its pool); the base primes are
+      // kept from one extend to the next, and those the new limit adds are read off the sieve itself while they lie
+      // below the old limit.  The count, and the index if one was built, are brought up to date by counting the new
+      // words alone.  A sieve that hasn't been run yet just grows, for runSieve to sieve the lot.
+
+      void extend(uint64_t limit)
+      {
+          if (limit <= Bits.limit())
+              return;
+          const uint64_t oldLimit = Bits.limit();
+          const uint64_t first = Bits.size();
+          Bits.grow(limit, oddPattern());
+          if (first == 0 && Bits.size())
+              Bits.clear(0);                                    // One is not prime
+          if (!Sieved)
+          {
+              Counted = false;
+              Index = prime_count_index();
+              Indexed = false;
+              return;
+          }
+
+          const uint64_t from = oddPattern().nextPrime();
+          const uint64_t root = isqrt(limit - 1);               // Base primes p need p*p < limit
+          if (root >= oldLimit)
+          {
+              Primes = basePrimes(limit, from);                 // Past what the sieve can tell us
+              PrimesRoot = root;
+          }
+          for (uint64_t p = std::max(from, PrimesRoot + 1) | 1; p <= root; p += 2)
+              if (Bits.test(p >> 1))
+                  Primes.push_back(p);
+          PrimesRoot = std::max(PrimesRoot, root);
+
+          if (workersFill())
+              sieveRangeParallel(Bits, Primes, first, Bits.size(), SegmentBytes, *Pool);
+          else
+              sieveRange(Bits, Primes, first, Bits.size(), SegmentBytes * 8);
+
+          if (Counted)
+              Count += (oldLimit < 2 && limit >= 2) + popcountBitRange(Bits.data(), first, Bits.size());
+          if (Indexed)
+              Index.extend(Bits.data(), limit);                 // Built afresh if there were no words to build it over
+      }
+
+      // countPrimes
+      //
+      // Can be called after runSieve to determine how many primes were found in total.  Counted a word at a time
+      // with popcount (one is never set), and kept, so validating and printing don't each count again.
+
+      size_t countPrimes() const
+      {
+          if (!Counted)
+          {
+              Count = (Bits.limit() >= 2) + Bits.count();       // Count 2 as prime if within range
+              Counted = true;
+          }
+          return Count;
+      }
+
+      // buildIndex
+      //
+      // Builds the count index over the finished sieve (one more pass, and 1.7% more memory), after which
+      // primesBelow and countRange are a couple of table reads and one block's popcount each
+
+      void buildIndex()
+      {
+          Index.build(Bits.data(), Bits.limit());
+          Indexed = true;
+      }
+
+      const prime_count_index &countIndex() const                  { return Index; }
+      uint64_t primesBelow(uint64_t x) const                       { return Index.primesBelow(x); }
+      uint64_t countRange(uint64_t lo, uint64_t hi) const          { return Index.countRange(lo, hi); }
+
+      // The finished bits, for saving to a sieve file
+
+      const odd_bits &bits() const
+      {
+          return Bits;
+      }
+
+      // isPrime 
+      // 
+      // Can be called after runSieve to determine whether a given number is prime. 
+
+      bool isPrime(uint64_t n) const
+      {
+          if (n & 1)
+              return Bits.test(n >> 1);
+          else
+              return n == 2;
+      }
+
+      // isPrimeBatch
+      //
+      // isPrime for count queries at once, answers[i] for queries[i], prefetching ahead; see prime_query.h
+
+      void isPrimeBatch(const uint64_t *queries, size_t count, uint8_t *answers) const
+      {
+          ::isPrimeBatch(Bits.data(), Bits.limit(), queries, count, answers);
+      }
+
+      // validateResults
+      //
+      // Checks to see if the number of primes found matches what we should expect, from the table in prime_counts.h.
+      // This data isn't used in the sieve processing at all, only to sanity check that the results are right when done.
+
+      bool validateResults() const
+      {
+          uint64_t expected = 0;
+          return knownPrimeCount(Bits.limit(), expected) && expected == countPrimes();
+      }
+
+      // printResults
+      //
+      // Displays stats about what was found as well as (optionally) the primes themselves, and the hardware counters
+      // of each thread over the timed passes when there are some
+
+      void printResults(bool showResults, double duration, double passes, size_t threads,
+                        const vector<perf_sample> *counters = nullptr) const
+      {
+          size_t count = (Bits.limit() >= 2);                   // Count 2 as prime if in range
+          if (showResults)
+          {
+              prime_writer out(stdout);
+              out.write(2);
+              forEachSetBit(Bits.data(), 1, Bits.size(), [&](uint64_t i)
+              {
+                  out.write(2 * i + 1);
+                  count++;
+                  return true;
+              });
+          }
+          else
+          {
+              count = countPrimes();                            // Nothing to list, so no second scan to check it by
+          }
+          
+          cout << "Passes: "  << passes << ", "
+               << "Threads: " << threads << ", "
+               << "Time: "    << duration << ", " 
+               << "Average: " << duration/passes << ", "
+               << "Limit: "   << Bits.limit() << ", "
+               << "Counts: "  << count << "/" << countPrimes() << ", "
+               << "Valid : "  << (validateResults() ? "Pass" : "FAIL!") << ", "
+               << "Engine: "  << engineName(Engine) << ", "
+               << "Buffers: " << (Bits.reused() ? "reused" : "fresh")
+               << "\n";
+
+          if (counters)
+              printCounters(*counters, passes);
+      }
+};
+
+} // namespace par
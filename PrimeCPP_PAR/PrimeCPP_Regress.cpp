@@ -0,0 +1,507 @@
+// ---------------------------------------------------------------------------
+// PrimeCPP_Regress.cpp : Per-stage microbenchmarks of the sieve engines, checked against stored baselines
+// ---------------------------------------------------------------------------
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../PrimeCPP_Common/bit_scan.h"
+#include "../PrimeCPP_Common/prime_counts.h"
+#include "../PrimeCPP_Common/prime_stream.h"
+#include "../PrimeCPP_Common/thread_pool.h"
+#include "../PrimeCPP/PrimeCPP.h"
+#include "PrimeCPP_PAR.h"
+#include "PrimeCPP_Threaded.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// tCritical
+//
+// The one-sided 1% critical value of Student's t for df degrees of freedom, from the table entry at or below df
+// (which errs towards calling a difference noise)
+
+double tCritical(double df)
+{
+    static const struct { double df, t; } TABLE[] =
+    {
+        { 1, 31.821 }, { 2, 6.965 }, { 3, 4.541 }, { 4, 3.747 }, { 5, 3.365 }, { 6, 3.143 }, { 7, 2.998 },
+        { 8, 2.896 }, { 9, 2.821 }, { 10, 2.764 }, { 12, 2.681 }, { 15, 2.602 }, { 20, 2.528 }, { 30, 2.457 },
+        { 60, 2.390 }, { 120, 2.358 }
+    };
+    double t = TABLE[0].t;
+    for (auto &row : TABLE)
+        if (row.df <= df)
+            t = row.t;
+    return t;
+}
+
+// stage_bench
+//
+// One stage of one engine.  prepare() does whatever the stage needs done first, untimed (building and running a
+// sieve, for the count stage), and returns the action that is timed; that returns a number that depends on the work
+// (a count, say), so none of it can be optimized away, and which has to equal expected when expected isn't zero.
+// Whatever the action builds is freed when it is, after the clock has stopped.
+
+struct stage_bench
+{
+    string name;
+    uint64_t expected;
+    function<function<uint64_t()>()> prepare;
+};
+
+// calibrationKernel
+//
+// A fixed workload that no change to the engines can touch: a plain sieve of one byte per number up to 2^20, written
+// out here rather than taken from the engines.  Each round of each stage is timed against a round of this run just
+// before it, so a machine that is slower overall, or busier for a while, slows both and cancels out.
+
+uint64_t calibrationKernel()
+{
+    const size_t n = 1 << 20;
+    vector<char> composite(n);
+    uint64_t count = 0;
+    for (size_t i = 2; i < n; i++)
+    {
+        if (composite[i])
+            continue;
+        count++;
+        for (size_t j = i * i; j < n; j += i)
+            composite[j] = 1;
+    }
+    return count;
+}
+
+const stage_bench CALIBRATION = { "calibration", 82025, [] { return function<uint64_t()>(calibrationKernel); } };
+
+// regress_options
+//
+// What to run, and how hard to look
+
+struct regress_options
+{
+    uint64_t limit = 10'000'000LLU;
+    unsigned threads = 1;                                       // One by default, so runs are comparable across machines
+    unsigned rounds = 5;                                        // Every stage is measured once per round
+    double seconds = 0.05;                                      // Per stage per round, once it has its minimum of samples
+    double sampleSeconds = 0.002;                               // Shorter actions are timed in batches at least this long
+    uint64_t minSamples = 5;
+    uint64_t maxSamples = 1000;
+    uint64_t queries = 1 << 20;                                 // The isPrime batch
+    double tolerance = 0.10;                                    // Slowdowns smaller than this never fail the run
+    uint64_t segmentKB = par::DEFAULT_SEGMENT_KB;
+    vector<string> stages;                                      // Names, or prefixes such as "par/"; empty runs all
+};
+
+// stage_stats
+//
+// A stage's timings, summarized the way the baseline stores them.  Times are in seconds.  Each round's samples come
+// down to their median, which over the calibration kernel's median just before it is the round's relative time; the
+// rounds come down to the mean and standard deviation of their log relative times.  Samples within one round sit
+// much closer together than rounds do (the machine's state drifts between them), so spread measured within a round
+// would make every run look significantly different from the last; and in logs, a change reads as a ratio whatever
+// the stage's size.
+
+struct stage_stats
+{
+    string name;
+    uint64_t limit = 0;
+    unsigned threads = 0;
+    vector<double> medians;                                     // One per round, while measuring
+    vector<double> relatives;                                   // The same over the calibration kernel's
+    uint64_t rounds = 0;
+    double median = 0;                                          // The median of the round medians
+    double logMean = 0;
+    double logSd = 0;
+    bool valid = true;
+
+    string key() const
+    {
+        return name + "," + to_string(limit) + "," + to_string(threads);
+    }
+};
+
+// addEngine
+//
+// The init, crossoff and count stages of one engine.  make() builds a sieve (the presieve fill and all) and returns
+// it as a pointer; run(sieve) crosses it off.  An engine that fills its array as part of crossing off, as the PAR
+// parallel one does on its workers, has no init stage worth timing: that would be an allocation.
+
+template <typename Make, typename Run>
+void addEngine(vector<stage_bench> &benches, const string &name, uint64_t expected, Make make, Run run, bool init = true)
+{
+    typedef decltype(make()) sieve_ptr;
+
+    if (init)
+    {
+        auto sieve = make_shared<sieve_ptr>();                  // One for every sample, so each build reuses the memory
+        benches.push_back({ name + "/init", 0, [make, sieve]  // the last one freed, instead of faulting in new pages
+        {
+            return function<uint64_t()>([make, sieve] { sieve->reset(); *sieve = make(); return (uint64_t) 1; });
+        } });
+    }
+    benches.push_back({ name + "/crossoff", 0, [make, run]
+    {
+        auto sieve = make_shared<sieve_ptr>(make());
+        return function<uint64_t()>([run, sieve] { run(**sieve); return (uint64_t) 1; });
+    } });
+    benches.push_back({ name + "/count", expected, [make, run]
+    {
+        auto sieve = make_shared<sieve_ptr>(make());
+        run(**sieve);
+        return function<uint64_t()>([sieve] { return (uint64_t) (*sieve)->countPrimes(); });
+    } });
+}
+
+// allStages
+//
+// Every stage of PrimeCPP, PrimeCPP_PAR and PrimeCPP_Threaded this measures.  Enumeration and isPrime are the same
+// code whichever engine sieved, so they run over one finished PAR sieve; the stream enumerates from scratch.
+
+vector<stage_bench> allStages(const regress_options &options, thread_pool &pool)
+{
+    vector<stage_bench> benches;
+    const uint64_t limit = options.limit;
+    const uint64_t expected = expectedPrimeCount(limit);
+    const uint64_t cbSegment = options.segmentKB * 1024;
+
+    addEngine(benches, "primecpp/basic", expected,
+              [=] { return unique_ptr<primecpp::prime_sieve>(new primecpp::prime_sieve(limit)); },
+              [](primecpp::prime_sieve &sieve) { sieve.runSieve(); });
+    addEngine(benches, "primecpp/segmented", expected,
+              [=] { return unique_ptr<primecpp::prime_sieve>(new primecpp::prime_sieve(limit)); },
+              [](primecpp::prime_sieve &sieve) { sieve.runSieveSegmented(); });
+
+    for (auto engine : { par::sieve_engine::basic, par::sieve_engine::segmented, par::sieve_engine::parallel })
+    {
+        thread_pool *shared = engine == par::sieve_engine::parallel ? &pool : nullptr;
+        addEngine(benches, string("par/") + par::engineName(engine), expected,
+                  [=] { return unique_ptr<par::prime_sieve>(new par::prime_sieve(limit, engine, cbSegment, shared)); },
+                  [](par::prime_sieve &sieve) { sieve.runSieve(); }, !shared);
+    }
+
+    for (auto engine : { threaded::sieve_engine::segmented, threaded::sieve_engine::atomic_segmented })
+        addEngine(benches, string("threaded/") + threaded::engineName(engine), expected,
+                  [=, &pool] { return unique_ptr<threaded::prime_sieve>(new threaded::prime_sieve(limit, pool, engine, cbSegment)); },
+                  [](threaded::prime_sieve &sieve) { sieve.runSieve(); });
+
+    auto finished = make_shared<par::prime_sieve>(limit, par::sieve_engine::segmented, cbSegment);
+    finished->runSieve();
+
+    benches.push_back({ "par/enumerate", expected, [finished]
+    {
+        return function<uint64_t()>([finished]
+        {
+            uint64_t count = finished->bits().limit() >= 2;     // 2, and then the odd ones
+            forEachSetBit(finished->bits().data(), 1, finished->bits().size(), [&](uint64_t) { count++; return true; });
+            return count;
+        });
+    } });
+
+    benches.push_back({ "stream/enumerate", expected, [limit]
+    {
+        return function<uint64_t()>([limit] { return forEachPrime(0, limit, [](uint64_t) {}); });
+    } });
+
+    mt19937_64 random(limit);
+    auto queries = make_shared<vector<uint64_t>>(options.queries);
+    for (auto &q : *queries)
+        q = random() % limit;
+    uint64_t primes = 0;
+    for (auto q : *queries)
+        primes += finished->isPrime(q);
+
+    benches.push_back({ "par/isprime-batch", primes, [finished, queries]
+    {
+        auto answers = make_shared<vector<uint8_t>>(queries->size());
+        return function<uint64_t()>([finished, queries, answers]
+        {
+            finished->isPrimeBatch(queries->data(), queries->size(), answers->data());
+            uint64_t count = 0;
+            for (auto a : *answers)
+                count += a;
+            return count;
+        });
+    } });
+
+    return benches;
+}
+
+// measureRound
+//
+// One round of samples of a stage: samples until there are options.minSamples of them and options.seconds have
+// passed (or there are options.maxSamples), after one untimed run to warm the caches.  An action quicker than
+// options.sampleSeconds (building a sieve takes under 100us at 10^7) is prepared several times over and the batch
+// timed together, so that a sample is long enough to measure the stage rather than a page fault or a time slice.
+// Returns the median time of one action, and clears valid if any result was wrong.
+
+double measureRound(const stage_bench &bench, const regress_options &options, bool &valid)
+{
+    auto sample = [&](uint64_t batch)
+    {
+        vector<function<uint64_t()>> actions;
+        for (uint64_t i = 0; i < batch; i++)
+            actions.push_back(bench.prepare());
+        auto tStart = steady_clock::now();
+        for (auto &action : actions)
+        {
+            const uint64_t result = action();
+            valid = valid && (!bench.expected || result == bench.expected);
+        }
+        return duration<double>(steady_clock::now() - tStart).count() / (double) batch;
+    };
+
+    const double warm = max(sample(1), 1e-9);
+    const uint64_t batch = (uint64_t) max(1.0, ceil(options.sampleSeconds / warm));
+    vector<double> samples;
+    const auto tStart = steady_clock::now();
+    while (samples.size() < options.minSamples ||
+           (samples.size() < options.maxSamples && duration<double>(steady_clock::now() - tStart).count() < options.seconds))
+        samples.push_back(max(sample(batch), 1e-9));
+
+    sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+// summarize
+//
+// Fills in the summary from the rounds
+
+void summarize(stage_stats &stats)
+{
+    double sum = 0, squares = 0;
+    for (auto r : stats.relatives)
+        sum += log(r);
+    stats.rounds = stats.relatives.size();
+    stats.logMean = sum / stats.rounds;
+    for (auto r : stats.relatives)
+        squares += (log(r) - stats.logMean) * (log(r) - stats.logMean);
+    stats.logSd = stats.rounds > 1 ? sqrt(squares / (stats.rounds - 1)) : 0;
+
+    vector<double> medians = stats.medians;
+    sort(medians.begin(), medians.end());
+    stats.median = medians[medians.size() / 2];
+}
+
+// readBaseline, writeBaseline
+//
+// Baselines are CSV, one stage per row, keyed by stage, limit and threads; lines starting with '#' are comments
+
+bool readBaseline(const string &path, map<string, stage_stats> &baseline)
+{
+    ifstream in(path);
+    if (!in)
+        return false;
+    string line;
+    while (getline(in, line))
+    {
+        if (line.empty() || line[0] == '#' || line.compare(0, 6, "stage,") == 0)
+            continue;
+        stage_stats s;
+        string field;
+        istringstream fields(line);
+        getline(fields, s.name, ',');
+        getline(fields, field, ',');  s.limit = strtoull(field.c_str(), nullptr, 10);
+        getline(fields, field, ',');  s.threads = (unsigned) atoi(field.c_str());
+        getline(fields, field, ',');  s.rounds = strtoull(field.c_str(), nullptr, 10);
+        getline(fields, field, ',');  s.median = atof(field.c_str());
+        getline(fields, field, ',');  s.logMean = atof(field.c_str());
+        getline(fields, field, ',');  s.logSd = atof(field.c_str());
+        if (s.rounds)
+            baseline[s.key()] = s;
+    }
+    return true;
+}
+
+bool writeBaseline(const string &path, const vector<stage_stats> &results)
+{
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out)
+    {
+        fprintf(stderr, "Can't write %s\n", path.c_str());
+        return false;
+    }
+    fprintf(out, "# PrimeCPP_Regress baseline: median in seconds, log_mean and log_sd over the rounds of log(median / calibration median)\n");
+    fprintf(out, "stage,limit,threads,rounds,median,log_mean,log_sd\n");
+    for (auto &r : results)
+        fprintf(out, "%s,%llu,%u,%llu,%.9f,%.6f,%.6f\n", r.name.c_str(), (unsigned long long) r.limit, r.threads,
+                (unsigned long long) r.rounds, r.median, r.logMean, r.logSd);
+    fclose(out);
+    return true;
+}
+
+// compare
+//
+// Whether now is a regression from then: slower by more than the tolerance, and significantly so by Welch's t-test
+// on the rounds' log medians (one-sided, at 1%), so a noisy stage has to be slower round after round to fail.  Sets
+// change to the ratio of the two (geometric mean) times, less one, and t to the statistic.
+
+bool compare(const stage_stats &now, const stage_stats &then, double tolerance, double &change, double &t)
+{
+    const double a = now.logSd * now.logSd / now.rounds, b = then.logSd * then.logSd / then.rounds;
+    const double diff = now.logMean - then.logMean;
+    const double se = sqrt(a + b);
+    change = exp(diff) - 1;
+    t = se > 0 ? diff / se : (diff > 0 ? INFINITY : 0);
+    if (now.rounds < 2 || then.rounds < 2)
+        return false;                                           // No spread to judge by
+    const double df = se > 0 ? (a + b) * (a + b) / (a * a / (now.rounds - 1) + b * b / (then.rounds - 1)) : 1;
+    return change > tolerance && t > tCritical(df);
+}
+
+int main(int argc, char **argv)
+{
+    vector<string> args(argv + 1, argv + argc);         // From first to last argument in the argv array
+    regress_options options;
+    string baselinePath, recordPath;
+    auto bQuiet = false;
+    auto bList = false;
+
+    // Process command-line args
+
+    for (auto i = args.begin(); i != args.end(); ++i)
+    {
+        auto next = [&] { return ++i == args.end() ? (--i, string()) : *i; };
+
+        if (*i == "-h" || *i == "--help") {
+              cout << "Syntax: " << argv[0] << " [-l,--limit limit] [-t,--threads threads] [-r,--rounds rounds] [-s,--seconds seconds] [-n,--samples min] [-e,--stages name|prefix,...] [-g,--segment KB] [-Q,--queries count] [-b,--baseline file] [-R,--record file] [-T,--tolerance percent] [-q,--quiet] [-L,--list] [-h] " << endl;
+            return 0;
+        }
+        else if (*i == "-l" || *i == "--limit")
+            options.limit = (uint64_t) max(1LL, atoll(next().c_str()));
+        else if (*i == "-t" || *i == "--threads")
+            options.threads = (unsigned) max(1, atoi(next().c_str()));
+        else if (*i == "-r" || *i == "--rounds")
+            options.rounds = (unsigned) max(1, atoi(next().c_str()));
+        else if (*i == "-s" || *i == "--seconds")
+            options.seconds = max(0.0, atof(next().c_str()));
+        else if (*i == "-n" || *i == "--samples")
+            options.minSamples = (uint64_t) max(1LL, atoll(next().c_str()));
+        else if (*i == "-e" || *i == "--stages")
+        {
+            string list = next();
+            for (size_t start = 0, end; start <= list.size(); start = end + 1)
+            {
+                end = min(list.find(',', start), list.size());
+                if (end > start)
+                    options.stages.push_back(list.substr(start, end - start));
+            }
+        }
+        else if (*i == "-g" || *i == "--segment")
+            options.segmentKB = (uint64_t) max(1LL, atoll(next().c_str()));
+        else if (*i == "-Q" || *i == "--queries")
+            options.queries = (uint64_t) max(1LL, atoll(next().c_str()));
+        else if (*i == "-b" || *i == "--baseline")
+            baselinePath = next();
+        else if (*i == "-R" || *i == "--record")
+            recordPath = next();
+        else if (*i == "-T" || *i == "--tolerance")
+            options.tolerance = max(0.0, atof(next().c_str())) / 100;
+        else if (*i == "-q" || *i == "--quiet")
+            bQuiet = true;
+        else if (*i == "-L" || *i == "--list")
+            bList = true;
+        else
+        {
+            fprintf(stderr, "Unknown argument: %s\n", i->c_str());
+            return 1;
+        }
+    }
+
+    map<string, stage_stats> baseline;
+    if (!baselinePath.empty() && !readBaseline(baselinePath, baseline))
+    {
+        fprintf(stderr, "Can't read %s\n", baselinePath.c_str());
+        return 1;
+    }
+
+    // A stage is picked if its name is on the list, or starts with an entry ending in '/', such as "par/"
+
+    thread_pool pool(options.threads);
+    vector<stage_bench> benches;
+    for (auto &b : allStages(options, pool))
+    {
+        bool picked = options.stages.empty();
+        for (auto &name : options.stages)
+            picked = picked || name == b.name || (!name.empty() && name.back() == '/' && b.name.compare(0, name.size(), name) == 0);
+        if (picked)
+            benches.push_back(b);
+    }
+    if (bList)
+    {
+        for (auto &b : benches)
+            cout << b.name << endl;
+        return 0;
+    }
+    if (benches.empty())
+    {
+        fprintf(stderr, "No stages match\n");
+        return 1;
+    }
+
+    // The rounds go through every stage in turn, so a stretch of the run when the machine was busy with something
+    // else lands on many stages once each rather than on all of one stage's rounds.  Then every stage is reported,
+    // and the run fails if any was wrong or slower than its baseline.
+
+    vector<stage_stats> results(benches.size());
+    for (size_t b = 0; b < benches.size(); b++)
+    {
+        results[b].name = benches[b].name;
+        results[b].limit = options.limit;
+        results[b].threads = options.threads;
+    }
+    regress_options calibration = options;                      // Just the minimum of samples, a few milliseconds
+    calibration.seconds = 0;
+    auto bCalibrated = true;
+    for (unsigned round = 0; round < options.rounds; round++)
+        for (size_t b = 0; b < benches.size(); b++)
+        {
+            const double reference = measureRound(CALIBRATION, calibration, bCalibrated);
+            const double median = measureRound(benches[b], options, results[b].valid);
+            results[b].medians.push_back(median);
+            results[b].relatives.push_back(median / reference);
+        }
+
+    auto bValid = bCalibrated;
+    auto cSlower = 0;
+    for (auto &stats : results)
+    {
+        summarize(stats);
+        bValid = bValid && stats.valid;
+
+        double change = 0, t = 0;
+        auto found = baseline.find(stats.key());
+        const bool bSlower = found != baseline.end() && compare(stats, found->second, options.tolerance, change, t);
+        cSlower += bSlower;
+        if (bQuiet && stats.valid && !bSlower)
+            continue;
+
+        printf("Stage: %s, Limit: %llu, Threads: %u, Rounds: %llu, Median: %.6f", stats.name.c_str(),
+               (unsigned long long) stats.limit, stats.threads, (unsigned long long) stats.rounds, stats.median);
+        if (found != baseline.end())
+            printf(", Baseline: %.6f, Change: %+.1f%%, t: %.1f", found->second.median, change * 100, t);
+        else if (!baseline.empty())
+            printf(", Baseline: none");
+        printf(", Result : %s\n", !stats.valid ? "FAIL!" : bSlower ? "SLOWER!" : "Pass");
+    }
+
+    if (!recordPath.empty() && !writeBaseline(recordPath, results))
+        return 1;
+
+    if (!bQuiet || cSlower)
+        printf("Stages: %zu, Slower: %d, Valid : %s\n", results.size(), cSlower, bValid ? "Pass" : "FAIL!");
+
+    return bValid && !cSlower ? 0 : 1;
+}
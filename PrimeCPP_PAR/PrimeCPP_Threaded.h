@@ -0,0 +1,447 @@
+// ---------------------------------------------------------------------------
+// PrimeCPP_Threaded.h : The PrimeCPP_Threaded engines, shared by PrimeCPP_Threaded and the benchmark harness
+// ---------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "../PrimeCPP_Common/buffer_arena.h"
+#include "../PrimeCPP_Common/cancel_token.h"
+#include "../PrimeCPP_Common/cross_off.h"
+#include "../PrimeCPP_Common/index_width.h"
+#include "../PrimeCPP_Common/odd_bits.h"
+#include "../PrimeCPP_Common/perf_counters.h"
+#include "../PrimeCPP_Common/popcount.h"
+#include "../PrimeCPP_Common/presieve.h"
+#include "../PrimeCPP_Common/prime_counts.h"
+#include "../PrimeCPP_Common/prime_writer.h"
+#include "../PrimeCPP_Common/segmented_sieve.h"
+#include "../PrimeCPP_Common/sieve_buffer.h"
+#include "../PrimeCPP_Common/thread_pool.h"
+#include "../PrimeCPP_Common/work_stealing.h"
+
+// threaded
+//
+// The engines of PrimeCPP_Threaded, where every thread crosses off one shared array, in a namespace of their own so
+// the benchmark harness can build them next to the others.
+
+namespace threaded
+{
+
+using namespace std;
+
+const uint64_t DEFAULT_SEGMENT_KB  = 32;                       // One L1 data cache; 256 or so targets L2 instead
+
+// sieve_engine
+//
+// Which algorithm the threads use to cross off the array, and whether they share a byte array or atomic bit words.
+// Every engine produces the same set of primes.
+
+enum class sieve_engine
+{
+    basic,                                                      // One pass over the whole array per factor
+    segmented,                                                  // All of a thread's factors over one block at a time
+    atomic,                                                     // As basic, into bit-packed atomic words
+    atomic_segmented,                                           // As segmented, into bit-packed atomic words
+    stealing,                                                   // Factors handed out by a work-stealing scheduler
+    atomic_stealing                                             // As stealing, into bit-packed atomic words
+};
+
+const struct { sieve_engine engine; const char *name; } ENGINES[] =
+{
+    { sieve_engine::basic,            "basic"            },
+    { sieve_engine::segmented,        "segmented"        },
+    { sieve_engine::atomic,           "atomic"           },
+    { sieve_engine::atomic_segmented, "atomic-segmented" },
+    { sieve_engine::stealing,         "stealing"         },
+    { sieve_engine::atomic_stealing,  "atomic-stealing"  },
+};
+
+inline const char *engineName(sieve_engine engine)
+{
+    for (auto &e : ENGINES)
+        if (e.engine == engine)
+            return e.name;
+    return "unknown";
+}
+
+inline bool usesAtomicBits(sieve_engine engine)
+{
+    return engine == sieve_engine::atomic || engine == sieve_engine::atomic_segmented || engine == sieve_engine::atomic_stealing;
+}
+
+// prime_sieve
+//
+// Represents the data comprising the sieve (an array of N bits, where N is the upper limit prime being tested)
+// as well as the code needed to eliminate non-primes from its array, which you perform by calling runSieve.
+
+class prime_sieve
+{
+  private:
+
+      sieve_buffer<char> Bits;                                  // Sieve data, where 1==prime, 0==not
+      /* The strange thing about this sieve is that we are only going to store odd numbers.                  */
+      /* Index i in the sieve corresponds to the number (2 * i + 1).                                         */
+      /* As such, we'll need to store the actual size for every place that Dave was using the vector's size. */
+      atomic_odd_bits AtomicBits;                               /* Same indexing, one bit each; only the atomic engines use it. */
+      uint64_t Size;
+      thread_pool &Pool;                                        /* Workers that run each pass; made once, not per sieve. */
+      uint64_t Threads;
+      sieve_engine Engine;
+      uint64_t SegmentBytes;
+      bool Reuse;                                               /* Bits came from this thread's arena and go back to it. */
+      mutable size_t Count = 0;                                 /* Primes found, once countPrimes has counted them. */
+      mutable bool Counted = false;
+      const cancel_token *Token = nullptr;                      /* Polled by the pass running now, if it was given one. */
+      vector<double> Done;                                      /* The factorWork each thread crossed off in that pass. */
+      atomic<bool> Stopped;                                     /* Whether any thread stopped short of its end. */
+
+      bool isAtomic() const
+      {
+          return usesAtomicBits(Engine);
+      }
+
+      /* Storage access for the crossing-off loops, which are written once for both kinds of array.      */
+      /* strike clears indices first, first+step, ... below end and returns the first index past them,   */
+      /* in the loop's index type (see index_width.h): 32 bits on a 32-bit build, if the limit allows.  */
+      static bool candidate(const sieve_buffer<char> &bits, uint64_t i) { return 1 == bits[i]; }
+      static bool candidate(const atomic_odd_bits &bits, uint64_t i)    { return bits.test(i); }
+      template <typename index>
+      static index strike(atomic_odd_bits &bits, index first, index step, index end)
+      {
+          return (index) bits.clearStride(first, step, end);
+      }
+      template <typename index>
+      static index strike(sieve_buffer<char> &bits, index first, index step, index end)
+      {
+          return crossOffBytes<index>(bits.data(), first, step, end);
+      }
+
+      bool test(uint64_t i) const
+      {
+          return isAtomic() ? AtomicBits.test(i) : (0 != Bits[i]);
+      }
+
+      /* Factors the presieve pattern already crossed off, which the crossing-off loops below pass over. */
+      static bool presieved(uint64_t factor)
+      {
+          return factor < oddPattern().nextPrime();
+      }
+
+   public:
+
+      prime_sieve(uint64_t n, thread_pool &pool, sieve_engine e = sieve_engine::basic, uint64_t segmentBytes = DEFAULT_SEGMENT_KB * 1024,
+                  bool reuse = false)
+        : Bits(reuse ? buffer_arena<char>::local().acquire(usesAtomicBits(e) ? 0 : n >> 1)
+                     : sieve_buffer<char>(usesAtomicBits(e) ? 0 : n >> 1)),
+          AtomicBits(usesAtomicBits(e) ? n : 0, oddPattern(), reuse ? &buffer_arena<std::atomic<uint64_t>>::local() : nullptr),
+          Size(n), Pool(pool), Threads(pool.size()), Engine(e), SegmentBytes(segmentBytes), Reuse(reuse), Stopped(false)
+      {
+          /* Initialize all to potential primes, less the multiples of 3 to 13, which the crossing off then skips. */
+          presieveBytes(Bits.data(), Bits.size());
+          if (n >> 1)
+          {
+              /* Except one: one is not prime. This may be a bug in Dave's code. */
+              if (isAtomic())
+                  AtomicBits.clear(0);
+              else
+                  Bits[0] = 0;
+          }
+      }
+
+      ~prime_sieve()
+      {
+          if (Reuse)
+              buffer_arena<char>::local().release(std::move(Bits));
+      }
+
+      // runSieve
+      //
+      // Scan the array for the next factor (>2) that hasn't yet been eliminated from the array, and then
+      // walk through the array crossing off every multiple of that factor.
+      //
+      // Given a token, every thread polls it between factors (or between blocks, for the segmented engines) and
+      // stops once it's cancelled.  Returns the share of the pass done: one if no thread stopped, or else the work of
+      // the factors each thread got through (see factorWork) over the work of them all.
+
+      double runSieve(const cancel_token *token = nullptr)
+      {
+          Counted = false;
+          Token = token;
+          Done.assign(Threads, 0.0);
+          Stopped = false;
+          withIndexWidth(Size, [this](auto zero)
+          {
+              typedef decltype(zero) index;
+              if (Engine == sieve_engine::stealing)
+                  return runSieveStealing<index>(Bits);
+              if (Engine == sieve_engine::atomic_stealing)
+                  return runSieveStealing<index>(AtomicBits);
+
+              Pool.run([this](unsigned i)
+              {
+                  switch (Engine)
+                  {
+                      case sieve_engine::basic:            runSieve<index>(Bits, i);                break;
+                      case sieve_engine::segmented:        runSieveSegmented<index>(Bits, i);       break;
+                      case sieve_engine::atomic:           runSieve<index>(AtomicBits, i);          break;
+                      case sieve_engine::atomic_segmented: runSieveSegmented<index>(AtomicBits, i); break;
+                      default:                                                                      break;
+                  }
+              });
+          });
+          double done = 0;
+          for (auto work : Done)
+              done += work;
+          Token = nullptr;
+          return Stopped ? factorPassFraction(Size, oddPattern().nextPrime(), done) : 1.0;
+      }
+
+      /* Before crossing off factor on the given thread: false, to stop, once the token is cancelled. */
+      bool proceed(uint64_t thread, uint64_t factor)
+      {
+          if (!Token)
+              return true;
+          if (Token->cancelled())
+          {
+              Stopped = true;
+              return false;
+          }
+          Done[thread] += factorWork(Size, factor);
+          return true;
+      }
+
+/*
+      Lock-free threaded sieve implementation.
+
+      One way we achieve lock-free-ness is that we don't actually compute the next prime for flagging its composites.
+      We just enumerate over numbers that are more likely to be prime, and hope we don't waste too much time computing the multiples of composites.
+
+      Consider all numbers arranged in six columns, like so:
+         1  2  3  4  5  6
+         7  8  9 10 11 12
+        13 14 15 16 17 18
+        19 20 21 22 23 24
+        25 26 27 28 29 30
+      By inspection, we can see that all numbers in columns 2, 3, 4, and 6 will always be composite (except for the numbers 2 and 3).
+      So there exists an n for all prime numbers greater than three such that the prime number is 6n-1 or 6n+1.
+
+      Each thread gets a different index, and then iterates over 6n-1 and 6n+1 for that index, and then it increments its index by the number of threads.
+      The only special thread is the one who gets index 0: it would iterate over the multiples of 3, which are presieved, so it starts at its next index.
+
+      The next stage of achieving lock-free-ness, and this method's fatal flaw, is selecting a unit of memory that is large enough
+      so that we don't do a read-modify-write, but rather just a write.
+      We only read from memory in a manner that it doesn't matter if the read is wrong
+      (while it is wasteful to mark the composites of a composite as composite, it doesn't change the correctness of the algorithm),
+      and we only write to memory in a manner that mis-ordered writes are still consistent
+      (it doesn't matter if the three thread or five thread marks 45 as composite, what matters is that doing so doesn't unmark 40 or 42).
+      The trick is to use a unit large enough that writes are atomic: my experience with bytes (on my machine) seem to work, but check your processor docs.
+
+      The real issue is memory:
+      As this uses eight times as much memory as a vector<bool>, it has less locality, and is far less performant because of it.
+      And, if your processor only guarantees consistency on 4-byte or 8-byte writes, then your performance will suffer accordingly,
+      as this algorithm will not be correct as programmed.
+
+      The atomic engines fix the flaw rather than hoping around it: the same loop runs over an atomic_odd_bits, where every store
+      is a relaxed fetch_and on a 64-bit word.  That is a real read-modify-write, so it can't lose a neighbour's clear, and the
+      C++ memory model guarantees it everywhere, with one bit per candidate instead of one byte.
+*/
+      template <typename index, typename Storage>
+      void runSieve(Storage &bits, uint64_t thread)
+      {
+          const index q = (index) isqrt(Size);
+          const index end = (index) (Size >> 1);
+          for (index n = (index) (thread ? thread : Threads); 6 * n - 1 <= q; n += (index) Threads)
+          {
+              for (index factor = 6 * n - 1; factor <= 6 * n + 1 && factor <= q; factor += 2)
+              {
+                  if (!presieved(factor) && candidate(bits, factor >> 1))
+                  {
+                      if (!proceed(thread, factor))
+                          return;
+                      strike<index>(bits, (factor * factor) >> 1, factor, end);
+                  }
+              }
+          }
+      }
+
+/*
+      Segmented variant of the above.
+
+      Each thread takes exactly the same factors it would have in runSieve(index), but instead of walking the whole array once
+      per factor, it crosses off all of its factors over one cache-sized block before moving on to the next block.
+      For each factor we keep the index of the next multiple still to be crossed off, so the following block picks up where the last one stopped.
+      The threads visit the blocks independently of one another, and the writes are the same stores as above.
+*/
+      template <typename index, typename Storage>
+      void runSieveSegmented(Storage &bits, uint64_t thread)
+      {
+          const index q = (index) isqrt(Size);
+          vector<index> factors;
+          vector<index> multiples;
+
+          /* Index 0 would be the multiples of 3, which were presieved. */
+          for (index n = (index) (thread ? thread : Threads), factor = 6 * n - 1; factor <= q; n += (index) Threads, factor = 6 * n - 1)
+          {
+              if (!presieved(factor))
+              {
+                  factors.push_back(factor);
+                  multiples.push_back((factor * factor) >> 1);
+              }
+              if (factor + 2 <= q && !presieved(factor + 2))
+              {
+                  factors.push_back(factor + 2);
+                  multiples.push_back(((factor + 2) * (factor + 2)) >> 1);
+              }
+          }
+
+          /* A block of SegmentBytes covers two numbers per byte, or sixteen once they're packed into bits. */
+          const uint64_t span = 2 * SegmentBytes * (isAtomic() ? 8 : 1);
+
+          /* A thread that stops (or finishes) credits each factor still standing with the multiples it struck. */
+          auto struck = [&]
+          {
+              for (size_t i = 0; Token && i < factors.size(); i++)
+                  if (candidate(bits, factors[i] >> 1))
+                      Done[thread] += (double) ((uint64_t) multiples[i] - (((uint64_t) factors[i] * factors[i]) >> 1)) / factors[i];
+          };
+
+          for (uint64_t low = 0; low < Size; low += span)
+          {
+              if (isCancelled(Token))
+              {
+                  Stopped = true;
+                  return struck();
+              }
+              uint64_t high = min(low + span, Size);
+              for (size_t i = 0; i < factors.size(); i++)
+              {
+                  if (!candidate(bits, factors[i] >> 1))
+                      continue;
+                  multiples[i] = strike<index>(bits, multiples[i], factors[i], (index) (high >> 1));
+              }
+          }
+          struck();
+      }
+
+/*
+      Work-stealing variant.
+
+      Handing out factors round-robin gives every thread the same number of factors, but not the same amount of work:
+      a small factor has far more multiples than a large one, and thread 0 gets the entire factor-3 sweep to itself.
+      Here the factors are numbered as tasks instead (task 0 is 3, task k is the pair 6k-1 and 6k+1), every thread starts
+      with an equal run of them, and a thread that finishes early steals half of whatever another thread has left.
+      The tasks for factors up to 13 have nothing left to do once the array is presieved; they are cheap to hand out and skip.
+      The reads and writes are the same as in runSieve(index), so the same storage arguments apply.
+*/
+      template <typename index, typename Storage>
+      void runSieveStealing(Storage &bits)
+      {
+          const index q = (index) isqrt(Size);
+          const index last = (index) (Size >> 1);
+          const uint64_t tasks = (q + 1) / 6 + 1;
+
+          work_stealing_scheduler scheduler(Pool);
+          scheduler.forEach(tasks, 1, [&](unsigned worker, uint64_t begin, uint64_t end)
+          {
+              for (uint64_t task = begin; task < end; task++)
+              {
+                  for (index factor = (index) (6 * task - 1); task && factor <= 6 * task + 1 && factor <= q; factor += 2)
+                      if (!presieved(factor) && candidate(bits, factor >> 1))
+                      {
+                          if (!proceed(worker, factor))
+                              return;                           /* What's left of this run is skipped too */
+                          strike<index>(bits, (factor * factor) >> 1, factor, last);
+                      }
+              }
+          });
+      }
+
+      // countPrimes
+      //
+      // Can be called after runSieve to determine how many primes were found in total.  Counted with popcount,
+      // eight bytes or 64 bits at a time (one is never set), and kept, so validating and printing don't count again.
+
+      size_t countPrimes() const
+      {
+          if (!Counted)
+          {
+              Count = (Size >= 2);                      // Count 2 as prime if within range
+              Count += isAtomic() ? AtomicBits.count() : popcountBytes(Bits.data(), Bits.size());
+              Counted = true;
+          }
+          return Count;
+      }
+
+      // isPrime 
+      // 
+      // Can be called after runSieve to determine whether a given number is prime. 
+
+      bool isPrime(uint64_t n) const
+      {
+          if (n & 1)
+              return test(n >> 1);
+          else
+              return false;
+      }
+
+      // validateResults
+      //
+      // Checks to see if the number of primes found matches what we should expect, from the table in prime_counts.h.
+      // This data isn't used in the sieve processing at all, only to sanity check that the results are right when done.
+
+      bool validateResults() const
+      {
+          uint64_t expected = 0;
+          return knownPrimeCount(Size, expected) && expected == countPrimes();
+      }
+
+      // printResults
+      //
+      // Displays stats about what was found as well as (optionally) the primes themselves, and the hardware counters
+      // of each thread over the timed passes when there are some
+
+      void printResults(bool showResults, double duration, double passes, size_t threads,
+                        const vector<perf_sample> *counters = nullptr) const
+      {
+          size_t count = (Size >= 2);                   // Count 2 as prime if in range
+          if (showResults)
+          {
+              prime_writer out(stdout);
+              out.write(2);
+              for (uint64_t num = 1; num < (Size >> 1); ++num)
+              {
+                  if (test(num))
+                  {
+                      out.write(2 * num + 1);
+                      count++;
+                  }
+              }
+          }
+          else
+          {
+              count = countPrimes();                    // Nothing to list, so no second scan to check it by
+          }
+          
+          cout << "Passes: "  << passes << ", "
+               << "Threads: " << threads << ", "
+               << "Time: "    << duration << ", " 
+               << "Average: " << duration/passes << ", "
+               << "Limit: "   << Size << ", "
+               << "Counts: "  << count << "/" << countPrimes() << ", "
+               << "Valid : "  << (validateResults() ? "Pass" : "FAIL!") << ", "
+               << "Engine: "  << engineName(Engine) << ", "
+               << "Buffers: " << (Reuse ? "reused" : "fresh")
+               << "\n";
+
+          if (counters)
+              printCounters(*counters, passes);
+      }
+};
+
+} // namespace threaded
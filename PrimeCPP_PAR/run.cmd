@@ -1,2 +1,2 @@
-gcc -Ofast PrimeCPP_PAR.cpp -std=c++14 -lstdc++ -oPrimes_par_gcc.exe
+gcc -Ofast PrimeCPP_PAR.cpp -std=c++17 -lstdc++ -oPrimes_par_gcc.exe
 .\Primes_par_gcc.exe
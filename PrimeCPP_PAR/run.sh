@@ -4,3 +4,24 @@
 
 clang++ -pthread -Ofast -std=c++17 PrimeCPP_PAR.cpp -oprimes_par.exe
 ./primes_par.exe
+
+# Every engine of PrimeCPP, PrimeCPP_PAR and PrimeCPP_Threaded, with latency stats and optional CSV/JSON output
+# clang++ -pthread -Ofast -std=c++17 PrimeCPP_Bench.cpp -oprimes_bench.exe
+# ./primes_bench.exe -l 1000000,10000000 -t 1,8 -c results.csv
+# ./primes_bench.exe -Q 1000000 -l 1000000,1000000000
+
+# Sharded across nodes: a worker on each, then a coordinator checking pi(10^9) .. pi(10^12) as the shards come back
+# ./primes_par.exe --worker 5500
+# ./primes_par.exe --coordinate node1:5500,node1:5500,node2:5500,local -l 1000000000000
+
+# Growing one sieve through several limits, checking the count and the count index at each
+# ./primes_par.exe --extend 1000000,10000000,100000000 -e all
+
+# As a query service: queries on stdin, answered in order, overlapping ones sharing cached segments
+# printf 'count 0 1000000000\nnth 1000000\nisprime 1000000007\nrange 1000000000 1000000100\n' | ./primes_par.exe --serve -t 8
+
+# Per-stage timings (init, crossing off, counting, enumeration, isPrime batches) against the stored baselines, failing
+# on a significant slowdown; -R records new ones.  The CMake build at the top of the tree has them as make benchmark.
+# clang++ -pthread -Ofast -std=c++17 PrimeCPP_Regress.cpp -oprimes_regress.exe
+# ./primes_regress.exe -b baselines/reference.csv
+# ./primes_regress.exe -r 15 -R baselines/reference.csv